@@ -4,6 +4,7 @@
 #include "stocks.h"
 #include "camera.h"
 #include "embark.h"
+#include "map_query.h"
 
 #include "modules/Gui.h"
 #include "modules/Maps.h"
@@ -32,7 +33,10 @@
 #include "df/viewscreen_topicmeetingst.h"
 #include "df/world.h"
 
+#include <chrono>
+#include <memory>
 #include <sstream>
+#include <unordered_map>
 
 REQUIRE_GLOBAL(announcements);
 REQUIRE_GLOBAL(cur_year);
@@ -53,6 +57,7 @@ AI::AI() :
     status_onupdate(nullptr),
     pause_onupdate(nullptr),
     tag_enemies_onupdate(nullptr),
+    profile_onupdate(nullptr),
     seen_cvname(),
     last_good_x(-1),
     last_good_y(-1),
@@ -72,6 +77,73 @@ AI::~AI()
     delete pop;
     logger.close();
     events.clear();
+    jobs_changed();
+    MapQuery::clear();
+}
+
+// rebuilt on the first query of each AI step, and after the AI itself adds
+// or removes jobs
+static bool jobs_valid = false;
+static std::vector<std::vector<df::job *>> jobs_type;
+static std::unordered_map<uint64_t, std::vector<df::job *>> jobs_pos;
+static const std::vector<df::job *> no_jobs;
+
+static uint64_t job_pos_key(df::coord pos)
+{
+    return uint64_t(uint16_t(pos.x)) | uint64_t(uint16_t(pos.y)) << 16 | uint64_t(uint16_t(pos.z)) << 32;
+}
+
+static void index_jobs()
+{
+    if (jobs_valid)
+    {
+        return;
+    }
+    jobs_valid = true;
+
+    // keep the per-type vectors around, they are filled again next tick
+    jobs_type.resize(df::enum_traits<df::job_type>::last_item_value + 1);
+    for (auto it = jobs_type.begin(); it != jobs_type.end(); it++)
+    {
+        it->clear();
+    }
+    jobs_pos.clear();
+
+    for (auto j = world->job_list.next; j; j = j->next)
+    {
+        df::job *job = j->item;
+        if (job->job_type >= 0 && size_t(job->job_type) < jobs_type.size())
+        {
+            jobs_type[job->job_type].push_back(job);
+        }
+        jobs_pos[job_pos_key(job->pos)].push_back(job);
+    }
+}
+
+const std::vector<df::job *> & AI::jobs_by_type(df::job_type type)
+{
+    index_jobs();
+    if (type < 0 || size_t(type) >= jobs_type.size())
+    {
+        return no_jobs;
+    }
+    return jobs_type[type];
+}
+
+const std::vector<df::job *> & AI::jobs_at(df::coord pos)
+{
+    index_jobs();
+    auto it = jobs_pos.find(job_pos_key(pos));
+    if (it == jobs_pos.end())
+    {
+        return no_jobs;
+    }
+    return it->second;
+}
+
+void AI::jobs_changed()
+{
+    jobs_valid = false;
 }
 
 std::string AI::timestamp(int32_t y, int32_t t)
@@ -190,6 +262,8 @@ bool AI::feed_key(df::viewscreen *view, df::interface_key key)
     keys.clear();
     keys.insert(key);
     view->feed(&keys);
+    // the key may have cancelled or removed jobs
+    jobs_changed();
     return !keys.count(key);
 }
 
@@ -253,6 +327,12 @@ void AI::debug(color_ostream & out, const std::string & str)
     write_df(logger, ts + " " + str, "\n                 ");
 }
 
+void AI::log_profile()
+{
+    logger << timestamp() << " callback profile:" << std::endl;
+    events.profile_dump(logger);
+}
+
 void AI::event(const std::string & name, const Json::Value & payload)
 {
     if (!eventsJson.is_open())
@@ -574,34 +654,51 @@ bool AI::tag_enemies(color_ostream & out)
     return found;
 }
 
-void AI::timeout_sameview(std::time_t delay, std::function<void(color_ostream &)> cb)
+void AI::timeout_sameview(int32_t delay_ms, std::function<void(color_ostream &)> cb)
 {
     virtual_identity *curscreen = virtual_identity::get(Gui::getCurViewscreen(true));
-    std::time_t timeoff = std::time(nullptr) + delay;
+    // cleared when the view changes or the timeout fires
+    std::shared_ptr<bool> sameview = std::make_shared<bool>(true);
+    // the view change watcher, until it unregisters itself or the timeout
+    // fires and unregisters it
+    std::shared_ptr<OnstatechangeCallback *> watcher = std::make_shared<OnstatechangeCallback *>(nullptr);
 
-    events.onupdate_register_once(std::string("timeout_sameview on ") + curscreen->getName(), [this, curscreen, timeoff, cb](color_ostream & out) -> bool
+    *watcher = events.onstatechange_register_once([this, curscreen, sameview, watcher](color_ostream &, state_change_event st) -> bool
             {
+                if (st != SC_VIEWSCREEN_CHANGED)
+                {
+                    return false;
+                }
+                if (auto view = strict_virtual_cast<df::viewscreen_movieplayerst>(Gui::getCurViewscreen(true)))
+                {
+                    Screen::dismiss(view);
+                    camera->check_record_status();
+                    return false;
+                }
                 if (virtual_identity::get(Gui::getCurViewscreen(true)) != curscreen)
                 {
-                    if (auto view = strict_virtual_cast<df::viewscreen_movieplayerst>(Gui::getCurViewscreen(true)))
-                    {
-                        Screen::dismiss(view);
-                        camera->check_record_status();
-                        return false;
-                    }
+                    *sameview = false;
+                    *watcher = nullptr;
                     return true;
                 }
+                return false;
+            });
 
-                if (std::time(nullptr) >= timeoff)
+    events.ontimeout_register(std::string("timeout_sameview on ") + curscreen->getName(), delay_ms, [curscreen, sameview, watcher, cb](color_ostream & out)
+            {
+                if (*watcher)
+                {
+                    events.onstatechange_unregister(*watcher);
+                }
+                if (*sameview && virtual_identity::get(Gui::getCurViewscreen(true)) == curscreen)
                 {
                     cb(out);
-                    return true;
                 }
-                return false;
+                *sameview = false;
             });
 }
 
-static std::time_t last_unpause;
+static std::chrono::steady_clock::time_point last_unpause;
 
 command_result AI::onupdate_register(color_ostream & out)
 {
@@ -619,7 +716,7 @@ command_result AI::onupdate_register(color_ostream & out)
     if (res == CR_OK)
     {
         status_onupdate = events.onupdate_register("df-ai status", 3*28*1200, 3*28*1200, [this](color_ostream & out) { debug(out, status()); });
-        last_unpause = std::time(nullptr);
+        last_unpause = std::chrono::steady_clock::now();
         pause_onupdate = events.onupdate_register_once("df-ai unpause", [this](color_ostream &) -> bool
                 {
                     if (!*pause_state && world->status.popups.empty())
@@ -628,16 +725,20 @@ command_result AI::onupdate_register(color_ostream & out)
                         return false;
                     }
 
-                    if (std::time(nullptr) < last_unpause + 11)
+                    if (std::chrono::steady_clock::now() < last_unpause + std::chrono::milliseconds(11000))
                     {
                         return false;
                     }
 
-                    timeout_sameview(10, [](color_ostream &) { AI::unpause(); });
-                    last_unpause = std::time(nullptr);
+                    timeout_sameview(10000, [](color_ostream &) { AI::unpause(); });
+                    last_unpause = std::chrono::steady_clock::now();
                     return false;
                 });
         tag_enemies_onupdate = events.onupdate_register("df-ai tag_enemies", 7*1200, 7*1200, [this](color_ostream & out) { tag_enemies(out); });
+        if (config.profile_log_interval > 0)
+        {
+            profile_onupdate = events.onupdate_register("df-ai profile", config.profile_log_interval, config.profile_log_interval, [this](color_ostream &) { log_profile(); });
+        }
         events.onstatechange_register_once([this](color_ostream & out, state_change_event st) -> bool
                 {
                     if (st == SC_WORLD_UNLOADED)
@@ -671,6 +772,7 @@ command_result AI::onupdate_unregister(color_ostream & out)
         events.onupdate_unregister(status_onupdate);
         events.onupdate_unregister(pause_onupdate);
         events.onupdate_unregister(tag_enemies_onupdate);
+        events.onupdate_unregister(profile_onupdate);
     }
     return res;
 }
@@ -11,6 +11,7 @@
 
 #include "df/coord.h"
 #include "df/interface_key.h"
+#include "df/job_type.h"
 #include "df/language_name.h"
 
 #include "jsoncpp.h"
@@ -49,6 +50,7 @@ public:
     OnupdateCallback *status_onupdate;
     OnupdateCallback *pause_onupdate;
     OnupdateCallback *tag_enemies_onupdate;
+    OnupdateCallback *profile_onupdate;
     std::set<std::string> seen_cvname;
     int32_t last_good_x, last_good_y, last_good_z;
     bool skip_persist;
@@ -74,6 +76,12 @@ public:
 
     static bool is_dwarfmode_viewscreen();
 
+    // world->job_list, indexed at most once per AI step when first asked
+    static const std::vector<df::job *> & jobs_by_type(df::job_type type);
+    static const std::vector<df::job *> & jobs_at(df::coord pos);
+    // call after anything that may add or remove jobs
+    static void jobs_changed();
+
     static void write_df(std::ostream & out, const std::string & str, const std::string & newline = "\n", const std::string & suffix = "\n", std::function<std::string(const std::string &)> translate = DF2UTF);
 
     void debug(color_ostream & out, const std::string & str, df::coord announce);
@@ -81,6 +89,8 @@ public:
 
     void event(const std::string & name, const Json::Value & payload);
 
+    void log_profile();
+
     command_result startup(color_ostream & out);
 
     static void unpause();
@@ -89,10 +99,10 @@ public:
     static void abandon(color_ostream & out);
     bool tag_enemies(color_ostream & out);
 
-    void timeout_sameview(std::time_t delay, std::function<void(color_ostream &)> cb);
+    void timeout_sameview(int32_t delay_ms, std::function<void(color_ostream &)> cb);
     void timeout_sameview(std::function<void(color_ostream &)> cb)
     {
-        timeout_sameview(5, cb);
+        timeout_sameview(5000, cb);
     }
 
     command_result onupdate_register(color_ostream & out);
@@ -18,7 +18,11 @@ Config::Config() :
     embark_options(),
     world_size(1),
     camera(true),
-    fps_meter(true)
+    fps_meter(true),
+    profile_log_interval(0),
+    frame_budget_us(1000),
+    census_full_interval(8),
+    manager_orders_ui(false)
 {
     for (int32_t i = 0; i < embark_options_count; i++)
     {
@@ -84,6 +88,22 @@ void Config::load(color_ostream & out)
             {
                 fps_meter = v["fps_meter"].asBool();
             }
+            if (v.isMember("profile_log_interval"))
+            {
+                profile_log_interval = std::max(int32_t(v["profile_log_interval"].asInt()), 0);
+            }
+            if (v.isMember("frame_budget_us"))
+            {
+                frame_budget_us = std::max(int32_t(v["frame_budget_us"].asInt()), 0);
+            }
+            if (v.isMember("census_full_interval"))
+            {
+                census_full_interval = std::max(int32_t(v["census_full_interval"].asInt()), 0);
+            }
+            if (v.isMember("manager_orders_ui"))
+            {
+                manager_orders_ui = v["manager_orders_ui"].asBool();
+            }
         }
         catch (Json::Exception & ex)
         {
@@ -111,6 +131,10 @@ void Config::save(color_ostream & out)
     v["world_size"] = Json::Int(world_size);
     v["camera"] = camera;
     v["fps_meter"] = fps_meter;
+    v["profile_log_interval"] = Json::Int(profile_log_interval);
+    v["frame_budget_us"] = Json::Int(frame_budget_us);
+    v["census_full_interval"] = Json::Int(census_full_interval);
+    v["manager_orders_ui"] = manager_orders_ui;
 
     std::ofstream f(config_name, std::ofstream::trunc);
     f << v;
@@ -22,6 +22,10 @@ struct Config
     int32_t world_size;
     bool camera;
     bool fps_meter;
+    int32_t profile_log_interval;
+    int32_t frame_budget_us;
+    int32_t census_full_interval;
+    bool manager_orders_ui;
 };
 
 extern Config config;
@@ -2,6 +2,7 @@
 
 #include "ai.h"
 #include "event_manager.h"
+#include "plan.h"
 
 #include <fstream>
 
@@ -92,6 +93,15 @@ DFhackCExport command_result plugin_init(color_ostream & out, std::vector<Plugin
         "  Shows a more detailed status report.\n"
         "ai enable events\n"
         "  Write events in JSON format to df-ai-events.json\n"
+        "ai plan export\n"
+        "  Writes the fort plan in JSON format to df-ai-plan.json. A JSON plan\n"
+        "  renamed to df-ai-plan.dat in the save folder is loaded as well.\n"
+        "ai profile\n"
+        "  Shows the time spent in each AI callback, in microseconds.\n"
+        "ai profile reset\n"
+        "  Clears the callback timings.\n"
+        "ai profile dump\n"
+        "  Writes the callback timings to df-ai.log.\n"
     ));
     return CR_OK;
 }
@@ -143,6 +153,36 @@ command_result ai_command(color_ostream & out, std::vector<std::string> & args)
         return CR_OK;
     }
 
+    if (args.size() == 2 && args[0] == "plan" && args[1] == "export")
+    {
+        std::ofstream f("df-ai-plan.json", std::ofstream::trunc);
+        dwarfAI->plan->save_json(f);
+        out << "plan written to df-ai-plan.json" << std::endl;
+        return CR_OK;
+    }
+
+    if (args.size() == 1 && args[0] == "profile")
+    {
+        events.profile_dump(out);
+        return CR_OK;
+    }
+
+    if (args.size() == 2 && args[0] == "profile")
+    {
+        if (args[1] == "reset")
+        {
+            events.profile_reset();
+            out << "callback profile reset" << std::endl;
+            return CR_OK;
+        }
+        if (args[1] == "dump")
+        {
+            dwarfAI->log_profile();
+            out << "callback profile written to df-ai.log" << std::endl;
+            return CR_OK;
+        }
+    }
+
     if (args.size() == 2 && (args[0] == "enable" || args[0] == "disable"))
     {
         bool enable = args[0] == "enable";
@@ -198,6 +238,9 @@ DFhackCExport command_result plugin_onupdate(color_ostream & out)
             return res;
     }
 
+    // the game may have added or removed jobs since the last step, paused
+    // or not
+    AI::jobs_changed();
     events.onupdate(out);
     return CR_OK;
 }
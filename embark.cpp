@@ -81,7 +81,7 @@ void Embark::register_restart_timer(color_ostream & out)
             full_reset_requested = true;
             return true;
         };
-        ai->timeout_sameview(60, [this, restart_wait](color_ostream & out)
+        ai->timeout_sameview(60000, [this, restart_wait](color_ostream & out)
                 {
                     ai->debug(out, "restarting.");
                     AI::feed_key(interface_key::LEAVESCREEN);
@@ -312,7 +312,7 @@ bool Embark::update(color_ostream & out)
 
                 selected_embark = true;
 
-                ai->timeout_sameview(15, [](color_ostream &)
+                ai->timeout_sameview(15000, [](color_ostream &)
                         {
                             df::viewscreen *view = Gui::getCurViewscreen(true);
                             AI::feed_key(view, interface_key::SETUP_EMBARK);
@@ -1,4 +1,7 @@
 #include "event_manager.h"
+#include "config.h"
+
+#include <chrono>
 
 REQUIRE_GLOBAL(cur_year);
 REQUIRE_GLOBAL(cur_year_tick);
@@ -11,7 +14,11 @@ OnupdateCallback::OnupdateCallback(std::string descr, std::function<bool(color_o
     minyear(0),
     minyeartick(0),
     description(descr),
-    hasTickLimit(false)
+    hasTickLimit(false),
+    budgeted(false),
+    heap_index(-1),
+    heap_seq(0),
+    profile(nullptr)
 {
 }
 
@@ -21,10 +28,64 @@ OnupdateCallback::OnupdateCallback(std::string descr, std::function<bool(color_o
     minyear(*cur_year),
     minyeartick(*cur_year_tick + initdelay),
     description(descr),
-    hasTickLimit(true)
+    hasTickLimit(true),
+    budgeted(false),
+    heap_index(-1),
+    heap_seq(0),
+    profile(nullptr)
 {
 }
 
+OnupdateProfile::OnupdateProfile() :
+    count(0),
+    total_us(0),
+    max_us(0),
+    buckets(),
+    starved(0)
+{
+}
+
+void OnupdateProfile::add(uint64_t us)
+{
+    count++;
+    total_us += us;
+    if (max_us < us)
+        max_us = us;
+
+    size_t b = 0;
+    while (us && b < buckets_count - 1)
+    {
+        us >>= 1;
+        b++;
+    }
+    buckets[b]++;
+}
+
+// upper bound of the bucket holding the p-th percentile call
+uint64_t OnupdateProfile::percentile(double p) const
+{
+    if (!count)
+        return 0;
+
+    uint64_t rank = uint64_t(p * double(count - 1));
+    uint64_t seen = 0;
+    for (size_t b = 0; b < buckets_count; b++)
+    {
+        seen += buckets[b];
+        if (seen > rank)
+        {
+            uint64_t bound = b ? (uint64_t(1) << b) - 1 : 0;
+            return bound < max_us ? bound : max_us;
+        }
+    }
+    return max_us;
+}
+
+void OnupdateProfile::reset()
+{
+    *this = OnupdateProfile();
+}
+
 const int32_t yearlen = 12 * 28 * 1200;
 
 bool OnupdateCallback::check_run(color_ostream & out, int32_t year, int32_t yeartick)
@@ -52,6 +113,14 @@ bool OnupdateCallback::check_run(color_ostream & out, int32_t year, int32_t year
     return true;
 }
 
+OntimeoutCallback::OntimeoutCallback(std::string descr, std::function<void(color_ostream &)> cb, int32_t delay_ms) :
+    callback(cb),
+    deadline(std::chrono::steady_clock::now() + std::chrono::milliseconds(delay_ms)),
+    description(descr),
+    seq(0)
+{
+}
+
 OnstatechangeCallback::OnstatechangeCallback(std::function<bool(color_ostream &, state_change_event)> cb) :
     cb(cb)
 {
@@ -59,7 +128,15 @@ OnstatechangeCallback::OnstatechangeCallback(std::function<bool(color_ostream &,
 
 EventManager::EventManager() :
     onupdate_list(),
-    onstatechange_list()
+    onupdate_due(),
+    onupdate_seq(0),
+    onupdate_profile(),
+    onupdate_post_mutex(),
+    onupdate_post_list(),
+    ontimeout_list(),
+    ontimeout_seq(0),
+    onstatechange_list(),
+    onstatechange_due()
 {
 }
 
@@ -74,11 +151,27 @@ void EventManager::clear()
         delete *it;
     }
     onupdate_list.clear();
+    // we may be called from within a callback, leave the slots for onupdate
+    for (auto it = onupdate_due.begin(); it != onupdate_due.end(); it++)
+    {
+        delete *it;
+        *it = nullptr;
+    }
+    {
+        std::lock_guard<std::mutex> lock(onupdate_post_mutex);
+        onupdate_post_list.clear();
+    }
+    for (auto it = ontimeout_list.begin(); it != ontimeout_list.end(); it++)
+    {
+        delete *it;
+    }
+    ontimeout_list.clear();
     for (auto it = onstatechange_list.begin(); it != onstatechange_list.end(); it++)
     {
         delete *it;
     }
     onstatechange_list.clear();
+    std::fill(onstatechange_due.begin(), onstatechange_due.end(), static_cast<OnstatechangeCallback *>(nullptr));
 }
 
 static bool update_cmp(OnupdateCallback *a, OnupdateCallback *b)
@@ -87,48 +180,159 @@ static bool update_cmp(OnupdateCallback *a, OnupdateCallback *b)
         return true;
     if (a->minyear > b->minyear)
         return false;
-    return a->minyeartick < b->minyeartick;
+    if (a->minyeartick < b->minyeartick)
+        return true;
+    if (a->minyeartick > b->minyeartick)
+        return false;
+    return a->heap_seq < b->heap_seq;
+}
+
+void EventManager::onupdate_sift_up(size_t i)
+{
+    OnupdateCallback *h = onupdate_list[i];
+    while (i > 0)
+    {
+        size_t parent = (i - 1) / 2;
+        if (!update_cmp(h, onupdate_list[parent]))
+            break;
+        onupdate_list[i] = onupdate_list[parent];
+        onupdate_list[i]->heap_index = int32_t(i);
+        i = parent;
+    }
+    onupdate_list[i] = h;
+    h->heap_index = int32_t(i);
+}
+
+void EventManager::onupdate_sift_down(size_t i)
+{
+    OnupdateCallback *h = onupdate_list[i];
+    size_t n = onupdate_list.size();
+    for (;;)
+    {
+        size_t child = 2 * i + 1;
+        if (child >= n)
+            break;
+        if (child + 1 < n && update_cmp(onupdate_list[child + 1], onupdate_list[child]))
+            child++;
+        if (!update_cmp(onupdate_list[child], h))
+            break;
+        onupdate_list[i] = onupdate_list[child];
+        onupdate_list[i]->heap_index = int32_t(i);
+        i = child;
+    }
+    onupdate_list[i] = h;
+    h->heap_index = int32_t(i);
+}
+
+OnupdateCallback *EventManager::onupdate_add(OnupdateCallback *h)
+{
+    h->heap_seq = onupdate_seq++;
+    h->profile = &onupdate_profile[h->description];
+    onupdate_push(h);
+    return h;
+}
+
+void EventManager::onupdate_push(OnupdateCallback *h)
+{
+    onupdate_list.push_back(h);
+    onupdate_sift_up(onupdate_list.size() - 1);
+}
+
+void EventManager::onupdate_remove(OnupdateCallback *h)
+{
+    size_t i = size_t(h->heap_index);
+    h->heap_index = -1;
+    OnupdateCallback *last = onupdate_list.back();
+    onupdate_list.pop_back();
+    if (last == h)
+        return;
+    onupdate_list[i] = last;
+    last->heap_index = int32_t(i);
+    if (i > 0 && update_cmp(last, onupdate_list[(i - 1) / 2]))
+        onupdate_sift_up(i);
+    else
+        onupdate_sift_down(i);
 }
 
 OnupdateCallback *EventManager::onupdate_register(std::string descr, int32_t ticklimit, int32_t initialtickdelay, std::function<void(color_ostream &)> b)
 {
     OnupdateCallback *h = new OnupdateCallback(descr, [b](color_ostream & out) -> bool { b(out); return false; }, ticklimit, initialtickdelay);
-    onupdate_list.push_back(h);
-    std::sort(onupdate_list.begin(), onupdate_list.end(), update_cmp);
-    return h;
+    return onupdate_add(h);
 }
 
 OnupdateCallback *EventManager::onupdate_register_once(std::string descr, std::function<bool(color_ostream &)> b)
 {
     OnupdateCallback *h = new OnupdateCallback(descr, b);
-    onupdate_list.push_back(h);
-    std::sort(onupdate_list.begin(), onupdate_list.end(), update_cmp);
-    return h;
+    return onupdate_add(h);
 }
 
 OnupdateCallback *EventManager::onupdate_register_once(std::string descr, int32_t ticklimit, std::function<bool(color_ostream &)> b)
 {
     OnupdateCallback *h = new OnupdateCallback(descr, b, ticklimit, ticklimit);
-    onupdate_list.push_back(h);
-    std::sort(onupdate_list.begin(), onupdate_list.end(), update_cmp);
-    return h;
+    return onupdate_add(h);
 }
 
 OnupdateCallback *EventManager::onupdate_register_once(std::string descr, int32_t ticklimit, int32_t initialtickdelay, std::function<bool(color_ostream &)> b)
 {
     OnupdateCallback *h = new OnupdateCallback(descr, b, ticklimit, initialtickdelay);
-    onupdate_list.push_back(h);
-    std::sort(onupdate_list.begin(), onupdate_list.end(), update_cmp);
-    return h;
+    return onupdate_add(h);
+}
+
+OnupdateCallback *EventManager::onupdate_register_budgeted(std::string descr, int32_t ticklimit, std::function<bool(color_ostream &)> b)
+{
+    OnupdateCallback *h = new OnupdateCallback(descr, b, ticklimit, ticklimit);
+    h->budgeted = true;
+    return onupdate_add(h);
+}
+
+OnupdateCallback *EventManager::onupdate_register_budgeted(std::string descr, std::function<bool(color_ostream &)> b)
+{
+    OnupdateCallback *h = new OnupdateCallback(descr, b);
+    h->budgeted = true;
+    return onupdate_add(h);
 }
 
 void EventManager::onupdate_unregister(OnupdateCallback *&b)
 {
-    onupdate_list.erase(std::remove(onupdate_list.begin(), onupdate_list.end(), b), onupdate_list.end());
+    if (!b)
+    {
+        return;
+    }
+    if (b->heap_index >= 0)
+    {
+        onupdate_remove(b);
+    }
+    else
+    {
+        // popped for the current frame, make sure onupdate skips it
+        std::replace(onupdate_due.begin(), onupdate_due.end(), b, static_cast<OnupdateCallback *>(nullptr));
+    }
     delete b;
     b = nullptr;
 }
 
+void EventManager::onupdate_post(std::function<void(color_ostream &)> b)
+{
+    std::lock_guard<std::mutex> lock(onupdate_post_mutex);
+    onupdate_post_list.push_back(b);
+}
+
+static bool timeout_cmp(OntimeoutCallback *a, OntimeoutCallback *b)
+{
+    // std::push_heap builds a max-heap, so this is reversed
+    if (a->deadline != b->deadline)
+        return a->deadline > b->deadline;
+    return a->seq > b->seq;
+}
+
+void EventManager::ontimeout_register(std::string descr, int32_t delay_ms, std::function<void(color_ostream &)> b)
+{
+    OntimeoutCallback *h = new OntimeoutCallback(descr, b, delay_ms);
+    h->seq = ontimeout_seq++;
+    ontimeout_list.push_back(h);
+    std::push_heap(ontimeout_list.begin(), ontimeout_list.end(), timeout_cmp);
+}
+
 OnstatechangeCallback *EventManager::onstatechange_register(std::function<void(color_ostream &, state_change_event)> b)
 {
     OnstatechangeCallback *h = new OnstatechangeCallback([b](color_ostream & out, state_change_event event) -> bool { b(out, event); return false; });
@@ -146,37 +350,158 @@ OnstatechangeCallback *EventManager::onstatechange_register_once(std::function<b
 void EventManager::onstatechange_unregister(OnstatechangeCallback *&b)
 {
     onstatechange_list.erase(std::remove(onstatechange_list.begin(), onstatechange_list.end(), b), onstatechange_list.end());
+    std::replace(onstatechange_due.begin(), onstatechange_due.end(), b, static_cast<OnstatechangeCallback *>(nullptr));
     delete b;
     b = nullptr;
 }
 
 void EventManager::onupdate(color_ostream & out)
 {
-    // make a copy
-    std::vector<OnupdateCallback *> list = onupdate_list;
+    int32_t year = *cur_year;
+    int32_t yeartick = *cur_year_tick;
 
-    for (auto it = list.begin(); it != list.end(); it++)
+    std::vector<std::function<void(color_ostream &)>> posted;
     {
-        if (!(*it)->check_run(out, *cur_year, *cur_year_tick))
+        std::lock_guard<std::mutex> lock(onupdate_post_mutex);
+        posted.swap(onupdate_post_list);
+    }
+    for (auto it = posted.begin(); it != posted.end(); it++)
+    {
+        (*it)(out);
+    }
+
+    // pop everything that is due, in order. callbacks registered while
+    // running this batch wait for the next frame.
+    while (!onupdate_list.empty())
+    {
+        OnupdateCallback *h = onupdate_list.front();
+        if (h->hasTickLimit && (year < h->minyear || (year == h->minyear && yeartick < h->minyeartick)))
         {
             break;
         }
+        onupdate_remove(h);
+        onupdate_due.push_back(h);
     }
 
-    std::sort(onupdate_list.begin(), onupdate_list.end(), update_cmp);
+    if (!ontimeout_list.empty())
+    {
+        auto now = std::chrono::steady_clock::now();
+        while (!ontimeout_list.empty() && ontimeout_list.front()->deadline <= now)
+        {
+            std::pop_heap(ontimeout_list.begin(), ontimeout_list.end(), timeout_cmp);
+            OntimeoutCallback *h = ontimeout_list.back();
+            ontimeout_list.pop_back();
+            h->callback(out);
+            delete h;
+        }
+    }
+
+    // shared by the budgeted callbacks, whatever one of them leaves unused
+    // is available to the next
+    int64_t budget_left = config.frame_budget_us;
+
+    for (size_t i = 0; i < onupdate_due.size(); i++)
+    {
+        OnupdateCallback *h = onupdate_due[i];
+        if (!h)
+        {
+            continue;
+        }
+        // check_run may unregister (and delete) the callback, which clears
+        // its slot
+        OnupdateProfile *profile = h->profile;
+        bool budgeted = h->budgeted;
+        auto start = std::chrono::steady_clock::now();
+        h->check_run(out, year, yeartick);
+        auto elapsed = std::chrono::steady_clock::now() - start;
+        int64_t elapsed_us = int64_t(std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count());
+
+        if (budgeted)
+        {
+            // the first step always runs, further steps while time remains
+            while (onupdate_due[i] && elapsed_us < budget_left)
+            {
+                if (h->callback(out))
+                {
+                    onupdate_unregister(h);
+                }
+                elapsed = std::chrono::steady_clock::now() - start;
+                elapsed_us = int64_t(std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count());
+            }
+            if (onupdate_due[i] && config.frame_budget_us > 0)
+            {
+                profile->starved++;
+            }
+            budget_left -= elapsed_us;
+        }
+
+        profile->add(uint64_t(elapsed_us));
+
+        if (onupdate_due[i])
+        {
+            onupdate_due[i] = nullptr;
+            onupdate_push(h);
+        }
+    }
+
+    onupdate_due.clear();
+}
+
+void EventManager::profile_reset()
+{
+    for (auto it = onupdate_profile.begin(); it != onupdate_profile.end(); it++)
+    {
+        it->second.reset();
+    }
+}
+
+void EventManager::profile_dump(std::ostream & out)
+{
+    std::vector<std::pair<std::string, const OnupdateProfile *>> sorted;
+    for (auto it = onupdate_profile.begin(); it != onupdate_profile.end(); it++)
+    {
+        if (it->second.count)
+        {
+            sorted.push_back(std::make_pair(it->first, &it->second));
+        }
+    }
+    std::sort(sorted.begin(), sorted.end(), [](const std::pair<std::string, const OnupdateProfile *> & a, const std::pair<std::string, const OnupdateProfile *> & b) -> bool
+            {
+                return a.second->total_us > b.second->total_us;
+            });
+
+    out << stl_sprintf("%-48s %10s %12s %8s %8s %8s %8s %8s", "callback", "calls", "total us", "avg", "p50", "p99", "max", "starved") << "\n";
+    for (auto it = sorted.begin(); it != sorted.end(); it++)
+    {
+        const OnupdateProfile *p = it->second;
+        out << stl_sprintf("%-48s %10llu %12llu %8llu %8llu %8llu %8llu %8llu",
+                it->first.c_str(),
+                (unsigned long long)p->count,
+                (unsigned long long)p->total_us,
+                (unsigned long long)(p->total_us / p->count),
+                (unsigned long long)p->percentile(0.5),
+                (unsigned long long)p->percentile(0.99),
+                (unsigned long long)p->max_us,
+                (unsigned long long)p->starved) << "\n";
+    }
+    out.flush();
 }
+
 void EventManager::onstatechange(color_ostream & out, state_change_event event)
 {
-    // make a copy
-    std::vector<OnstatechangeCallback *> list = onstatechange_list;
+    // callbacks unregistered while dispatching are cleared from the copy
+    onstatechange_due = onstatechange_list;
 
-    for (auto it = list.begin(); it != list.end(); it++)
+    for (size_t i = 0; i < onstatechange_due.size(); i++)
     {
-        if ((*it)->cb(out, event))
+        OnstatechangeCallback *h = onstatechange_due[i];
+        if (h && h->cb(out, event))
         {
-            onstatechange_unregister(*it);
+            onstatechange_unregister(h);
         }
     }
+
+    onstatechange_due.clear();
 }
 
 // vim: et:sw=4:ts=4
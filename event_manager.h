@@ -2,7 +2,29 @@
 
 #include "dfhack_shared.h"
 
+#include <chrono>
 #include <functional>
+#include <map>
+#include <mutex>
+
+// wall time spent in the callbacks sharing a description
+struct OnupdateProfile
+{
+    // bucket i counts calls that took [2^(i-1), 2^i) microseconds
+    static const size_t buckets_count = 32;
+
+    uint64_t count;
+    uint64_t total_us;
+    uint64_t max_us;
+    uint64_t buckets[buckets_count];
+    // frames a budgeted callback ran out of time before it was done
+    uint64_t starved;
+
+    OnupdateProfile();
+    void add(uint64_t us);
+    uint64_t percentile(double p) const;
+    void reset();
+};
 
 struct OnupdateCallback
 {
@@ -12,6 +34,13 @@ struct OnupdateCallback
     int32_t minyeartick;
     std::string description;
     bool hasTickLimit;
+    // keep calling within the frame budget until the callback is done
+    bool budgeted;
+    // position in EventManager's heap, -1 when not queued
+    int32_t heap_index;
+    // registration order, breaks ties between equal deadlines
+    uint32_t heap_seq;
+    OnupdateProfile *profile;
 
     OnupdateCallback(std::string descr, std::function<bool(color_ostream &)> cb);
     OnupdateCallback(std::string descr, std::function<bool(color_ostream &)> cb, int32_t tl, int32_t initdelay = 0);
@@ -19,6 +48,16 @@ struct OnupdateCallback
     bool check_run(color_ostream & out, int32_t year, int32_t yeartick);
 };
 
+struct OntimeoutCallback
+{
+    std::function<void(color_ostream &)> callback;
+    std::chrono::steady_clock::time_point deadline;
+    std::string description;
+    uint32_t seq;
+
+    OntimeoutCallback(std::string descr, std::function<void(color_ostream &)> cb, int32_t delay_ms);
+};
+
 struct OnstatechangeCallback
 {
     std::function<bool(color_ostream &, state_change_event)> cb;
@@ -35,7 +74,14 @@ public:
     OnupdateCallback *onupdate_register_once(std::string descr, int32_t ticklimit, int32_t initialtickdelay, std::function<bool(color_ostream &)> b);
     OnupdateCallback *onupdate_register_once(std::string descr, int32_t ticklimit, std::function<bool(color_ostream &)> b);
     OnupdateCallback *onupdate_register_once(std::string descr, std::function<bool(color_ostream &)> b);
+    OnupdateCallback *onupdate_register_budgeted(std::string descr, int32_t ticklimit, std::function<bool(color_ostream &)> b);
+    OnupdateCallback *onupdate_register_budgeted(std::string descr, std::function<bool(color_ostream &)> b);
     void onupdate_unregister(OnupdateCallback *&b);
+    // safe to call from any thread, b runs once at the next onupdate
+    void onupdate_post(std::function<void(color_ostream &)> b);
+
+    // run once, delay_ms milliseconds of real time from now
+    void ontimeout_register(std::string descr, int32_t delay_ms, std::function<void(color_ostream &)> b);
 
     OnstatechangeCallback *onstatechange_register(std::function<void(color_ostream &, state_change_event)> b);
     OnstatechangeCallback *onstatechange_register_once(std::function<bool(color_ostream &, state_change_event)> b);
@@ -43,12 +89,33 @@ public:
 
     void onstatechange(color_ostream & out, state_change_event event);
     void onupdate(color_ostream & out);
+
+    void profile_reset();
+    void profile_dump(std::ostream & out);
 protected:
     friend class AI;
     void clear();
 private:
+    OnupdateCallback *onupdate_add(OnupdateCallback *h);
+    void onupdate_push(OnupdateCallback *h);
+    void onupdate_remove(OnupdateCallback *h);
+    void onupdate_sift_up(size_t i);
+    void onupdate_sift_down(size_t i);
+
+    // binary min-heap ordered by (minyear, minyeartick, heap_seq)
     std::vector<OnupdateCallback *> onupdate_list;
+    // callbacks popped from the heap that are due this frame
+    std::vector<OnupdateCallback *> onupdate_due;
+    uint32_t onupdate_seq;
+    std::map<std::string, OnupdateProfile> onupdate_profile;
+    std::mutex onupdate_post_mutex;
+    std::vector<std::function<void(color_ostream &)>> onupdate_post_list;
+    // binary min-heap ordered by (deadline, seq)
+    std::vector<OntimeoutCallback *> ontimeout_list;
+    uint32_t ontimeout_seq;
     std::vector<OnstatechangeCallback *> onstatechange_list;
+    // copy of onstatechange_list being dispatched
+    std::vector<OnstatechangeCallback *> onstatechange_due;
 };
 
 extern EventManager events;
@@ -0,0 +1,116 @@
+#include "map_query.h"
+
+#include <algorithm>
+#include <cstring>
+#include <unordered_map>
+
+#include "modules/Maps.h"
+
+#include "df/map_block.h"
+#include "df/world.h"
+
+REQUIRE_GLOBAL(world);
+
+struct map_query_block
+{
+    // world->frame_counter when last compared to the map
+    int32_t frame;
+    bool present;
+    // tiletypes the tables were built from
+    df::tiletype tiles[16][16];
+    // sums[c][y][x] = tiles of class c in [0, x) * [0, y)
+    uint16_t sums[MapQuery::_shape_class_count][17][17];
+};
+
+static std::unordered_map<uint64_t, map_query_block> query_blocks;
+
+static uint64_t query_block_key(int16_t bx, int16_t by, int16_t z)
+{
+    return uint64_t(uint16_t(bx)) | uint64_t(uint16_t(by)) << 16 | uint64_t(uint16_t(z)) << 32;
+}
+
+static void build_query_block(map_query_block & q, df::map_block *b)
+{
+    std::memcpy(q.tiles, b->tiletype, sizeof(q.tiles));
+    std::memset(q.sums, 0, sizeof(q.sums));
+    for (int16_t y = 0; y < 16; y++)
+    {
+        for (int16_t x = 0; x < 16; x++)
+        {
+            df::tiletype_shape s = ENUM_ATTR(tiletype, shape, b->tiletype[x][y]);
+            df::tiletype_shape_basic sb = ENUM_ATTR(tiletype_shape, basic_shape, s);
+            bool is[MapQuery::_shape_class_count];
+            is[MapQuery::wall] = s == tiletype_shape::WALL;
+            is[MapQuery::open] = sb == tiletype_shape_basic::Open;
+            is[MapQuery::floor] = sb == tiletype_shape_basic::Floor;
+            for (int c = 0; c < MapQuery::_shape_class_count; c++)
+            {
+                q.sums[c][y + 1][x + 1] = uint16_t((is[c] ? 1 : 0) + q.sums[c][y][x + 1] + q.sums[c][y + 1][x] - q.sums[c][y][x]);
+            }
+        }
+    }
+}
+
+static const map_query_block *get_query_block(int16_t bx, int16_t by, int16_t z)
+{
+    map_query_block & q = query_blocks[query_block_key(bx, by, z)];
+    if (q.frame == world->frame_counter && q.present)
+        return &q;
+
+    df::map_block *b = Maps::getBlock(bx, by, z);
+    if (!b)
+    {
+        q.frame = world->frame_counter;
+        q.present = false;
+        return nullptr;
+    }
+    if (!q.present || std::memcmp(q.tiles, b->tiletype, sizeof(q.tiles)))
+    {
+        build_query_block(q, b);
+    }
+    q.frame = world->frame_counter;
+    q.present = true;
+    return &q;
+}
+
+int32_t MapQuery::count(shape_class c, df::coord min, df::coord max)
+{
+    int16_t x0 = std::max<int16_t>(min.x, 0), x1 = std::min<int16_t>(max.x, world->map.x_count - 1);
+    int16_t y0 = std::max<int16_t>(min.y, 0), y1 = std::min<int16_t>(max.y, world->map.y_count - 1);
+    int16_t z0 = std::max<int16_t>(min.z, 0), z1 = std::min<int16_t>(max.z, world->map.z_count - 1);
+
+    int32_t n = 0;
+    for (int16_t z = z0; z <= z1; z++)
+    {
+        for (int16_t by = y0 >> 4; by <= y1 >> 4; by++)
+        {
+            for (int16_t bx = x0 >> 4; bx <= x1 >> 4; bx++)
+            {
+                const map_query_block *q = get_query_block(bx, by, z);
+                if (!q)
+                    continue;
+                int16_t lx0 = std::max<int16_t>(x0 - bx * 16, 0), lx1 = std::min<int16_t>(x1 - bx * 16, 15) + 1;
+                int16_t ly0 = std::max<int16_t>(y0 - by * 16, 0), ly1 = std::min<int16_t>(y1 - by * 16, 15) + 1;
+                n += q->sums[c][ly1][lx1] - q->sums[c][ly0][lx1] - q->sums[c][ly1][lx0] + q->sums[c][ly0][lx0];
+            }
+        }
+    }
+    return n;
+}
+
+bool MapQuery::all(shape_class c, df::coord min, df::coord max)
+{
+    return count(c, min, max) == int32_t(max.x - min.x + 1) * int32_t(max.y - min.y + 1) * int32_t(max.z - min.z + 1);
+}
+
+bool MapQuery::any(shape_class c, df::coord min, df::coord max)
+{
+    return count(c, min, max) != 0;
+}
+
+void MapQuery::clear()
+{
+    query_blocks.clear();
+}
+
+// vim: et:sw=4:ts=4
@@ -0,0 +1,39 @@
+#pragma once
+
+#include "dfhack_shared.h"
+
+#include "df/coord.h"
+
+// counts of tile shapes over boxes of the map, shared by Plan, room and
+// Stocks
+//
+// each 16x16 map block slice keeps a summed-area table per shape class, so a
+// box costs one lookup per block slice it touches. a slice is checked
+// against the map at most once per tick, and its tables are only rebuilt
+// when its tiletypes changed since.
+class MapQuery
+{
+public:
+    enum shape_class
+    {
+        // tiletype_shape::WALL
+        wall,
+        // tiletype_shape_basic::Open
+        open,
+        // tiletype_shape_basic::Floor
+        floor,
+
+        _shape_class_count
+    };
+
+    // number of tiles of the class in the box, min and max included. tiles
+    // outside the map are not counted.
+    static int32_t count(shape_class c, df::coord min, df::coord max);
+    static bool all(shape_class c, df::coord min, df::coord max);
+    static bool any(shape_class c, df::coord min, df::coord max);
+
+    // forget every block, when the map goes away
+    static void clear();
+};
+
+// vim: et:sw=4:ts=4
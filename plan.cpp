@@ -1,11 +1,16 @@
 #include "ai.h"
 #include "camera.h"
+#include "map_query.h"
 #include "plan.h"
 #include "population.h"
 #include "stocks.h"
 
+#include <algorithm>
 #include <cstdio>
+#include <cstring>
+#include <memory>
 #include <sstream>
+#include <type_traits>
 #include <unordered_map>
 #include <fstream>
 
@@ -85,17 +90,154 @@ farm_allowed_materials_t::farm_allowed_materials_t()
 
 farm_allowed_materials_t farm_allowed_materials;
 
+std::ostream & operator <<(std::ostream & stream, task_type::type type)
+{
+    switch (type)
+    {
+        case task_type::checkconstruct:
+            return stream << "checkconstruct";
+        case task_type::checkfurnish:
+            return stream << "checkfurnish";
+        case task_type::checkidle:
+            return stream << "checkidle";
+        case task_type::checkrooms:
+            return stream << "checkrooms";
+        case task_type::construct_activityzone:
+            return stream << "construct_activityzone";
+        case task_type::construct_stockpile:
+            return stream << "construct_stockpile";
+        case task_type::construct_workshop:
+            return stream << "construct_workshop";
+        case task_type::dig_cistern:
+            return stream << "dig_cistern";
+        case task_type::dig_garbage:
+            return stream << "dig_garbage";
+        case task_type::digroom:
+            return stream << "digroom";
+        case task_type::furnish:
+            return stream << "furnish";
+        case task_type::monitor_cistern:
+            return stream << "monitor_cistern";
+        case task_type::setup_farmplot:
+            return stream << "setup_farmplot";
+        case task_type::wantdig:
+            return stream << "wantdig";
+
+        case task_type::_task_type_count:
+            return stream << "???";
+    }
+    return stream << "???";
+}
+
+std::ostream & operator <<(std::ostream & stream, task_priority::priority priority)
+{
+    switch (priority)
+    {
+        case task_priority::urgent:
+            return stream << "urgent";
+        case task_priority::normal:
+            return stream << "normal";
+        case task_priority::low:
+            return stream << "low";
+
+        case task_priority::_task_priority_count:
+            return stream << "???";
+    }
+    return stream << "???";
+}
+
+// which queue each task type goes in, and whether failing to make progress
+// should push the task back (tasks waiting on items or materials) or not
+// (digging and waiting for constructions, buildings or the right screen,
+// which only need time, and the periodic checks).
+static const struct
+{
+    task_priority::priority priority;
+    bool backoff;
+} task_schedule[task_type::_task_type_count] =
+{
+    { task_priority::normal, false }, // checkconstruct
+    { task_priority::low, false }, // checkfurnish
+    { task_priority::normal, false }, // checkidle
+    { task_priority::normal, false }, // checkrooms
+    { task_priority::normal, false }, // construct_activityzone
+    { task_priority::normal, false }, // construct_stockpile
+    { task_priority::normal, true }, // construct_workshop
+    { task_priority::urgent, false }, // dig_cistern
+    { task_priority::normal, false }, // dig_garbage
+    { task_priority::urgent, false }, // digroom
+    { task_priority::low, true }, // furnish
+    { task_priority::urgent, false }, // monitor_cistern
+    { task_priority::normal, false }, // setup_farmplot
+    { task_priority::urgent, false }, // wantdig
+};
+
+// a task that keeps failing is retried after 1, 2, 4, ... bg passes
+static const uint32_t task_backoff_max_passes = 16;
+
+// tasks come and go every few ticks, so they are carved out of blocks and
+// recycled through a free list instead of going through the heap each time.
+union task_slot
+{
+    task_slot *next;
+    std::aligned_storage<sizeof(task), alignof(task)>::type storage;
+};
+static const size_t task_block_size = 256;
+static std::vector<std::unique_ptr<task_slot[]>> task_blocks;
+static task_slot *task_free = nullptr;
+
+void *task::operator new(size_t)
+{
+    if (!task_free)
+    {
+        task_blocks.push_back(std::unique_ptr<task_slot[]>(new task_slot[task_block_size]));
+        task_slot *block = task_blocks.back().get();
+        for (size_t i = task_block_size; i > 0; i--)
+        {
+            block[i - 1].next = task_free;
+            task_free = &block[i - 1];
+        }
+    }
+    task_slot *slot = task_free;
+    task_free = slot->next;
+    return slot;
+}
+
+void task::operator delete(void *ptr)
+{
+    if (!ptr)
+        return;
+    task_slot *slot = static_cast<task_slot *>(ptr);
+    slot->next = task_free;
+    task_free = slot;
+}
+
 Plan::Plan(AI *ai) :
     ai(ai),
     onupdate_handle(nullptr),
     nrdig(0),
+    nrdigging(0),
     tasks(),
-    bg_idx(tasks.end()),
+    bg_idx(),
+    bg_active(false),
+    bg_pass(0),
+    bg_pass_start(0),
+    bg_pass_ticks(0),
+    bg_current(nullptr),
+    task_count(),
+    task_wait(),
     rooms(),
     room_category(),
-    room_by_z(),
+    room_by_block(),
     corridors(),
     cache_nofurnish(),
+    snapshot_id(0),
+    snapshot_rooms(),
+    snapshot_furniture(),
+    dirty_rooms(),
+    dirty_furniture(),
+    dirty_tasks(false),
+    saver(nullptr),
     fort_entrance(nullptr),
     map_veins(),
     important_workshops(),
@@ -110,13 +252,22 @@ Plan::Plan(AI *ai) :
     map_vein_queue(),
     dug_veins(),
     noblesuite(-1),
-    cavern_max_level(-1),
+    cavern_candidates(),
+    caverns_discovered(false),
+    fort_body_z(-1),
     last_idle_year(-1),
     allow_ice(false),
     past_initial_phase(false),
-    cistern_channel_requested(false)
+    cistern_channel_requested(false),
+    surface_columns(),
+    surface_blocks(),
+    block_masks()
 {
-    tasks.push_back(new task("checkrooms"));
+    for (int p = 0; p < task_priority::_task_priority_count; p++)
+    {
+        bg_idx[p] = tasks[p].end();
+    }
+    add_task(task_type::checkrooms);
 
     important_workshops.push_back("Butchers");
     important_workshops.push_back("Quern");
@@ -136,10 +287,8 @@ Plan::Plan(AI *ai) :
 
 Plan::~Plan()
 {
-    for (auto it = tasks.begin(); it != tasks.end(); it++)
-    {
-        delete *it;
-    }
+    persist_wait();
+    clear_tasks();
     for (auto it = rooms.begin(); it != rooms.end(); it++)
     {
         delete *it;
@@ -187,11 +336,19 @@ static bool find_items(df::items_other_id idx, std::vector<df::item *> & items,
 
 command_result Plan::startup(color_ostream & out)
 {
-    std::ifstream persist(("data/save/" + World::ReadWorldFolder() + "/df-ai-plan.dat").c_str());
+    std::ifstream persist(("data/save/" + World::ReadWorldFolder() + "/df-ai-plan.dat").c_str(), std::ifstream::binary);
     if (persist.good())
     {
-        load(persist);
-        return CR_OK;
+        if (load(persist))
+        {
+            std::ifstream journal(("data/save/" + World::ReadWorldFolder() + "/df-ai-plan.journal").c_str(), std::ifstream::binary);
+            if (journal.good())
+            {
+                load_journal(journal);
+            }
+            return CR_OK;
+        }
+        ai->debug(out, "[ERROR] df-ai-plan.dat is damaged, planning the fort again");
     }
 
     command_result res = setup_blueprint(out);
@@ -219,507 +376,257 @@ static bool want_reupdate = false;
 
 void Plan::update(color_ostream &)
 {
-    if (bg_idx != tasks.end())
+    if (bg_active)
         return;
 
-    bg_idx = tasks.begin();
-
-    cache_nofurnish.clear();
-
-    nrdig = 0;
-    for (auto it = tasks.begin(); it != tasks.end(); it++)
+    bg_active = true;
+    bg_pass++;
+    bg_pass_start = world->frame_counter;
+    for (int p = 0; p < task_priority::_task_priority_count; p++)
     {
-        task *t = *it;
-        if (t->type != "digroom")
-            continue;
-        df::coord size = t->r->size();
-        if (t->r->type != room_type::corridor || size.z > 1)
-            nrdig++;
-        if (t->r->type != room_type::corridor && size.x * size.y * size.z >= 10)
-            nrdig++;
+        bg_idx[p] = tasks[p].begin();
     }
 
+    cache_nofurnish.clear();
+
     want_reupdate = false;
-    events.onupdate_register_once("df-ai plan bg", [this](color_ostream & out) -> bool
+    events.onupdate_register_budgeted("df-ai plan bg", [this](color_ostream & out) -> bool
             {
-                if (bg_idx == tasks.end())
+                // take the next task from the most urgent queue that has
+                // any left in this pass
+                int p = 0;
+                while (p < task_priority::_task_priority_count && bg_idx[p] == tasks[p].end())
                 {
+                    p++;
+                }
+                if (p == task_priority::_task_priority_count)
+                {
+                    bg_active = false;
+                    bg_pass_ticks = world->frame_counter - bg_pass_start;
                     if (want_reupdate)
                     {
                         update(out);
                     }
                     return true;
                 }
-                task & t = **bg_idx;
+                task & t = **bg_idx[p];
 
-                bool del = false;
-                if (t.type == "wantdig")
+                if (t.retry_pass > bg_pass)
                 {
-                    if (t.r->is_dug() || nrdig < wantdig_max)
-                    {
-                        digroom(out, t.r);
-                        del = true;
-                    }
-                }
-                else if (t.type == "digroom")
-                {
-                    fixup_open(out, t.r);
-                    if (t.r->is_dug())
-                    {
-                        t.r->status = room_status::dug;
-                        construct_room(out, t.r);
-                        want_reupdate = true; // wantdig asap
-                        del = true;
-                    }
-                }
-                else if (t.type == "construct_workshop")
-                {
-                    del = try_construct_workshop(out, t.r);
-                }
-                else if (t.type == "construct_stockpile")
-                {
-                    del = try_construct_stockpile(out, t.r);
-                }
-                else if (t.type == "construct_activityzone")
-                {
-                    del = try_construct_activityzone(out, t.r);
-                }
-                else if (t.type == "setup_farmplot")
-                {
-                    del = try_setup_farmplot(out, t.r);
-                }
-                else if (t.type == "furnish")
-                {
-                    del = try_furnish(out, t.r, t.f);
-                }
-                else if (t.type == "checkfurnish")
-                {
-                    del = try_endfurnish(out, t.r, t.f);
-                }
-                else if (t.type == "checkconstruct")
-                {
-                    del = try_endconstruct(out, t.r);
-                }
-                else if (t.type == "dig_cistern")
-                {
-                    del = try_digcistern(out, t.r);
-                }
-                else if (t.type == "dig_garbage")
-                {
-                    del = try_diggarbage(out, t.r);
-                }
-                else if (t.type == "checkidle")
-                {
-                    del = checkidle(out);
+                    bg_idx[p]++;
+                    return false;
                 }
-                else if (t.type == "checkrooms")
+                bg_current = &t;
+
+                bool del = false;
+                // still waiting for time to pass, not a failure
+                bool waiting = false;
+                switch (t.type)
                 {
-                    checkrooms(out);
+                    case task_type::wantdig:
+                        if (t.r->is_dug() || nrdig < wantdig_max)
+                        {
+                            digroom(out, t.r);
+                            del = true;
+                        }
+                        break;
+                    case task_type::digroom:
+                        fixup_open(out, t.r);
+                        if (t.r->is_dug())
+                        {
+                            t.r->status = room_status::dug;
+                            dirty(t.r);
+                            construct_room(out, t.r);
+                            want_reupdate = true; // wantdig asap
+                            del = true;
+                        }
+                        break;
+                    case task_type::construct_workshop:
+                        if (!t.r->constructions_done())
+                        {
+                            waiting = true;
+                            break;
+                        }
+                        del = try_construct_workshop(out, t.r);
+                        break;
+                    case task_type::construct_stockpile:
+                        del = try_construct_stockpile(out, t.r);
+                        break;
+                    case task_type::construct_activityzone:
+                        del = try_construct_activityzone(out, t.r);
+                        break;
+                    case task_type::setup_farmplot:
+                        del = try_setup_farmplot(out, t.r);
+                        break;
+                    case task_type::furnish:
+                        del = try_furnish(out, t.r, t.f);
+                        break;
+                    case task_type::checkfurnish:
+                        del = try_endfurnish(out, t.r, t.f);
+                        break;
+                    case task_type::checkconstruct:
+                        del = try_endconstruct(out, t.r);
+                        break;
+                    case task_type::dig_cistern:
+                        del = try_digcistern(out, t.r);
+                        break;
+                    case task_type::dig_garbage:
+                        del = try_diggarbage(out, t.r);
+                        break;
+                    case task_type::checkidle:
+                        del = checkidle(out);
+                        break;
+                    case task_type::checkrooms:
+                        checkrooms(out);
+                        break;
+                    case task_type::monitor_cistern:
+                        monitor_cistern(out);
+                        break;
+                    case task_type::_task_type_count:
+                        break;
                 }
-                else if (t.type == "monitor_cistern")
+
+                if (!bg_current)
                 {
-                    monitor_cistern(out);
+                    // the task was removed while it ran
+                    return false;
                 }
+                bg_current = nullptr;
 
                 if (del)
                 {
-                    delete *bg_idx;
-                    tasks.erase(bg_idx++);
+                    task_wait_stats & wait = task_wait[t.type];
+                    int32_t ticks = world->frame_counter - t.queued;
+                    wait.done++;
+                    wait.total_ticks += ticks;
+                    wait.max_ticks = std::max(wait.max_ticks, ticks);
+                    bg_idx[p] = remove_task(bg_idx[p]);
                 }
                 else
                 {
-                    bg_idx++;
+                    if (task_schedule[t.type].backoff && !waiting)
+                    {
+                        t.fails++;
+                        t.retry_pass = bg_pass + std::min(uint32_t(1) << std::min(t.fails - 1, uint32_t(31)), task_backoff_max_passes);
+                    }
+                    bg_idx[p]++;
                 }
                 return false;
             });
 }
 
-command_result Plan::persist(color_ostream &)
+uint16_t Plan::getTileWalkable(df::coord t)
 {
-    if (corridors.empty())
-    {
-        // we haven't initialized yet.
-        return CR_OK;
-    }
-    std::ofstream f("data/save/current/df-ai-plan.dat", std::ofstream::trunc);
-    save(f);
-    return CR_OK;
+    if (df::map_block *b = Maps::getTileBlock(t))
+        return b->walkable[t.x & 0xf][t.y & 0xf];
+    return 0;
 }
 
-command_result Plan::unpersist(color_ostream &)
+// how much a digroom task counts towards wantdig_max
+static size_t dig_weight(room *r)
 {
-    std::remove("data/save/current/df-ai-plan.dat");
-    std::remove(("data/save/" + World::ReadWorldFolder() + "/df-ai-plan.dat").c_str());
-    return CR_OK;
+    df::coord size = r->size();
+    size_t weight = 0;
+    if (r->type != room_type::corridor || size.z > 1)
+        weight++;
+    if (r->type != room_type::corridor && size.x * size.y * size.z >= 10)
+        weight++;
+    return weight;
 }
 
-void Plan::save(std::ostream & out)
+void Plan::dirty(room *r)
 {
-    std::vector<furniture *> all_furniture;
-    std::vector<room *> all_rooms;
-    std::unordered_map<furniture *, size_t> furniture_index;
-    std::unordered_map<room *, size_t> room_index;
-
-    auto add_furniture = [&all_furniture, &furniture_index](furniture *f)
-    {
-        if (furniture_index.count(f))
-            return;
-        furniture_index[f] = all_furniture.size();
-        all_furniture.push_back(f);
-    };
-
-    auto add_room = [add_furniture, &all_rooms, &room_index](room *r)
-    {
-        if (room_index.count(r))
-            return;
-        room_index[r] = all_rooms.size();
-        all_rooms.push_back(r);
-
-        for (auto it = r->layout.begin(); it != r->layout.end(); it++)
-        {
-            add_furniture(*it);
-        }
-    };
-
-    for (auto it = corridors.begin(); it != corridors.end(); it++)
-    {
-        add_room(*it);
-    }
-    for (auto it = rooms.begin(); it != rooms.end(); it++)
-    {
-        add_room(*it);
-    }
-
-    Json::Value converted_tasks(Json::arrayValue);
-    for (auto it = tasks.begin(); it != tasks.end(); it++)
-    {
-        Json::Value t(Json::objectValue);
-        t["t"] = (*it)->type;
-        if ((*it)->r)
-        {
-            t["r"] = Json::Int(room_index.at((*it)->r));
-        }
-        if ((*it)->f)
-        {
-            t["f"] = Json::Int(furniture_index.at((*it)->f));
-        }
-        converted_tasks.append(t);
-    }
-
-    std::ostringstream stringify;
-
-    Json::Value converted_rooms(Json::arrayValue);
-    for (auto it = all_rooms.begin(); it != all_rooms.end(); it++)
-    {
-        Json::Value r(Json::objectValue);
-        stringify.str(std::string());
-        stringify.clear();
-        stringify << (*it)->status;
-        r["status"] = stringify.str();
-        stringify.str(std::string());
-        stringify.clear();
-        stringify << (*it)->type;
-        r["type"] = stringify.str();
-        r["subtype"] = (*it)->subtype;
-        r["comment"] = (*it)->comment;
-        Json::Value r_min(Json::arrayValue);
-        r_min.append(Json::Int((*it)->min.x));
-        r_min.append(Json::Int((*it)->min.y));
-        r_min.append(Json::Int((*it)->min.z));
-        r["min"] = r_min;
-        Json::Value r_max(Json::arrayValue);
-        r_max.append(Json::Int((*it)->max.x));
-        r_max.append(Json::Int((*it)->max.y));
-        r_max.append(Json::Int((*it)->max.z));
-        r["max"] = r_max;
-        Json::Value r_accesspath(Json::arrayValue);
-        for (auto it_ = (*it)->accesspath.begin(); it_ != (*it)->accesspath.end(); it_++)
-        {
-            r_accesspath.append(Json::Int(room_index.at(*it_)));
-        }
-        r["accesspath"] = r_accesspath;
-        Json::Value r_layout(Json::arrayValue);
-        for (auto it_ = (*it)->layout.begin(); it_ != (*it)->layout.end(); it_++)
-        {
-            r_layout.append(Json::Int(furniture_index.at(*it_)));
-        }
-        r["layout"] = r_layout;
-        r["owner"] = Json::Int((*it)->owner);
-        r["bld_id"] = Json::Int((*it)->bld_id);
-        r["squad_id"] = Json::Int((*it)->squad_id);
-        r["level"] = Json::Int((*it)->level);
-        r["noblesuite"] = Json::Int((*it)->noblesuite);
-        if ((*it)->workshop)
-        {
-            r["workshop"] = Json::Int(room_index.at((*it)->workshop));
-        }
-        Json::Value r_users(Json::arrayValue);
-        for (auto it_ = (*it)->users.begin(); it_ != (*it)->users.end(); it_++)
-        {
-            r_users.append(Json::Int(*it_));
-        }
-        r["users"] = r_users;
-        Json::Value r_channel_enable(Json::arrayValue);
-        r_channel_enable.append(Json::Int((*it)->channel_enable.x));
-        r_channel_enable.append(Json::Int((*it)->channel_enable.y));
-        r_channel_enable.append(Json::Int((*it)->channel_enable.z));
-        r["channel_enable"] = r_channel_enable;
-        Json::Value r_stock_disable(Json::arrayValue);
-        for (auto it_ = (*it)->stock_disable.begin(); it_ != (*it)->stock_disable.end(); it_++)
-        {
-            r_stock_disable.append(ENUM_KEY_STR(stockpile_list, *it_));
-        }
-        r["stock_disable"] = r_stock_disable;
-        r["stock_specific1"] = (*it)->stock_specific1;
-        r["stock_specific2"] = (*it)->stock_specific2;
-        r["has_users"] = (*it)->has_users;
-        r["furnished"] = (*it)->furnished;
-        r["queue_dig"] = (*it)->queue_dig;
-        r["temporary"] = (*it)->temporary;
-        r["outdoor"] = (*it)->outdoor;
-        r["channeled"] = (*it)->channeled;
-        converted_rooms.append(r);
-    }
-
-    Json::Value converted_furniture(Json::arrayValue);
-    for (auto it = all_furniture.begin(); it != all_furniture.end(); it++)
-    {
-        Json::Value f(Json::objectValue);
-        f["item"] = (*it)->item;
-        f["subtype"] = (*it)->subtype;
-        f["construction"] = ENUM_KEY_STR(construction_type, (*it)->construction);
-        f["dig"] = ENUM_KEY_STR(tile_dig_designation, (*it)->dig);
-        f["direction"] = (*it)->direction;
-        f["way"] = (*it)->way;
-        f["bld_id"] = Json::Int((*it)->bld_id);
-        f["x"] = Json::Int((*it)->x);
-        f["y"] = Json::Int((*it)->y);
-        f["z"] = Json::Int((*it)->z);
-        if ((*it)->target)
-        {
-            f["target"] = Json::Int(furniture_index.at((*it)->target));
-        }
-        Json::Value f_users(Json::arrayValue);
-        for (auto it_ = (*it)->users.begin(); it_ != (*it)->users.end(); it_++)
-        {
-            f_users.append(Json::Int(*it_));
-        }
-        f["users"] = f_users;
-        f["has_users"] = (*it)->has_users;
-        f["ignore"] = (*it)->ignore;
-        f["makeroom"] = (*it)->makeroom;
-        f["internal"] = (*it)->internal;
-        converted_furniture.append(f);
-    }
-
-    Json::Value all(Json::objectValue);
-    all["t"] = converted_tasks;
-    all["r"] = converted_rooms;
-    all["f"] = converted_furniture;
-
-    out << all;
+    dirty_rooms.insert(r);
 }
 
-void Plan::load(std::istream & in)
+void Plan::dirty(furniture *f)
 {
-    for (auto it = tasks.begin(); it != tasks.end(); it++)
-    {
-        delete *it;
-    }
-    tasks.clear();
-    for (auto it = rooms.begin(); it != rooms.end(); it++)
-    {
-        delete *it;
-    }
-    rooms.clear();
-    for (auto it = corridors.begin(); it != corridors.end(); it++)
-    {
-        delete *it;
-    }
-    corridors.clear();
-
-    Json::Value all(Json::objectValue);
-    in >> all;
-
-    std::vector<room *> all_rooms;
-    std::vector<furniture *> all_furniture;
-
-    for (unsigned int i = all["r"].size(); i > 0; i--)
-    {
-        all_rooms.push_back(new room(df::coord(), df::coord()));
-    }
-    for (unsigned int i = all["f"].size(); i > 0; i--)
-    {
-        all_furniture.push_back(new furniture());
-    }
-
-    for (auto it = all["t"].begin(); it != all["t"].end(); it++)
-    {
-        task *t = new task((*it)["t"].asString());
-        if (it->isMember("r"))
-        {
-            t->r = all_rooms.at((*it)["r"].asInt());
-        }
-        if (it->isMember("f"))
-        {
-            t->f = all_furniture.at((*it)["f"].asInt());
-        }
-        tasks.push_back(t);
-    }
-
-    std::ostringstream stringify;
-
-    std::map<std::string, room_status::status> statuses;
-    for (int i = 0; i < room_status::_room_status_count; i++)
-    {
-        stringify.str(std::string());
-        stringify.clear();
-        stringify << room_status::status(i);
-        statuses[stringify.str()] = room_status::status(i);
-    }
-    std::map<std::string, room_type::type> types;
-    for (int i = 0; i < room_type::_room_type_count; i++)
-    {
-        stringify.str(std::string());
-        stringify.clear();
-        stringify << room_type::type(i);
-        types[stringify.str()] = room_type::type(i);
-    }
+    dirty_furniture.insert(f);
+}
 
-    for (auto it = all_rooms.begin(); it != all_rooms.end(); it++)
-    {
-        const Json::Value & r = all["r"][it - all_rooms.begin()];
-        (*it)->status = statuses.at(r["status"].asString());
-        (*it)->type = types.at(r["type"].asString());
-        (*it)->subtype = r["subtype"].asString();
-        (*it)->comment = r["comment"].asString();
-        (*it)->min.x = r["min"][0].asInt();
-        (*it)->min.y = r["min"][1].asInt();
-        (*it)->min.z = r["min"][2].asInt();
-        (*it)->max.x = r["max"][0].asInt();
-        (*it)->max.y = r["max"][1].asInt();
-        (*it)->max.z = r["max"][2].asInt();
-        for (auto it_ = r["accesspath"].begin(); it_ != r["accesspath"].end(); it_++)
-        {
-            (*it)->accesspath.push_back(all_rooms.at(it_->asInt()));
-        }
-        for (auto it_ = r["layout"].begin(); it_ != r["layout"].end(); it_++)
-        {
-            (*it)->layout.push_back(all_furniture.at(it_->asInt()));
-        }
-        (*it)->owner = r["owner"].asInt();
-        (*it)->bld_id = r["bld_id"].asInt();
-        (*it)->squad_id = r["squad_id"].asInt();
-        (*it)->level = r["level"].asInt();
-        (*it)->noblesuite = r["noblesuite"].asInt();
-        if (r.isMember("workshop"))
-        {
-            (*it)->workshop = all_rooms.at(r["workshop"].asInt());
-        }
-        for (auto it_ = r["users"].begin(); it_ != r["users"].end(); it_++)
-        {
-            (*it)->users.insert(it_->asInt());
-        }
-        if ((*it)->type == room_type::pasture)
-        {
-            ai->pop->pet_check.insert((*it)->users.begin(), (*it)->users.end());
-        }
-        (*it)->channel_enable.x = r["channel_enable"][0].asInt();
-        (*it)->channel_enable.y = r["channel_enable"][1].asInt();
-        (*it)->channel_enable.z = r["channel_enable"][2].asInt();
-        for (auto it_ = r["stock_disable"].begin(); it_ != r["stock_disable"].end(); it_++)
-        {
-            df::stockpile_list disable;
-            if (find_enum_item(&disable, it_->asString()))
-            {
-                (*it)->stock_disable.insert(disable);
-            }
-        }
-        (*it)->stock_specific1 = r["stock_specific1"].asBool();
-        (*it)->stock_specific2 = r["stock_specific2"].asBool();
-        (*it)->has_users = r["has_users"].asBool();
-        (*it)->furnished = r["furnished"].asBool();
-        (*it)->queue_dig = r["queue_dig"].asBool();
-        (*it)->temporary = r["temporary"].asBool();
-        (*it)->outdoor = r["outdoor"].asBool();
-        (*it)->channeled = r["channeled"].asBool();
+void Plan::add_task(task_type::type type, room *r, furniture *f)
+{
+    dirty_tasks = true;
+    int p = task_schedule[type].priority;
+    task *t = new task(type, r, f, world->frame_counter);
+    tasks[p].push_back(t);
+    if (bg_active && bg_idx[p] == tasks[p].end())
+    {
+        // the queue was already done for this pass, but a new task should
+        // not have to wait for the next one.
+        bg_idx[p] = std::prev(tasks[p].end());
+    }
+    task_count[type]++;
+    if (type == task_type::digroom)
+        t->dig_weight = uint32_t(dig_weight(r));
+    t->digging = (type == task_type::wantdig || type == task_type::digroom) && r->type != room_type::corridor;
+    nrdig += t->dig_weight;
+    if (t->digging)
+        nrdigging++;
+}
 
-        if ((*it)->type == room_type::corridor)
-        {
-            corridors.push_back(*it);
-        }
-        else
-        {
-            rooms.push_back(*it);
-        }
-    }
+std::list<task *>::iterator Plan::remove_task(std::list<task *>::iterator it)
+{
+    task *t = *it;
+    dirty_tasks = true;
+    task_count[t->type]--;
+    nrdig -= t->dig_weight;
+    if (t->digging)
+        nrdigging--;
+    if (bg_current == t)
+        bg_current = nullptr;
+    int p = task_schedule[t->type].priority;
+    bool at_cursor = bg_idx[p] == it;
+    delete t;
+    it = tasks[p].erase(it);
+    if (at_cursor)
+        bg_idx[p] = it;
+    return it;
+}
 
-    for (auto it = all_furniture.begin(); it != all_furniture.end(); it++)
+void Plan::clear_tasks()
+{
+    dirty_tasks = true;
+    for (int p = 0; p < task_priority::_task_priority_count; p++)
     {
-        const Json::Value & f = all["f"][it - all_furniture.begin()];
-        (*it)->item = f["item"].asString();
-        (*it)->subtype = f["subtype"].asString();
-        find_enum_item(&(*it)->construction, f["construction"].asString());
-        find_enum_item(&(*it)->dig, f["dig"].asString());
-        (*it)->direction = f["direction"].asString();
-        (*it)->way = f["way"].asString();
-        (*it)->bld_id = f["bld_id"].asInt();
-        (*it)->x = f["x"].asInt();
-        (*it)->y = f["y"].asInt();
-        (*it)->z = f["z"].asInt();
-        if (f.isMember("target"))
-        {
-            (*it)->target = all_furniture.at(f["target"].asInt());
-        }
-        for (auto it_ = f["users"].begin(); it_ != f["users"].end(); it_++)
+        for (auto it = tasks[p].begin(); it != tasks[p].end(); it++)
         {
-            ai->pop->citizen.insert(it_->asInt());
-            (*it)->users.insert(it_->asInt());
+            delete *it;
         }
-        (*it)->has_users = f["has_users"].asBool();
-        (*it)->ignore = f["ignore"].asBool();
-        (*it)->makeroom = f["makeroom"].asBool();
-        (*it)->internal = f["internal"].asBool();
+        tasks[p].clear();
+        bg_idx[p] = tasks[p].end();
     }
-
-    fort_entrance = corridors.at(0);
-    categorize_all();
+    bg_current = nullptr;
+    std::fill(task_count, task_count + task_type::_task_type_count, 0);
+    nrdig = 0;
+    nrdigging = 0;
 }
 
-uint16_t Plan::getTileWalkable(df::coord t)
+size_t Plan::count_tasks()
 {
-    if (df::map_block *b = Maps::getTileBlock(t))
-        return b->walkable[t.x & 0xf][t.y & 0xf];
-    return 0;
+    size_t total = 0;
+    for (int p = 0; p < task_priority::_task_priority_count; p++)
+    {
+        total += tasks[p].size();
+    }
+    return total;
 }
 
-task *Plan::is_digging()
+bool Plan::is_digging()
 {
-    for (auto it = tasks.begin(); it != tasks.end(); it++)
-    {
-        task *t = *it;
-        if ((t->type == "wantdig" || t->type == "digroom") && t->r->type != room_type::corridor)
-            return t;
-    }
-    return nullptr;
+    return nrdigging != 0;
 }
 
 bool Plan::is_idle()
 {
-    for (auto it = tasks.begin(); it != tasks.end(); it++)
-    {
-        task *t = *it;
-        if (t->type != "monitor_cistern" && t->type != "checkrooms" && t->type != "checkidle")
-            return false;
-    }
-    return true;
+    return count_tasks() == task_count[task_type::monitor_cistern] + task_count[task_type::checkrooms] + task_count[task_type::checkidle];
 }
 
 void Plan::new_citizen(color_ostream & out, int32_t uid)
 {
-    if (std::find_if(tasks.begin(), tasks.end(), [](task *t) -> bool { return t->type == "checkidle"; }) == tasks.end())
+    if (!task_count[task_type::checkidle])
     {
-        tasks.push_back(new task("checkidle"));
+        add_task(task_type::checkidle);
     }
     getdiningroom(out, uid);
     getbedroom(out, uid);
@@ -903,9 +810,11 @@ bool Plan::checkidle(color_ostream & out)
         if (r->status == room_status::finished)
         {
             r->furnished = true;
+            dirty(r);
             for (auto it = r->layout.begin(); it != r->layout.end(); it++)
             {
                 (*it)->ignore = false;
+                dirty(*it);
             }
             furnish_room(out, r);
             smooth_room(out, r);
@@ -959,7 +868,7 @@ void Plan::idleidle(color_ostream & out)
             idleidle_tab.push_back(r);
     }
 
-    events.onupdate_register_once("df-ai plan idleidle", 4, [this](color_ostream & out) -> bool
+    events.onupdate_register_budgeted("df-ai plan idleidle", 4, [this](color_ostream & out) -> bool
             {
                 if (idleidle_tab.empty())
                 {
@@ -1020,8 +929,9 @@ void Plan::checkroom(color_ostream & out, room *r)
             {
                 ai->debug(out, "fix furniture " + f->item + " in " + describe_room(r), t);
                 f->bld_id = -1;
+                dirty(f);
 
-                tasks.push_back(new task("furnish", r, f));
+                add_task(task_type::furnish, r, f);
             }
             if (f->construction != construction_type::NONE)
             {
@@ -1033,6 +943,7 @@ void Plan::checkroom(color_ostream & out, room *r)
         {
             ai->debug(out, "rebuild " + describe_room(r), r->pos());
             r->bld_id = -1;
+            dirty(r);
             construct_room(out, r);
         }
     }
@@ -1083,6 +994,7 @@ void Plan::getdiningroom(color_ostream & out, int32_t id)
     {
         wantdig(out, r);
         r->users.insert(id);
+        dirty(r);
     }
 
     if (room *r = find_room(room_type::farmplot, [](room *r_) -> bool
@@ -1096,6 +1008,7 @@ void Plan::getdiningroom(color_ostream & out, int32_t id)
     {
         wantdig(out, r);
         r->users.insert(id);
+        dirty(r);
     }
 
     if (room *r = find_room(room_type::farmplot, [](room *r_) -> bool
@@ -1109,6 +1022,7 @@ void Plan::getdiningroom(color_ostream & out, int32_t id)
     {
         wantdig(out, r);
         r->users.insert(id);
+        dirty(r);
     }
 
     if (room *r = find_room(room_type::farmplot, [](room *r_) -> bool
@@ -1122,6 +1036,7 @@ void Plan::getdiningroom(color_ostream & out, int32_t id)
     {
         wantdig(out, r);
         r->users.insert(id);
+        dirty(r);
     }
 
     if (room *r = find_room(room_type::dininghall, [](room *r_) -> bool
@@ -1143,6 +1058,7 @@ void Plan::getdiningroom(color_ostream & out, int32_t id)
             {
                 f->ignore = false;
                 f->users.insert(id);
+                dirty(f);
                 break;
             }
         }
@@ -1153,6 +1069,7 @@ void Plan::getdiningroom(color_ostream & out, int32_t id)
             {
                 f->ignore = false;
                 f->users.insert(id);
+                dirty(f);
                 break;
             }
         }
@@ -1215,6 +1132,7 @@ void Plan::getsoldierbarrack(color_ostream & out, int32_t id)
             return;
         }
         r->squad_id = squad_id;
+        dirty(r);
         ai->debug(out, stl_sprintf("squad %d assign %s", squad_id, describe_room(r).c_str()));
         wantdig(out, r);
         if (df::building *bld = r->dfbuilding())
@@ -1223,7 +1141,7 @@ void Plan::getsoldierbarrack(color_ostream & out, int32_t id)
         }
     }
 
-    auto find_furniture = [id, r](const std::string & type)
+    auto find_furniture = [this, id, r](const std::string & type)
     {
         for (auto it = r->layout.begin(); it != r->layout.end(); it++)
         {
@@ -1231,6 +1149,7 @@ void Plan::getsoldierbarrack(color_ostream & out, int32_t id)
             if (f->item == type && f->users.count(id))
             {
                 f->ignore = false;
+                dirty(f);
                 return;
             }
         }
@@ -1241,6 +1160,7 @@ void Plan::getsoldierbarrack(color_ostream & out, int32_t id)
             {
                 f->users.insert(id);
                 f->ignore = false;
+                dirty(f);
                 return;
             }
         }
@@ -1302,6 +1222,7 @@ void Plan::getcoffin(color_ostream & out)
             {
                 f->users.insert(0);
                 f->ignore = false;
+                dirty(f);
                 break;
             }
         }
@@ -1329,10 +1250,13 @@ void Plan::freebedroom(color_ostream & out, int32_t id)
             if (df::building *bld = df::building::find(f->bld_id))
             {
                 Buildings::deconstruct(bld);
+                AI::jobs_changed();
             }
             f->bld_id = -1;
+            dirty(f);
         }
         r->bld_id = -1;
+        dirty(r);
     }
 }
 
@@ -1350,9 +1274,12 @@ void Plan::freecommonrooms(color_ostream & out, int32_t id, room_type::type subt
 {
     if (subtype == room_type::farmplot)
     {
-        find_room(subtype, [id](room *r) -> bool
+        find_room(subtype, [this, id](room *r) -> bool
                 {
-                    r->users.erase(id);
+                    if (r->users.erase(id))
+                    {
+                        dirty(r);
+                    }
                     return false;
                 });
     }
@@ -1367,7 +1294,10 @@ void Plan::freecommonrooms(color_ostream & out, int32_t id, room_type::type subt
                             continue;
                         if (f->ignore)
                             continue;
-                        if (f->users.erase(id) && f->users.empty())
+                        if (!f->users.erase(id))
+                            continue;
+                        dirty(f);
+                        if (f->users.empty())
                         {
                             // delete the specific table/chair/bed/etc for the dwarf
                             if (f->bld_id != -1 && f->bld_id != r->bld_id)
@@ -1375,6 +1305,7 @@ void Plan::freecommonrooms(color_ostream & out, int32_t id, room_type::type subt
                                 if (df::building *bld = df::building::find(f->bld_id))
                                 {
                                     Buildings::deconstruct(bld);
+                                    AI::jobs_changed();
                                 }
                                 f->bld_id = -1;
                                 f->ignore = true;
@@ -1386,8 +1317,10 @@ void Plan::freecommonrooms(color_ostream & out, int32_t id, room_type::type subt
                                 if (df::building *bld = r->dfbuilding())
                                 {
                                     Buildings::deconstruct(bld);
+                                    AI::jobs_changed();
                                 }
                                 r->bld_id = -1;
+                                dirty(r);
 
                                 if (r->squad_id != -1)
                                 {
@@ -1431,6 +1364,7 @@ df::building *Plan::getpasture(color_ostream & out, int32_t pet_id)
                 }))
     {
         r->users.insert(pet_id);
+        dirty(r);
         if (r->bld_id == -1)
             construct_room(out, r);
         return r->dfbuilding();
@@ -1443,12 +1377,14 @@ void Plan::freepasture(color_ostream &, int32_t pet_id)
     if (room *r = find_room(room_type::pasture, [pet_id](room *r_) -> bool { return r_->users.count(pet_id); }))
     {
         r->users.erase(pet_id);
+        dirty(r);
     }
 }
 
 void Plan::set_owner(color_ostream &, room *r, int32_t uid)
 {
     r->owner = uid;
+    dirty(r);
     if (r->bld_id != -1)
     {
         df::unit *u = df::unit::find(uid);
@@ -1470,9 +1406,10 @@ void Plan::dig_tile(df::coord t, df::tile_dig_designation dig)
     df::tile_designation *des = Maps::getTileDesignation(t);
     if (dig != tile_dig_designation::No && des->bits.dig == tile_dig_designation::No && !des->bits.hidden)
     {
-        for (auto job = world->job_list.next; job != nullptr; job = job->next)
+        const auto & jobs = AI::jobs_at(t);
+        for (auto job = jobs.begin(); job != jobs.end(); job++)
         {
-            if (ENUM_ATTR(job_type, type, job->item->job_type) == job_type_class::Digging && job->item->pos == t)
+            if (ENUM_ATTR(job_type, type, (*job)->job_type) == job_type_class::Digging)
             {
                 // someone already enroute to dig here, avoid 'Inappropriate
                 // dig square' spam
@@ -1493,8 +1430,9 @@ void Plan::wantdig(color_ostream & out, room *r)
         return;
     ai->debug(out, "wantdig " + describe_room(r));
     r->queue_dig = true;
+    dirty(r);
     r->dig(true);
-    tasks.push_back(new task("wantdig", r));
+    add_task(task_type::wantdig, r);
 }
 
 void Plan::digroom(color_ostream & out, room *r)
@@ -1504,10 +1442,11 @@ void Plan::digroom(color_ostream & out, room *r)
     ai->debug(out, "digroom " + describe_room(r));
     r->queue_dig = false;
     r->status = room_status::dig;
+    dirty(r);
     fixup_open(out, r);
     r->dig();
 
-    tasks.push_back(new task("digroom", r));
+    add_task(task_type::digroom, r);
 
     for (auto it = r->accesspath.begin(); it != r->accesspath.end(); it++)
     {
@@ -1521,7 +1460,7 @@ void Plan::digroom(color_ostream & out, room *r)
             continue;
         if (f->dig != tile_dig_designation::Default)
             continue;
-        tasks.push_back(new task("furnish", r, f));
+        add_task(task_type::furnish, r, f);
     }
 
     if (r->type == room_type::workshop)
@@ -1540,14 +1479,6 @@ void Plan::digroom(color_ostream & out, room *r)
                     return false;
                 });
     }
-
-    df::coord size = r->size();
-    if (r->type != room_type::corridor || size.z > 1)
-    {
-        nrdig++;
-        if (size.x * size.y * size.z >= 10)
-            nrdig++;
-    }
 }
 
 bool Plan::construct_room(color_ostream & out, room *r)
@@ -1562,13 +1493,13 @@ bool Plan::construct_room(color_ostream & out, room *r)
     if (r->type == room_type::stockpile)
     {
         furnish_room(out, r);
-        tasks.push_back(new task("construct_stockpile", r));
+        add_task(task_type::construct_stockpile, r);
         return true;
     }
 
     if (r->type == room_type::workshop)
     {
-        tasks.push_back(new task("construct_workshop", r));
+        add_task(task_type::construct_workshop, r);
         return true;
     }
 
@@ -1592,7 +1523,7 @@ bool Plan::construct_room(color_ostream & out, room *r)
         furnish_room(out, r);
         if (try_construct_activityzone(out, r))
             return true;
-        tasks.push_back(new task("construct_activityzone", r));
+        add_task(task_type::construct_activityzone, r);
         return true;
     }
 
@@ -1616,9 +1547,10 @@ bool Plan::furnish_room(color_ostream &, room *r)
     for (auto it = r->layout.begin(); it != r->layout.end(); it++)
     {
         furniture *f = *it;
-        tasks.push_back(new task("furnish", r, f));
+        add_task(task_type::furnish, r, f);
     }
     r->status = room_status::finished;
+    dirty(r);
     return true;
 }
 
@@ -1736,7 +1668,7 @@ bool Plan::try_furnish(color_ostream & out, room *r, furniture *f)
 
     if (itm != nullptr)
     {
-        if (f->subtype == "cage" && ai->stocks->count["cage"] < 1)
+        if (f->subtype == "cage" && ai->stocks->count[stock_kind::cage] < 1)
         {
             // avoid too much spam
             return false;
@@ -1749,12 +1681,15 @@ bool Plan::try_furnish(color_ostream & out, room *r, furniture *f)
         std::vector<df::item *> item;
         item.push_back(itm);
         Buildings::constructWithItems(bld, item);
+        AI::jobs_changed();
         if (f->makeroom)
         {
             r->bld_id = bld->id;
+            dirty(r);
         }
         f->bld_id = bld->id;
-        tasks.push_back(new task("checkfurnish", r, f));
+        dirty(f);
+        add_task(task_type::checkfurnish, r, f);
         return true;
     }
 
@@ -1778,8 +1713,10 @@ bool Plan::try_furnish_well(color_ostream &, room *r, furniture *f, df::coord t)
         items.push_back(buckt);
         items.push_back(chain);
         Buildings::constructWithItems(bld, items);
+        AI::jobs_changed();
         f->bld_id = bld->id;
-        tasks.push_back(new task("checkfurnish", r, f));
+        dirty(f);
+        add_task(task_type::checkfurnish, r, f);
         return true;
     }
     return false;
@@ -1797,8 +1734,10 @@ bool Plan::try_furnish_archerytarget(color_ostream &, room *r, furniture *f, df:
     std::vector<df::item *> item;
     item.push_back(bould);
     Buildings::constructWithItems(bld, item);
+    AI::jobs_changed();
     f->bld_id = bld->id;
-    tasks.push_back(new task("checkfurnish", r, f));
+    dirty(f);
+    add_task(task_type::checkfurnish, r, f);
     return true;
 }
 
@@ -1878,6 +1817,7 @@ bool Plan::try_furnish_construction(color_ostream &, df::construction_type ctype
     std::vector<df::item *> item;
     item.push_back(mat);
     Buildings::constructWithItems(bld, item);
+    AI::jobs_changed();
     return true;
 }
 
@@ -1893,8 +1833,10 @@ bool Plan::try_furnish_windmill(color_ostream &, room *r, furniture *f, df::coor
     df::building *bld = Buildings::allocInstance(t - df::coord(1, 1, 0), building_type::Windmill);
     Buildings::setSize(bld, df::coord(3, 3, 1));
     Buildings::constructWithItems(bld, mat);
+    AI::jobs_changed();
     f->bld_id = bld->id;
-    tasks.push_back(new task("checkfurnish", r, f));
+    dirty(f);
+    add_task(task_type::checkfurnish, r, f);
     return true;
 }
 
@@ -1910,9 +1852,12 @@ bool Plan::try_furnish_roller(color_ostream &, room *r, furniture *f, df::coord
         items.push_back(mecha);
         items.push_back(chain);
         Buildings::constructWithItems(bld, items);
+        AI::jobs_changed();
         r->bld_id = bld->id;
+        dirty(r);
         f->bld_id = bld->id;
-        tasks.push_back(new task("checkfurnish", r, f));
+        dirty(f);
+        add_task(task_type::checkfurnish, r, f);
         return true;
     }
     return false;
@@ -1945,8 +1890,10 @@ bool Plan::try_furnish_trap(color_ostream &, room *r, furniture *f)
     std::vector<df::item *> item;
     item.push_back(mecha);
     Buildings::constructWithItems(bld, item);
+    AI::jobs_changed();
     f->bld_id = bld->id;
-    tasks.push_back(new task("checkfurnish", r, f));
+    dirty(f);
+    add_task(task_type::checkfurnish, r, f);
 
     return true;
 }
@@ -1980,9 +1927,11 @@ bool Plan::try_construct_workshop(color_ostream & out, room *r)
             items.push_back(barrel);
             items.push_back(bucket);
             Buildings::constructWithItems(bld, items);
+            AI::jobs_changed();
             r->bld_id = bld->id;
+            dirty(r);
             init_managed_workshop(out, r, bld);
-            tasks.push_back(new task("checkconstruct", r));
+            add_task(task_type::checkconstruct, r);
             return true;
         }
     }
@@ -2000,9 +1949,11 @@ bool Plan::try_construct_workshop(color_ostream & out, room *r)
             items.push_back(barrel);
             items.push_back(bucket);
             Buildings::constructWithItems(bld, items);
+            AI::jobs_changed();
             r->bld_id = bld->id;
+            dirty(r);
             init_managed_workshop(out, r, bld);
-            tasks.push_back(new task("checkconstruct", r));
+            add_task(task_type::checkconstruct, r);
             return true;
         }
     }
@@ -2018,9 +1969,11 @@ bool Plan::try_construct_workshop(color_ostream & out, room *r)
             items.push_back(buckt);
             items.push_back(bould);
             Buildings::constructWithItems(bld, items);
+            AI::jobs_changed();
             r->bld_id = bld->id;
+            dirty(r);
             init_managed_workshop(out, r, bld);
-            tasks.push_back(new task("checkconstruct", r));
+            add_task(task_type::checkconstruct, r);
             return true;
         }
     }
@@ -2032,9 +1985,11 @@ bool Plan::try_construct_workshop(color_ostream & out, room *r)
             df::building *bld = Buildings::allocInstance(r->min, building_type::Workshop, workshop_type::Custom, find_custom_building("SCREW_PRESS"));
             Buildings::setSize(bld, r->size());
             Buildings::constructWithItems(bld, mechas);
+            AI::jobs_changed();
             r->bld_id = bld->id;
+            dirty(r);
             init_managed_workshop(out, r, bld);
-            tasks.push_back(new task("checkconstruct", r));
+            add_task(task_type::checkconstruct, r);
             return true;
         }
     }
@@ -2050,9 +2005,11 @@ bool Plan::try_construct_workshop(color_ostream & out, room *r)
             items.push_back(anvil);
             items.push_back(bould);
             Buildings::constructWithItems(bld, items);
+            AI::jobs_changed();
             r->bld_id = bld->id;
+            dirty(r);
             init_managed_workshop(out, r, bld);
-            tasks.push_back(new task("checkconstruct", r));
+            add_task(task_type::checkconstruct, r);
             return true;
         }
     }
@@ -2075,9 +2032,11 @@ bool Plan::try_construct_workshop(color_ostream & out, room *r)
             std::vector<df::item *> item;
             item.push_back(bould);
             Buildings::constructWithItems(bld, item);
+            AI::jobs_changed();
             r->bld_id = bld->id;
+            dirty(r);
             init_managed_workshop(out, r, bld);
-            tasks.push_back(new task("checkconstruct", r));
+            add_task(task_type::checkconstruct, r);
             return true;
         }
     }
@@ -2091,9 +2050,11 @@ bool Plan::try_construct_workshop(color_ostream & out, room *r)
             std::vector<df::item *> item;
             item.push_back(quern);
             Buildings::constructWithItems(bld, item);
+            AI::jobs_changed();
             r->bld_id = bld->id;
+            dirty(r);
             init_managed_workshop(out, r, bld);
-            tasks.push_back(new task("checkconstruct", r));
+            add_task(task_type::checkconstruct, r);
             return true;
         }
     }
@@ -2105,8 +2066,10 @@ bool Plan::try_construct_workshop(color_ostream & out, room *r)
             df::building *bld = Buildings::allocInstance(r->min, building_type::TradeDepot);
             Buildings::setSize(bld, r->size());
             Buildings::constructWithItems(bld, boulds);
+            AI::jobs_changed();
             r->bld_id = bld->id;
-            tasks.push_back(new task("checkconstruct", r));
+            dirty(r);
+            add_task(task_type::checkconstruct, r);
             return true;
         }
     }
@@ -2128,9 +2091,11 @@ bool Plan::try_construct_workshop(color_ostream & out, room *r)
             std::vector<df::item *> item;
             item.push_back(bould);
             Buildings::constructWithItems(bld, item);
+            AI::jobs_changed();
             r->bld_id = bld->id;
+            dirty(r);
             init_managed_workshop(out, r, bld);
-            tasks.push_back(new task("checkconstruct", r));
+            add_task(task_type::checkconstruct, r);
             return true;
             // XXX else quarry?
         }
@@ -2252,6 +2217,7 @@ bool Plan::try_construct_stockpile(color_ostream & out, room *r)
     ai->camera->ignore_pause(start_x, start_y, start_z);
     df::building_stockpilest *bld = virtual_cast<df::building_stockpilest>(world->buildings.all.back());
     r->bld_id = bld->id;
+    dirty(r);
     furnish_room(out, r);
 
     if (r->workshop && r->subtype == "stone")
@@ -2325,6 +2291,7 @@ bool Plan::try_construct_activityzone(color_ostream & out, room *r)
     memset(bld->room.extents, 1, size.x * size.y);
     Buildings::constructAbstract(bld);
     r->bld_id = bld->id;
+    dirty(r);
     bld->is_room = true;
 
     bld->zone_flags.bits.active = 1;
@@ -2435,13 +2402,15 @@ bool Plan::construct_farmplot(color_ostream & out, room *r)
     df::building *bld = Buildings::allocInstance(r->min, building_type::FarmPlot);
     Buildings::setSize(bld, r->size());
     Buildings::constructWithItems(bld, std::vector<df::item *>());
+    AI::jobs_changed();
     r->bld_id = bld->id;
+    dirty(r);
     furnish_room(out, r);
     if (room *st = find_room(room_type::stockpile, [r](room *o) -> bool { return o->workshop == r; }))
     {
         digroom(out, st);
     }
-    tasks.push_back(new task("setup_farmplot", r));
+    add_task(task_type::setup_farmplot, r);
     return true;
 }
 
@@ -2463,25 +2432,29 @@ void Plan::move_dininghall_fromtemp(color_ostream &, room *r, room *t)
                 {
                     (*of)->ignore = false;
                 }
+                dirty(*of);
                 if (df::building *bld = df::building::find((*f)->bld_id))
                 {
                     Buildings::deconstruct(bld);
+                    AI::jobs_changed();
                 }
                 break;
             }
         }
     }
     rooms.erase(std::remove(rooms.begin(), rooms.end(), t), rooms.end());
-    for (auto it = tasks.begin(); it != tasks.end(); )
+    for (int p = 0; p < task_priority::_task_priority_count; p++)
     {
-        if ((*it)->r == t)
-        {
-            delete *it;
-            tasks.erase(it++);
-        }
-        else
+        for (auto it = tasks[p].begin(); it != tasks[p].end(); )
         {
-            it++;
+            if ((*it)->r == t)
+            {
+                it = remove_task(it);
+            }
+            else
+            {
+                it++;
+            }
         }
     }
     delete t;
@@ -2571,7 +2544,7 @@ bool Plan::construct_cistern(color_ostream & out, room *r)
     // check smoothing progress, channel intermediate levels
     if (r->subtype == "well")
     {
-        tasks.push_back(new task("dig_cistern", r));
+        add_task(task_type::dig_cistern, r);
     }
 
     return true;
@@ -2623,11 +2596,16 @@ void Plan::room_items(color_ostream &, room *r, std::function<void(df::item *)>
 void Plan::smooth_xyz(df::coord min, df::coord max)
 {
     std::set<df::coord> tiles;
-    for (int16_t x = min.x; x <= max.x; x++)
+    for (int16_t z = min.z; z <= max.z; z++)
     {
-        for (int16_t y = min.y; y <= max.y; y++)
+        // nothing to smooth on this z-level
+        df::coord zmin(min, z), zmax(max, z);
+        if (!MapQuery::any(MapQuery::wall, zmin, zmax) && !MapQuery::any(MapQuery::floor, zmin, zmax))
+            continue;
+
+        for (int16_t x = min.x; x <= max.x; x++)
         {
-            for (int16_t z = min.z; z <= max.z; z++)
+            for (int16_t y = min.y; y <= max.y; y++)
             {
                 tiles.insert(df::coord(x, y, z));
             }
@@ -2682,13 +2660,15 @@ void Plan::smooth(std::set<df::coord> tiles)
     }
 
     // remove tiles that are already being smoothed
-    for (auto j = world->job_list.next; j != nullptr; j = j->next)
+    const auto & detail_wall = AI::jobs_by_type(job_type::DetailWall);
+    for (auto j = detail_wall.begin(); j != detail_wall.end(); j++)
     {
-        if (j->item->job_type == job_type::DetailWall ||
-                j->item->job_type == job_type::DetailFloor)
-        {
-            tiles.erase(j->item->pos);
-        }
+        tiles.erase((*j)->pos);
+    }
+    const auto & detail_floor = AI::jobs_by_type(job_type::DetailFloor);
+    for (auto j = detail_floor.begin(); j != detail_floor.end(); j++)
+    {
+        tiles.erase((*j)->pos);
     }
 
     // mark the tiles to be smoothed!
@@ -2795,6 +2775,7 @@ bool Plan::try_digcistern(color_ostream & out, room *r)
     if (cnt == size.x * size.y * (size.z - 1))
     {
         r->channeled = true;
+        dirty(r);
         return true;
     }
     return false;
@@ -2807,8 +2788,9 @@ void Plan::dig_garbagedump(color_ostream &)
                 if (r->status == room_status::plan)
                 {
                     r->status = room_status::dig;
+                    dirty(r);
                     r->dig(false, true);
-                    tasks.push_back(new task("dig_garbage", r));
+                    add_task(task_type::dig_garbage, r);
                 }
                 return false;
             });
@@ -2819,6 +2801,7 @@ bool Plan::try_diggarbage(color_ostream & out, room *r)
     if (r->is_dug(tiletype_shape_basic::Open))
     {
         r->status = room_status::dug;
+        dirty(r);
         // XXX ugly as usual
         df::coord t(r->min.x, r->min.y, r->min.z - 1);
         if (ENUM_ATTR(tiletype_shape, basic_shape, ENUM_ATTR(tiletype, shape,
@@ -2914,6 +2897,7 @@ bool Plan::try_endfurnish(color_ostream & out, room *r, furniture *f)
     else if (f->item == "archerytarget")
     {
         f->makeroom = true;
+        dirty(f);
     }
 
     if (r->type == room_type::infirmary)
@@ -3027,6 +3011,7 @@ bool Plan::setup_lever(color_ostream & out, room *r, furniture *f)
                 if ((*gate)->item == "floodgate" && (*gate)->way == way)
                 {
                     f->target = *gate;
+                    dirty(f);
                     break;
                 }
             }
@@ -3037,7 +3022,7 @@ bool Plan::setup_lever(color_ostream & out, room *r, furniture *f)
             pull_lever(out, f);
             if (way == "in")
             {
-                tasks.push_back(new task("monitor_cistern"));
+                add_task(task_type::monitor_cistern);
             }
 
             return true;
@@ -3091,6 +3076,7 @@ bool Plan::link_lever(color_ostream &, furniture *src, furniture *dst)
     job->general_refs.push_back(refhold);
     bld->jobs.push_back(job);
     Job::linkIntoWorld(job);
+    AI::jobs_changed();
 
     Job::attachJobItem(job, mechas[0], df::job_item_ref::LinkToTarget);
     Job::attachJobItem(job, mechas[1], df::job_item_ref::LinkToTrigger);
@@ -3122,6 +3108,7 @@ bool Plan::pull_lever(color_ostream & out, furniture *f)
     job->general_refs.push_back(ref);
     bld->jobs.push_back(job);
     Job::linkIntoWorld(job);
+    AI::jobs_changed();
     return true;
 }
 
@@ -3166,6 +3153,7 @@ void Plan::monitor_cistern(color_ostream & out)
         for (auto l = m_c_reserve->layout.begin(); l != m_c_reserve->layout.end(); l++)
         {
             (*l)->ignore = false;
+            dirty(*l);
         }
         furnish_room(out, m_c_reserve);
     }
@@ -3184,6 +3172,7 @@ void Plan::monitor_cistern(color_ostream & out)
         if ((*f)->ignore)
         {
             (*f)->ignore = false;
+            dirty(*f);
             furnish_entrance = true;
         }
     }
@@ -3544,6 +3533,7 @@ command_result Plan::make_map_walkable(color_ostream &)
                 for (auto c = cor.begin(); c != cor.end(); c++)
                 {
                     corridors.push_back(*c);
+                    index_room(*c);
                     wantdig(out, *c);
                 }
                 return true;
@@ -3900,152 +3890,334 @@ df::coord Plan::spiral_search(df::coord t, int16_t max, int16_t min, int16_t ste
     return invalid;
 }
 
-// check that tile is surrounded by solid rock/soil walls
-bool Plan::map_tile_in_rock(df::coord tile)
+static bool is_rock_material(df::tiletype_material tm, bool allow_ice)
+{
+    return tm == tiletype_material::STONE || tm == tiletype_material::MINERAL || tm == tiletype_material::SOIL || tm == tiletype_material::ROOT || (allow_ice && tm == tiletype_material::FROZEN_LIQUID);
+}
+
+const map_block_masks *Plan::get_block_masks(int16_t bx, int16_t by, int16_t z)
 {
-    for (int16_t dx = -1; dx <= 1; dx++)
+    if (bx < 0 || by < 0 || z < 0 || bx >= world->map.x_count_block || by >= world->map.y_count_block || z >= world->map.z_count_block)
+        return nullptr;
+
+    size_t count = size_t(world->map.x_count_block) * size_t(world->map.y_count_block) * size_t(world->map.z_count_block);
+    if (block_masks.size() != count)
+    {
+        block_masks.clear();
+        block_masks.resize(count);
+    }
+
+    map_block_masks & m = block_masks[bx + (by + z * world->map.y_count_block) * world->map.x_count_block];
+    if (m.frame == world->frame_counter && m.allow_ice == allow_ice)
+        return m.present ? &m : nullptr;
+
+    m.frame = world->frame_counter;
+    m.allow_ice = allow_ice;
+    df::map_block *b = Maps::getBlock(bx, by, z);
+    m.present = b != nullptr;
+    if (!b)
+        return nullptr;
+
+    for (int16_t y = 0; y < 16; y++)
     {
-        for (int16_t dy = -1; dy <= 1; dy++)
+        uint16_t rock = 0, nocavern = 0, cavernfloor = 0;
+        for (int16_t x = 0; x < 16; x++)
         {
-            df::tiletype *tt = Maps::getTileType(tile + df::coord(dx, dy, 0));
-            if (!tt)
+            df::tiletype tt = b->tiletype[x][y];
+            df::tile_designation td = b->designation[x][y];
+            df::tiletype_shape_basic tsb = ENUM_ATTR(tiletype_shape, basic_shape, ENUM_ATTR(tiletype, shape, tt));
+            df::tiletype_material tm = ENUM_ATTR(tiletype, material, tt);
+            uint16_t bit = uint16_t(1 << x);
+
+            bool is_rock = tsb == tiletype_shape_basic::Wall && is_rock_material(tm, allow_ice);
+            if (is_rock)
             {
-                return false;
+                rock |= bit;
             }
-
-            if (ENUM_ATTR(tiletype_shape, basic_shape, ENUM_ATTR(tiletype, shape, *tt)) != tiletype_shape_basic::Wall)
+            if (td.bits.hidden ? is_rock : (td.bits.flow_size < 4 && (allow_ice || tm != tiletype_material::FROZEN_LIQUID)))
             {
-                return false;
+                nocavern |= bit;
             }
-
-            df::tiletype_material tm = ENUM_ATTR(tiletype, material, *tt);
-            if (tm != tiletype_material::STONE && tm != tiletype_material::MINERAL && tm != tiletype_material::SOIL && tm != tiletype_material::ROOT && (!allow_ice || tm != tiletype_material::FROZEN_LIQUID))
+            if (td.bits.hidden && td.bits.flow_size == 0 && tsb == tiletype_shape_basic::Floor &&
+                    (is_rock_material(tm, false) || tm == tiletype_material::GRASS_LIGHT || tm == tiletype_material::GRASS_DARK || tm == tiletype_material::PLANT))
             {
-                return false;
+                cavernfloor |= bit;
             }
         }
+        m.rows[map_block_masks::rock][y] = rock;
+        m.rows[map_block_masks::nocavern][y] = nocavern;
+        m.rows[map_block_masks::cavernfloor][y] = cavernfloor;
     }
-    return true;
+    return &m;
 }
 
-// check tile is surrounded by solid walls or visible tile
-bool Plan::map_tile_nocavern(df::coord tile)
+// row ty of the plane from x = bx * 16 - 1 to x = bx * 16 + 16, in bits 0
+// to 17. tiles outside the map count as set for nocavern, as the per-tile
+// check skipped them, and as clear otherwise.
+uint32_t Plan::mask_row(map_block_masks::plane p, int16_t bx, int16_t ty, int16_t z)
 {
-    for (int16_t dx = -1; dx <= 1; dx++)
-    {
-        for (int16_t dy = -1; dy <= 1; dy++)
-        {
-            df::coord t = tile + df::coord(dx, dy, 0);
-            df::tile_designation *td = Maps::getTileDesignation(t);
-            if (!td)
-            {
-                continue;
-            }
-
-
-            if (!td->bits.hidden)
-            {
-                if (td->bits.flow_size >= 4)
-                    return false;
-                if (!allow_ice && ENUM_ATTR(tiletype, material, *Maps::getTileType(t)) == tiletype_material::FROZEN_LIQUID)
-                    return false;
-                continue;
-            }
+    uint16_t missing = p == map_block_masks::nocavern ? 0xffff : 0;
+    int16_t by = ty >> 4;
+    int16_t y = ty & 0xf;
+
+    const map_block_masks *left = get_block_masks(bx - 1, by, z);
+    const map_block_masks *mid = get_block_masks(bx, by, z);
+    const map_block_masks *right = get_block_masks(bx + 1, by, z);
+
+    uint32_t row = uint32_t(mid ? mid->rows[p][y] : missing) << 1;
+    row |= ((left ? left->rows[p][y] : missing) >> 15) & 1;
+    row |= uint32_t((right ? right->rows[p][y] : missing) & 1) << 17;
+    return row;
+}
 
-            df::tiletype tt = *Maps::getTileType(t);
+// bit x is set when the plane is set on all 9 tiles around
+// (bx * 16 + x, ty, z)
+uint16_t Plan::mask_area_row(map_block_masks::plane p, int16_t bx, int16_t ty, int16_t z)
+{
+    uint32_t area = mask_row(p, bx, ty - 1, z) & mask_row(p, bx, ty, z) & mask_row(p, bx, ty + 1, z);
+    return uint16_t(area & (area >> 1) & (area >> 2));
+}
 
-            if (ENUM_ATTR(tiletype_shape, basic_shape, ENUM_ATTR(tiletype, shape, tt)) != tiletype_shape_basic::Wall)
-            {
-                return false;
-            }
+// check that tile is surrounded by solid rock/soil walls
+bool Plan::map_tile_in_rock(df::coord tile)
+{
+    return (mask_area_row(map_block_masks::rock, tile.x >> 4, tile.y, tile.z) >> (tile.x & 0xf)) & 1;
+}
 
-            df::tiletype_material tm = ENUM_ATTR(tiletype, material, tt);
-            if (tm != tiletype_material::STONE && tm != tiletype_material::MINERAL && tm != tiletype_material::SOIL && tm != tiletype_material::ROOT && (!allow_ice || tm != tiletype_material::FROZEN_LIQUID))
-            {
-                return false;
-            }
-        }
-    }
-    return true;
+// check tile is surrounded by solid walls or visible tile
+bool Plan::map_tile_nocavern(df::coord tile)
+{
+    return (mask_area_row(map_block_masks::nocavern, tile.x >> 4, tile.y, tile.z) >> (tile.x & 0xf)) & 1;
 }
 
 // check tile is a hidden floor
 bool Plan::map_tile_cavernfloor(df::coord t)
 {
-    df::tile_designation *td = Maps::getTileDesignation(t);
-    if (!td)
-        return false;
-    if (!td->bits.hidden)
-        return false;
-    if (td->bits.flow_size != 0)
+    const map_block_masks *m = get_block_masks(t.x >> 4, t.y >> 4, t.z);
+    return m && (m->rows[map_block_masks::cavernfloor][t.y & 0xf] >> (t.x & 0xf)) & 1;
+}
+
+// one step of the walk down a column, returns true once the column is known
+static bool surface_step(surface_column & col, bool & tree, df::tiletype tt, int16_t z)
+{
+    df::tiletype_shape ts = ENUM_ATTR(tiletype, shape, tt);
+    df::tiletype_shape_basic tsb = ENUM_ATTR(tiletype_shape, basic_shape, ts);
+    if (tsb == tiletype_shape_basic::Open)
         return false;
-    df::tiletype tt = *Maps::getTileType(t);
     df::tiletype_material tm = ENUM_ATTR(tiletype, material, tt);
-    if (tm != tiletype_material::STONE && tm != tiletype_material::MINERAL && tm != tiletype_material::SOIL && tm != tiletype_material::ROOT && tm != tiletype_material::GRASS_LIGHT && tm != tiletype_material::GRASS_DARK && tm != tiletype_material::PLANT && tm != tiletype_material::SOIL)
+    if (tm == tiletype_material::POOL || tm == tiletype_material::RIVER)
+    {
+        col.kind = surface_column::water;
+    }
+    else if (tm == tiletype_material::TREE)
+    {
+        tree = true;
+        return false;
+    }
+    else if (tsb == tiletype_shape_basic::Floor || tsb == tiletype_shape_basic::Ramp)
+    {
+        col.kind = surface_column::ground;
+    }
+    else if (tree)
+    {
+        col.kind = surface_column::below_tree;
+    }
+    else
+    {
         return false;
-    return ENUM_ATTR(tiletype_shape, basic_shape, ENUM_ATTR(tiletype, shape, tt)) == tiletype_shape_basic::Floor;
+    }
+    col.z = z;
+    return true;
 }
 
-df::coord Plan::surface_tile_at(int16_t tx, int16_t ty, bool allow_trees)
+// scan the whole map once, one 16x16 block column at a time
+void Plan::index_surface()
 {
-    int16_t dx = tx & 0xf;
-    int16_t dy = ty & 0xf;
+    surface_columns.assign(size_t(world->map.x_count) * size_t(world->map.y_count), surface_column());
+    surface_blocks.assign(size_t(world->map.x_count_block) * size_t(world->map.y_count_block), surface_block());
+
+    for (int16_t bx = 0; bx < world->map.x_count_block; bx++)
+    {
+        for (int16_t by = 0; by < world->map.y_count_block; by++)
+        {
+            index_surface_block(bx, by);
+        }
+    }
+}
 
-    bool tree = false;
-    for (int16_t z = world->map.z_count - 1; z >= 0; z--)
+// walk down every column of a block column, then keep its tiletypes from
+// the lowest surface found up
+void Plan::index_surface_block(int16_t bx, int16_t by)
+{
+    bool tree[16][16] = {};
+    int16_t left = 0;
+    for (int16_t dx = 0; dx < 16; dx++)
     {
-        df::map_block *b = Maps::getTileBlock(tx, ty, z);
+        for (int16_t dy = 0; dy < 16; dy++)
+        {
+            int16_t tx = bx * 16 + dx;
+            int16_t ty = by * 16 + dy;
+            if (tx < world->map.x_count && ty < world->map.y_count)
+            {
+                surface_columns[tx + ty * world->map.x_count] = surface_column();
+                left++;
+            }
+        }
+    }
+
+    int16_t z = world->map.z_count - 1;
+    for (; z >= 0 && left > 0; z--)
+    {
+        df::map_block *b = Maps::getBlock(bx, by, z);
         if (!b)
             continue;
-        df::tiletype tt = b->tiletype[dx][dy];
-        df::tiletype_shape ts = ENUM_ATTR(tiletype, shape, tt);
-        df::tiletype_shape_basic tsb = ENUM_ATTR(tiletype_shape, basic_shape, ts);
-        if (tsb == tiletype_shape_basic::Open)
-            continue;
-        df::tiletype_material tm = ENUM_ATTR(tiletype, material, tt);
-        if (tm == tiletype_material::POOL || tm == tiletype_material::RIVER)
+        for (int16_t dx = 0; dx < 16; dx++)
         {
-            df::coord invalid;
-            invalid.clear();
-            return invalid;
+            for (int16_t dy = 0; dy < 16; dy++)
+            {
+                int16_t tx = bx * 16 + dx;
+                int16_t ty = by * 16 + dy;
+                if (tx >= world->map.x_count || ty >= world->map.y_count)
+                    continue;
+                surface_column & col = surface_columns[tx + ty * world->map.x_count];
+                if (col.kind != surface_column::unknown)
+                    continue;
+                if (surface_step(col, tree[dx][dy], b->tiletype[dx][dy], z))
+                {
+                    left--;
+                }
+            }
         }
-        if (tm == tiletype_material::TREE)
+    }
+
+    if (left > 0)
+    {
+        // some column has no surface at all, it can appear anywhere
+        z = 0;
+        for (int16_t dx = 0; dx < 16; dx++)
         {
-            tree = true;
+            for (int16_t dy = 0; dy < 16; dy++)
+            {
+                int16_t tx = bx * 16 + dx;
+                int16_t ty = by * 16 + dy;
+                if (tx >= world->map.x_count || ty >= world->map.y_count)
+                    continue;
+                surface_column & col = surface_columns[tx + ty * world->map.x_count];
+                if (col.kind == surface_column::unknown)
+                {
+                    col.kind = surface_column::none;
+                }
+            }
         }
-        else if (tsb == tiletype_shape_basic::Floor || tsb == tiletype_shape_basic::Ramp)
+    }
+    else
+    {
+        // the loop stopped one level below the lowest surface
+        z++;
+    }
+
+    surface_block & sb = surface_blocks[bx + by * world->map.x_count_block];
+    sb.frame = world->frame_counter;
+    sb.min_z = z;
+    sb.tiles.assign(size_t(world->map.z_count - z) * 256, tiletype::Void);
+    for (; z < world->map.z_count; z++)
+    {
+        df::map_block *b = Maps::getBlock(bx, by, z);
+        if (b)
         {
-            return df::coord(tx, ty, z);
+            std::memcpy(&sb.tiles[size_t(z - sb.min_z) * 256], b->tiletype, 256 * sizeof(df::tiletype));
         }
-        else if (tree)
+    }
+}
+
+bool Plan::surface_block_changed(int16_t bx, int16_t by)
+{
+    const surface_block & sb = surface_blocks[bx + by * world->map.x_count_block];
+    for (int16_t z = sb.min_z; z < world->map.z_count; z++)
+    {
+        const df::tiletype *tiles = &sb.tiles[size_t(z - sb.min_z) * 256];
+        df::map_block *b = Maps::getBlock(bx, by, z);
+        if (b)
         {
-            df::coord c(tx, ty, z + 1);
-            if (!allow_trees)
-                c.clear();
-            return c;
+            if (std::memcmp(tiles, b->tiletype, 256 * sizeof(df::tiletype)))
+                return true;
+        }
+        else if (std::count(tiles, tiles + 256, tiletype::Void) != 256)
+        {
+            return true;
         }
     }
+    return false;
+}
+
+// the map is scanned once and cached. once per tick, the first lookup in a
+// block column compares it to the map from its lowest surface up, and
+// scans it again if anything changed there.
+df::coord Plan::surface_tile_at(int16_t tx, int16_t ty, bool allow_trees)
+{
     df::coord invalid;
     invalid.clear();
-    return invalid;
+
+    if (tx < 0 || ty < 0 || tx >= world->map.x_count || ty >= world->map.y_count)
+        return invalid;
+
+    if (surface_columns.size() != size_t(world->map.x_count) * size_t(world->map.y_count))
+    {
+        index_surface();
+    }
+
+    int16_t bx = tx >> 4;
+    int16_t by = ty >> 4;
+    surface_block & sb = surface_blocks[bx + by * world->map.x_count_block];
+    if (sb.frame != world->frame_counter)
+    {
+        sb.frame = world->frame_counter;
+        if (surface_block_changed(bx, by))
+        {
+            index_surface_block(bx, by);
+        }
+    }
+
+    const surface_column & col = surface_columns[tx + ty * world->map.x_count];
+    switch (col.kind)
+    {
+        case surface_column::ground:
+            return df::coord(tx, ty, col.z);
+        case surface_column::below_tree:
+            if (allow_trees)
+                return df::coord(tx, ty, col.z + 1);
+            return invalid;
+        default:
+            return invalid;
+    }
 }
 
 std::string Plan::status()
 {
-    std::map<std::string, size_t> task_count;
     std::map<std::string, size_t> furnishing;
-    for (auto t = tasks.begin(); t != tasks.end(); t++)
+    task *digging = nullptr;
+    for (int p = 0; p < task_priority::_task_priority_count; p++)
     {
-        task_count[(*t)->type]++;
-        if ((*t)->type == "furnish" && !(*t)->f->item.empty())
+        for (auto t = tasks[p].begin(); t != tasks[p].end(); t++)
         {
-            furnishing[(*t)->f->item]++;
+            if ((*t)->type == task_type::furnish && !(*t)->f->item.empty())
+            {
+                furnishing[(*t)->f->item]++;
+            }
+            if (!digging && ((*t)->type == task_type::wantdig || (*t)->type == task_type::digroom) && (*t)->r->type != room_type::corridor)
+            {
+                digging = *t;
+            }
         }
     }
     std::ostringstream s;
     bool first = true;
-    for (auto tc = task_count.begin(); tc != task_count.end(); tc++)
+    for (int i = 0; i < task_type::_task_type_count; i++)
     {
+        if (!task_count[i])
+        {
+            continue;
+        }
         if (first)
         {
             first = false;
@@ -4054,11 +4226,11 @@ std::string Plan::status()
         {
             s << ", ";
         }
-        s << tc->first << ": " << tc->second;
+        s << task_type::type(i) << ": " << task_count[i];
     }
-    if (task *t = is_digging())
+    if (digging)
     {
-        s << ", digging: " << describe_room(t->r);
+        s << ", digging: " << describe_room(digging->r);
     }
     first = true;
     for (auto f = furnishing.begin(); f != furnishing.end(); f++)
@@ -4082,27 +4254,49 @@ std::string Plan::report()
     std::ostringstream s;
 
     s << "## Tasks\n";
-    for (auto it = tasks.begin(); it != tasks.end(); it++)
+    for (int p = 0; p < task_priority::_task_priority_count; p++)
     {
-        if (bg_idx == it)
+        s << "### " << task_priority::priority(p) << "\n";
+        for (auto it = tasks[p].begin(); it != tasks[p].end(); it++)
         {
-            s << "--- current position ---\n";
-        }
+            if (bg_active && bg_idx[p] == it)
+            {
+                s << "--- current position ---\n";
+            }
 
-        task *t = *it;
-        s << "- " << t->type << "\n";
-        if (t->r != nullptr)
-        {
-            s << "  " << describe_room(t->r) << "\n";
+            task *t = *it;
+            s << "- " << t->type;
+            if (t->retry_pass > bg_pass)
+            {
+                s << " (failed " << t->fails << " times, next try in " << (t->retry_pass - bg_pass) << " passes)";
+            }
+            s << "\n";
+            if (t->r != nullptr)
+            {
+                s << "  " << describe_room(t->r) << "\n";
+            }
+            if (t->f != nullptr)
+            {
+                s << "  " << describe_furniture(t->f) << "\n";
+            }
         }
-        if (t->f != nullptr)
+        if (bg_active && bg_idx[p] == tasks[p].end())
         {
-            s << "  " << describe_furniture(t->f) << "\n";
+            s << "--- current position ---\n";
         }
     }
-    if (bg_idx == tasks.end())
+    s << "\n";
+
+    s << "## Task wait times\n";
+    s << "last pass took " << bg_pass_ticks << " ticks\n";
+    for (int i = 0; i < task_type::_task_type_count; i++)
     {
-        s << "--- current position ---\n";
+        const task_wait_stats & wait = task_wait[i];
+        if (!wait.done)
+        {
+            continue;
+        }
+        s << "- " << task_type::type(i) << ": " << wait.done << " done, average " << (wait.total_ticks / wait.done) << " ticks, longest " << wait.max_ticks << " ticks\n";
     }
     s << "\n";
 
@@ -4112,29 +4306,15 @@ std::string Plan::report()
 void Plan::categorize_all()
 {
     room_category.clear();
-    room_by_z.clear();
+    room_by_block.clear();
     for (auto r = rooms.begin(); r != rooms.end(); r++)
     {
         room_category[(*r)->type].push_back(*r);
-        for (int32_t z = (*r)->min.z; z <= (*r)->max.z; z++)
-        {
-            room_by_z[z].insert(*r);
-        }
-        for (auto f = (*r)->layout.begin(); f != (*r)->layout.end(); f++)
-        {
-            room_by_z[(*r)->min.z + (*f)->z].insert(*r);
-        }
+        index_room(*r);
     }
     for (auto r = corridors.begin(); r != corridors.end(); r++)
     {
-        for (int32_t z = (*r)->min.z; z <= (*r)->max.z; z++)
-        {
-            room_by_z[z].insert(*r);
-        }
-        for (auto f = (*r)->layout.begin(); f != (*r)->layout.end(); f++)
-        {
-            room_by_z[(*r)->min.z + (*f)->z].insert(*r);
-        }
+        index_room(*r);
     }
 
     if (room_category.count(room_type::stockpile))
@@ -4337,9 +4517,39 @@ room *Plan::find_room(room_type::type type, std::function<bool(room *)> b)
     return nullptr;
 }
 
+static void index_area(std::map<df::coord, std::set<room *>> & room_by_block, room *r, int16_t x1, int16_t y1, int16_t x2, int16_t y2, int16_t z)
+{
+    for (int16_t bx = x1 >> 4; bx <= x2 >> 4; bx++)
+    {
+        for (int16_t by = y1 >> 4; by <= y2 >> 4; by++)
+        {
+            room_by_block[df::coord(bx, by, z)].insert(r);
+        }
+    }
+}
+
+// add a room to room_by_block, for find_room_at
+void Plan::index_room(room *r)
+{
+    for (int16_t z = r->min.z; z <= r->max.z; z++)
+    {
+        index_area(room_by_block, r, r->min.x - 1, r->min.y - 1, r->max.x + 1, r->max.y + 1, z);
+    }
+    for (auto f = r->layout.begin(); f != r->layout.end(); f++)
+    {
+        index_furniture(r, *f);
+    }
+}
+
+void Plan::index_furniture(room *r, furniture *f)
+{
+    df::coord ft = r->min + df::coord(f->x, f->y, f->z);
+    index_area(room_by_block, r, ft.x - 1, ft.y - 1, ft.x + 1, ft.y + 1, ft.z);
+}
+
 room *Plan::find_room_at(df::coord t)
 {
-    if (room_by_z.empty())
+    if (room_by_block.empty())
     {
         for (auto r = rooms.begin(); r != rooms.end(); r++)
         {
@@ -4358,12 +4568,12 @@ room *Plan::find_room_at(df::coord t)
         return nullptr;
     }
 
-    auto by_z = room_by_z.find(t.z);
-    if (by_z == room_by_z.end())
+    auto block = room_by_block.find(df::coord(t.x >> 4, t.y >> 4, t.z));
+    if (block == room_by_block.end())
     {
         return nullptr;
     }
-    for (auto r = by_z->second.begin(); r != by_z->second.end(); r++)
+    for (auto r = block->second.begin(); r != block->second.end(); r++)
     {
         if ((*r)->safe_include(t))
         {
@@ -4432,6 +4642,18 @@ df::coord Plan::find_tree_base(df::coord t)
 
 void Plan::fixup_open(color_ostream & out, room *r)
 {
+    // fixup_open_tile only acts on open space and floors
+    if (!MapQuery::any(MapQuery::open, r->min, r->max) && !MapQuery::any(MapQuery::floor, r->min, r->max))
+        return;
+
+    // first furniture of the layout on each tile
+    std::map<df::coord, furniture *> layout;
+    for (auto it = r->layout.begin(); it != r->layout.end(); it++)
+    {
+        furniture *f = *it;
+        layout.insert(std::make_pair(r->min + df::coord(f->x, f->y, f->z), f));
+    }
+
     for (int16_t x = r->min.x; x <= r->max.x; x++)
     {
         for (int16_t y = r->min.y; y <= r->max.y; y++)
@@ -4439,24 +4661,16 @@ void Plan::fixup_open(color_ostream & out, room *r)
             for (int16_t z = r->min.z; z <= r->max.z; z++)
             {
                 df::coord t(x, y, z);
-                for (auto it = r->layout.begin(); it != r->layout.end(); it++)
+                auto f = layout.find(t);
+                if (f != layout.end())
                 {
-                    furniture *f = *it;
-                    df::coord ft = r->min + df::coord(f->x, f->y, f->z);
-                    if (t == ft)
+                    if (f->second->construction == construction_type::NONE)
                     {
-                        if (f->construction == construction_type::NONE)
-                        {
-                            fixup_open_tile(out, r, ft, f->dig, f);
-                        }
-                        t.clear();
-                        break;
+                        fixup_open_tile(out, r, t, f->second->dig, f->second);
                     }
+                    continue;
                 }
-                if (t.isValid())
-                {
-                    fixup_open_tile(out, r, t, r->dig_mode(t));
-                }
+                fixup_open_tile(out, r, t, r->dig_mode(t));
             }
         }
     }
@@ -4524,13 +4738,15 @@ void Plan::fixup_open_helper(color_ostream & out, room *r, df::coord t, df::cons
         f->y = t.y - r->min.y;
         f->z = t.z - r->min.z;
         r->layout.push_back(f);
+        index_furniture(r, f);
     }
     if (f->construction != c)
     {
         ai->debug(out, stl_sprintf("plan fixup_open %s %s(%d, %d, %d)", describe_room(r).c_str(), ENUM_KEY_STR(construction_type, c).c_str(), f->x, f->y, f->z));
-        tasks.push_back(new task("furnish", r, f));
+        add_task(task_type::furnish, r, f);
     }
     f->construction = c;
+    dirty(f);
 }
 
 // XXX
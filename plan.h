@@ -7,9 +7,11 @@
 #include <list>
 #include <map>
 #include <set>
+#include <unordered_map>
 
 #include "df/coord.h"
 #include "df/tile_dig_designation.h"
+#include "df/tiletype.h"
 #include "df/tiletype_material.h"
 #include "df/tiletype_shape_basic.h"
 
@@ -22,20 +24,145 @@ namespace df
 }
 
 class AI;
+struct plan_save_job;
+struct plan_saver;
+
+namespace task_type
+{
+    // kept in alphabetical order for Plan::status
+    enum type
+    {
+        checkconstruct,
+        checkfurnish,
+        checkidle,
+        checkrooms,
+        construct_activityzone,
+        construct_stockpile,
+        construct_workshop,
+        dig_cistern,
+        dig_garbage,
+        digroom,
+        furnish,
+        monitor_cistern,
+        setup_farmplot,
+        wantdig,
+
+        _task_type_count
+    };
+}
+
+std::ostream & operator <<(std::ostream & stream, task_type::type type);
+
+namespace task_priority
+{
+    enum priority
+    {
+        urgent,
+        normal,
+        low,
+
+        _task_priority_count
+    };
+}
+
+std::ostream & operator <<(std::ostream & stream, task_priority::priority priority);
 
 struct task
 {
-    std::string type;
+    task_type::type type;
     room *r;
     furniture *f;
-
-    task(std::string type, room *r = nullptr, furniture *f = nullptr) :
-        type(type), r(r), f(f)
+    // world->frame_counter when the task was queued
+    int32_t queued;
+    // failed attempts in a row, and the bg pass to try again on
+    uint32_t fails;
+    uint32_t retry_pass;
+    // what the task added to Plan::nrdig and nrdigging, the room may have
+    // changed by the time it is removed
+    uint32_t dig_weight;
+    bool digging;
+
+    task(task_type::type type, room *r = nullptr, furniture *f = nullptr, int32_t queued = 0) :
+        type(type), r(r), f(f), queued(queued), fails(0), retry_pass(0), dig_weight(0), digging(false)
     {
     }
     ~task()
     {
     }
+
+    // allocated from a free list, see plan.cpp
+    static void *operator new(size_t size);
+    static void operator delete(void *ptr);
+};
+
+struct task_wait_stats
+{
+    size_t done;
+    int64_t total_ticks;
+    int32_t max_ticks;
+};
+
+// where surface_tile_at stopped walking down a map column
+struct surface_column
+{
+    enum kind_t
+    {
+        unknown,
+        none,
+        water,
+        ground,
+        below_tree,
+    };
+
+    kind_t kind;
+    int16_t z;
+
+    surface_column() : kind(unknown), z(-1)
+    {
+    }
+};
+
+// tiletypes of a 16x16 block column from the lowest surface_column in it
+// up to the top of the map, to notice anything that can move a surface:
+// digging, constructions, tree crowns growing over it
+struct surface_block
+{
+    // world->frame_counter when last compared to the map
+    int32_t frame;
+    int16_t min_z;
+    // 256 tiletypes per z-level from min_z up, as in df::map_block
+    std::vector<df::tiletype> tiles;
+
+    surface_block() : frame(-1), min_z(0), tiles()
+    {
+    }
+};
+
+// bitplanes of a 16x16 map block for the map_tile_* checks, one uint16_t
+// per row of the block with bit x set for the tile at x
+struct map_block_masks
+{
+    enum plane
+    {
+        // wall of stone, mineral, soil or root (or ice when allowed)
+        rock,
+        // hidden rock, or visible tile without deep water (or ice)
+        nocavern,
+        // hidden floor without water
+        cavernfloor,
+
+        _plane_count
+    };
+
+    // world->frame_counter when built, and Plan::allow_ice at that time
+    int32_t frame;
+    bool allow_ice;
+    bool present;
+    uint16_t rows[_plane_count][16];
+
+    map_block_masks() : frame(-1), allow_ice(false), present(false), rows()
+    {
+    }
 };
 
 class Plan
@@ -43,13 +170,36 @@ class Plan
     AI *ai;
     OnupdateCallback *onupdate_handle;
     size_t nrdig;
-    std::list<task *> tasks;
-    std::list<task *>::iterator bg_idx;
+    // non-corridor wantdig and digroom tasks
+    size_t nrdigging;
+    // one queue per priority, each in the order the tasks were added
+    std::list<task *> tasks[task_priority::_task_priority_count];
+    std::list<task *>::iterator bg_idx[task_priority::_task_priority_count];
+    bool bg_active;
+    uint32_t bg_pass;
+    int32_t bg_pass_start;
+    int32_t bg_pass_ticks;
+    // the task the bg stepper is running, reset if it gets removed
+    task *bg_current;
+    size_t task_count[task_type::_task_type_count];
+    task_wait_stats task_wait[task_type::_task_type_count];
     std::vector<room *> rooms;
     std::map<room_type::type, std::vector<room *>> room_category;
-    std::map<int32_t, std::set<room *>> room_by_z;
+    // rooms whose safe_include area touches a 16x16 map block, keyed by
+    // (x / 16, y / 16, z)
+    std::map<df::coord, std::set<room *>> room_by_block;
     std::vector<room *> corridors;
     std::set<std::string> cache_nofurnish;
+    // the last snapshot handed to the save thread, for journal saves
+    uint64_t snapshot_id;
+    std::vector<room *> snapshot_rooms;
+    std::vector<furniture *> snapshot_furniture;
+    // changed since the last save, for the next journal entry
+    std::set<room *> dirty_rooms;
+    std::set<furniture *> dirty_furniture;
+    bool dirty_tasks;
+    // encodes and writes saves in the background, see plan_persist.cpp
+    plan_saver *saver;
 public:
     room *fort_entrance;
     std::map<int32_t, std::set<df::coord>> map_veins;
@@ -66,13 +216,24 @@ private:
     std::map<int32_t, std::vector<std::pair<df::coord, df::tile_dig_designation>>> map_vein_queue;
     std::set<df::coord> dug_veins;
     int32_t noblesuite;
-    int16_t cavern_max_level;
+    // (wall, cavern floor) pairs found by discover_caverns, next at the back
+    std::vector<std::pair<df::coord, df::coord>> cavern_candidates;
+    bool caverns_discovered;
+    // z-level of the fort body under fort_entrance, see scan_fort_entrance
+    int16_t fort_body_z;
     int32_t last_idle_year;
     bool allow_ice;
 public:
     bool past_initial_phase;
 private:
     bool cistern_channel_requested;
+    // indexed by x + y * world->map.x_count, see surface_tile_at
+    std::vector<surface_column> surface_columns;
+    // indexed by map block x + y * x_count_block
+    std::vector<surface_block> surface_blocks;
+    // indexed by map block x + y * x_count_block + z * x_count_block *
+    // y_count_block, rebuilt once per tick when asked for
+    std::vector<map_block_masks> block_masks;
 
 public:
     Plan(AI *ai);
@@ -84,15 +245,28 @@ public:
 
     command_result persist(color_ostream & out);
     command_result unpersist(color_ostream & out);
+    void persist_wait();
 
     void update(color_ostream & out);
 
-    void save(std::ostream & out);
-    void load(std::istream & in);
+    void save_image(plan_save_job & job);
+    void save_json(std::ostream & out);
+    // reads both the binary format and legacy JSON
+    bool load(std::istream & in);
+    void load_journal(std::istream & in);
 
     static uint16_t getTileWalkable(df::coord t);
 
-    task *is_digging();
+    // call after changing a room or furniture, so the next save journals it
+    void dirty(room *r);
+    void dirty(furniture *f);
+
+    void add_task(task_type::type type, room *r = nullptr, furniture *f = nullptr);
+    std::list<task *>::iterator remove_task(std::list<task *>::iterator it);
+    void clear_tasks();
+    size_t count_tasks();
+
+    bool is_digging();
     bool is_idle();
 
     void new_citizen(color_ostream & out, int32_t uid);
@@ -197,6 +371,9 @@ public:
     bool map_tile_in_rock(df::coord tile);
     bool map_tile_nocavern(df::coord tile);
     bool map_tile_cavernfloor(df::coord tile);
+    const map_block_masks *get_block_masks(int16_t bx, int16_t by, int16_t z);
+    uint32_t mask_row(map_block_masks::plane p, int16_t bx, int16_t ty, int16_t z);
+    uint16_t mask_area_row(map_block_masks::plane p, int16_t bx, int16_t ty, int16_t z);
 
     df::coord surface_tile_at(int16_t tx, int16_t ty, bool allow_trees = false);
 
@@ -204,6 +381,8 @@ public:
     std::string report();
 
     void categorize_all();
+    void index_room(room *r);
+    void index_furniture(room *r, furniture *f);
 
     std::string describe_room(room *r);
     std::string describe_furniture(furniture *f);
@@ -216,6 +395,14 @@ public:
     static df::coord find_tree_base(df::coord t);
 
 private:
+    void index_plan(std::vector<room *> & all_rooms, std::vector<furniture *> & all_furniture, std::unordered_map<room *, size_t> & room_index, std::unordered_map<furniture *, size_t> & furniture_index);
+    bool load_binary(std::istream & in);
+    void load_json(std::istream & in);
+
+    void index_surface();
+    void index_surface_block(int16_t bx, int16_t by);
+    bool surface_block_changed(int16_t bx, int16_t by);
+
     void fixup_open(color_ostream & out, room *r);
     void fixup_open_tile(color_ostream & out, room *r, df::coord t, df::tile_dig_designation d, furniture *f = nullptr);
     void fixup_open_helper(color_ostream & out, room *r, df::coord t, df::construction_type c, furniture *f = nullptr);
@@ -2,11 +2,16 @@
 #include "plan.h"
 #include "room.h"
 
+#include <algorithm>
+#include <cstdlib>
 #include <tuple>
 
 #include "modules/Buildings.h"
+#include "modules/Maps.h"
 
 #include "df/building_civzonest.h"
+#include "df/coord2d.h"
+#include "df/map_block.h"
 #include "df/world.h"
 
 REQUIRE_GLOBAL(world);
@@ -181,65 +186,341 @@ command_result Plan::setup_blueprint(color_ostream & out)
     return CR_OK;
 }
 
-// search a valid tile for fortress entrance
-command_result Plan::scan_fort_entrance(color_ostream & out)
+// what scan_fort_entrance needs to know about each tile, copied out of the
+// map so that worker threads can score sites without touching the game
+struct fort_site_snapshot
 {
-    // map center
-    int16_t cx = world->map.x_count / 2;
-    int16_t cy = world->map.y_count / 2;
-    df::coord center = surface_tile_at(cx, cy, true);
+    enum flag
+    {
+        // flat, dry, revealed and free of buildings
+        entrance_floor = 1 << 0,
+        // wall the entrance can stand on
+        entrance_base = 1 << 1,
+        // wall the fort body can be dug into below the entrance level
+        body_deep = 1 << 2,
+        // same, also allowing soil, for the entrance level and above
+        body_shallow = 1 << 3,
+        // see map_block_masks::nocavern
+        nocavern = 1 << 4,
+        water_table = 1 << 5,
+        mineral = 1 << 6,
+    };
+
+    // map coordinates of tile (0, 0), the snapshot only covers the part
+    // of the map the candidate sites can reach
+    int16_t x0, y0;
+    int16_t xs, ys, zs;
+    std::vector<uint8_t> tiles;
+    // surface_tile_at(x0 + x, y0 + y).z, or -1
+    std::vector<int16_t> surface;
+    // surface_tile_at(x0 + x, y0 + y, true).isValid()
+    std::vector<bool> surface_trees;
+
+    size_t index(int16_t x, int16_t y, int16_t z) const
+    {
+        return size_t(x) + size_t(xs) * (size_t(y) + size_t(ys) * size_t(z));
+    }
+    bool has(int16_t x, int16_t y, int16_t z, uint8_t f) const
+    {
+        return (tiles[index(x, y, z)] & f) != 0;
+    }
+};
+
+// number of tiles with a snapshot flag in any box, in constant time. the
+// sums wrap around at 65536, which does not matter as long as the box is
+// smaller than that.
+struct summed_volume
+{
+    int16_t xs, ys, zs;
+    std::vector<uint16_t> sums;
 
-    df::coord ent0 = spiral_search(center, [this](df::coord t0) -> bool
+    summed_volume(const fort_site_snapshot & snap, uint8_t f) :
+        xs(snap.xs), ys(snap.ys), zs(snap.zs),
+        sums((size_t(xs) + 1) * (size_t(ys) + 1) * (size_t(zs) + 1), 0)
+    {
+        for (int16_t z = 0; z < zs; z++)
+        {
+            for (int16_t y = 0; y < ys; y++)
             {
-                // test the whole map for 3x5 clear spots
-                df::coord t = surface_tile_at(t0.x, t0.y);
-                if (!t.isValid())
-                    return false;
+                for (int16_t x = 0; x < xs; x++)
+                {
+                    sums[index(x + 1, y + 1, z + 1)] = uint16_t((snap.has(x, y, z, f) ? 1 : 0) +
+                            sums[index(x, y + 1, z + 1)] + sums[index(x + 1, y, z + 1)] + sums[index(x + 1, y + 1, z)] -
+                            sums[index(x, y, z + 1)] - sums[index(x, y + 1, z)] - sums[index(x + 1, y, z)] +
+                            sums[index(x, y, z)]);
+                }
+            }
+        }
+    }
+
+    size_t index(int16_t x, int16_t y, int16_t z) const
+    {
+        return size_t(x) + (size_t(xs) + 1) * (size_t(y) + (size_t(ys) + 1) * size_t(z));
+    }
 
-                // make sure we're not too close to the edge of the map.
-                if (t.x + MinX < 0 || t.x + MaxX >= world->map.x_count ||
-                        t.y + MinY < 0 || t.y + MaxY >= world->map.y_count ||
-                        t.z + MinZ < 0 || t.z + MaxZ >= world->map.z_count)
+    // min and max included, the box must be inside the snapshot
+    int32_t count(df::coord min, df::coord max) const
+    {
+        return uint16_t(sums[index(max.x + 1, max.y + 1, max.z + 1)] -
+                sums[index(min.x, max.y + 1, max.z + 1)] - sums[index(max.x + 1, min.y, max.z + 1)] - sums[index(max.x + 1, max.y + 1, min.z)] +
+                sums[index(min.x, min.y, max.z + 1)] + sums[index(min.x, max.y + 1, min.z)] + sums[index(max.x + 1, min.y, min.z)] -
+                sums[index(min.x, min.y, min.z)]);
+    }
+};
+
+struct fort_site_score
+{
+    bool valid;
+    int16_t body_z;
+    int32_t score;
+    int16_t dist;
+};
+
+// the score of a fort entrance at column (x, y) of the snapshot, whose map
+// center is at (cx, cy): -1 per two tiles away from the map center, -16 per
+// z-level dug before the body fits, +8 per z-level of dry rock below the
+// body (up to 8), and +1 per 16 mineral tiles in the body (up to 64)
+static fort_site_score score_fort_site(const fort_site_snapshot & snap, const summed_volume & deep, const summed_volume & shallow, const summed_volume & mineral, int16_t x, int16_t y, int16_t cx, int16_t cy)
+{
+    fort_site_score res;
+    res.valid = false;
+    res.body_z = -1;
+    res.score = 0;
+    res.dist = std::max(std::abs(x - cx), std::abs(y - cy));
+
+    int16_t z = snap.surface[x + snap.xs * y];
+    if (z < 0)
+        return res;
+
+    // make sure we're not too close to the edge of the map (or of the
+    // snapshot, which only happens where the map ends too).
+    if (x + Plan::MinX < 0 || x + Plan::MaxX >= snap.xs ||
+            y + Plan::MinY < 0 || y + Plan::MaxY >= snap.ys ||
+            z + Plan::MinZ < 0 || z + Plan::MaxZ >= snap.zs)
+    {
+        return res;
+    }
+
+    // 3x5 clear spot
+    for (int16_t _x = -1; _x <= 1; _x++)
+    {
+        for (int16_t _y = -2; _y <= 2; _y++)
+        {
+            if (!snap.has(x + _x, y + _y, z - 1, fort_site_snapshot::entrance_base))
+                return res;
+            if (!snap.has(x + _x, y + _y, z, fort_site_snapshot::entrance_floor))
+                return res;
+        }
+    }
+    for (int16_t _x = -3; _x <= 3; _x++)
+    {
+        for (int16_t _y = -4; _y <= 4; _y++)
+        {
+            if (!snap.surface_trees[(x + _x) + snap.xs * (y + _y)])
+                return res;
+        }
+    }
+
+    // same as scan_fort_body used to do tile by tile
+    int32_t level = (Plan::MaxX - Plan::MinX + 1) * (Plan::MaxY - Plan::MinY + 1);
+    for (int16_t cz1 = z; cz1 + Plan::MinZ >= 0; cz1--)
+    {
+        // stop searching if we hit a cavern or an aquifer inside our main
+        // staircase
+        bool stop = false;
+        int16_t sz = cz1 + Plan::MaxZ;
+        for (int16_t sy = y - 1; !stop && sy <= y + 1; sy++)
+        {
+            if (snap.has(x, sy, sz, fort_site_snapshot::water_table))
+                stop = true;
+            for (int16_t dx = -1; !stop && dx <= 1; dx++)
+            {
+                for (int16_t dy = -1; !stop && dy <= 1; dy++)
                 {
-                    return false;
+                    if (sy + dy >= 0 && sy + dy < snap.ys && !snap.has(x + dx, sy + dy, sz, fort_site_snapshot::nocavern))
+                        stop = true;
                 }
+            }
+        }
+        if (stop)
+            return res;
+
+        df::coord min(x + Plan::MinX, y + Plan::MinY, cz1 + Plan::MinZ);
+        df::coord max(x + Plan::MaxX, y + Plan::MaxY, cz1 + Plan::MaxZ);
+        if (deep.count(min, df::coord(max, cz1 - 1)) != level * -Plan::MinZ)
+            continue;
+        if (shallow.count(df::coord(min, cz1), max) != level * (Plan::MaxZ + 1))
+            continue;
+
+        int16_t dry = 0;
+        while (dry < 8 && min.z - dry - 1 >= 0 && !snap.has(x, y, min.z - dry - 1, fort_site_snapshot::water_table))
+        {
+            dry++;
+        }
 
-                for (int16_t _x = -1; _x <= 1; _x++)
+        res.valid = true;
+        res.body_z = cz1;
+        res.score = std::min(mineral.count(min, max), 1024) / 16 + 8 * dry - 16 * (z - cz1) - res.dist / 2;
+        return res;
+    }
+    return res;
+}
+
+// copy the tile flags of the map columns from min to max (included) out of
+// the map, up to the highest z-level any site could use
+static void snapshot_fort_sites(Plan *plan, fort_site_snapshot & snap, bool allow_ice, df::coord2d min, df::coord2d max)
+{
+    snap.x0 = min.x;
+    snap.y0 = min.y;
+    snap.xs = max.x - min.x + 1;
+    snap.ys = max.y - min.y + 1;
+    snap.surface.assign(size_t(snap.xs) * size_t(snap.ys), -1);
+    snap.surface_trees.assign(size_t(snap.xs) * size_t(snap.ys), false);
+
+    int16_t top = 0;
+    for (int16_t y = 0; y < snap.ys; y++)
+    {
+        for (int16_t x = 0; x < snap.xs; x++)
+        {
+            df::coord t = plan->surface_tile_at(snap.x0 + x, snap.y0 + y);
+            if (t.isValid())
+            {
+                snap.surface[x + snap.xs * y] = t.z;
+                top = std::max(top, t.z);
+            }
+            snap.surface_trees[x + snap.xs * y] = plan->surface_tile_at(snap.x0 + x, snap.y0 + y, true).isValid();
+        }
+    }
+    snap.zs = std::min(int16_t(top + Plan::MaxZ + 1), int16_t(world->map.z_count));
+
+    snap.tiles.assign(size_t(snap.xs) * size_t(snap.ys) * size_t(snap.zs), 0);
+    for (int16_t z = 0; z < snap.zs; z++)
+    {
+        for (int16_t by = min.y / 16; by <= max.y / 16; by++)
+        {
+            for (int16_t bx = min.x / 16; bx <= max.x / 16; bx++)
+            {
+                df::map_block *b = Maps::getBlock(bx, by, z);
+                for (int16_t dy = 0; dy < 16; dy++)
                 {
-                    for (int16_t _y = -2; _y <= 2; _y++)
+                    for (int16_t dx = 0; dx < 16; dx++)
                     {
-                        df::tiletype tt = *Maps::getTileType(t + df::coord(_x, _y, -1));
-                        if (ENUM_ATTR(tiletype, shape, tt) != tiletype_shape::WALL)
-                            return false;
+                        int16_t x = bx * 16 + dx - snap.x0;
+                        int16_t y = by * 16 + dy - snap.y0;
+                        if (x < 0 || y < 0 || x >= snap.xs || y >= snap.ys)
+                            continue;
+                        uint8_t & f = snap.tiles[snap.index(x, y, z)];
+                        if (!b)
+                        {
+                            // map_tile_nocavern skips missing tiles
+                            f = fort_site_snapshot::nocavern;
+                            continue;
+                        }
+
+                        df::tiletype tt = b->tiletype[dx][dy];
+                        df::tile_designation td = b->designation[dx][dy];
+                        df::tiletype_shape ts = ENUM_ATTR(tiletype, shape, tt);
                         df::tiletype_material tm = ENUM_ATTR(tiletype, material, tt);
-                        if (!allow_ice &&
-                                tm != tiletype_material::STONE &&
-                                tm != tiletype_material::MINERAL &&
-                                tm != tiletype_material::SOIL &&
-                                tm != tiletype_material::ROOT)
-                            return false;
-                        df::coord ttt = t + df::coord(_x, _y, 0);
-                        if (ENUM_ATTR(tiletype, shape, *Maps::getTileType(ttt)) != tiletype_shape::FLOOR)
-                            return false;
-                        df::tile_designation td = *Maps::getTileDesignation(ttt);
-                        if (td.bits.flow_size != 0 || td.bits.hidden)
-                            return false;
-                        if (Buildings::findAtTile(ttt))
-                            return false;
+                        bool rock = tm == tiletype_material::STONE || tm == tiletype_material::MINERAL || tm == tiletype_material::SOIL || tm == tiletype_material::ROOT;
+                        bool ice = tm == tiletype_material::FROZEN_LIQUID;
+
+                        if (ts == tiletype_shape::FLOOR && td.bits.flow_size == 0 && !td.bits.hidden && b->occupancy[dx][dy].bits.building == tile_building_occ::None)
+                            f |= fort_site_snapshot::entrance_floor;
+                        if (ts == tiletype_shape::WALL && (allow_ice || rock))
+                            f |= fort_site_snapshot::entrance_base;
+                        if (ts == tiletype_shape::WALL && !td.bits.water_table)
+                        {
+                            if (tm == tiletype_material::STONE || tm == tiletype_material::MINERAL || (allow_ice && ice))
+                                f |= fort_site_snapshot::body_deep | fort_site_snapshot::body_shallow;
+                            else if (tm == tiletype_material::SOIL || tm == tiletype_material::ROOT)
+                                f |= fort_site_snapshot::body_shallow;
+                        }
+                        bool wall = ENUM_ATTR(tiletype_shape, basic_shape, ts) == tiletype_shape_basic::Wall;
+                        if (td.bits.hidden ? (wall && (rock || (allow_ice && ice))) : (td.bits.flow_size < 4 && (allow_ice || !ice)))
+                            f |= fort_site_snapshot::nocavern;
+                        if (td.bits.water_table)
+                            f |= fort_site_snapshot::water_table;
+                        if (tm == tiletype_material::MINERAL)
+                            f |= fort_site_snapshot::mineral;
                     }
                 }
-                for (int16_t _x = -3; _x <= 3; _x++)
-                {
-                    for (int16_t _y = -4; _y <= 4; _y++)
+            }
+        }
+    }
+}
+
+// search a valid tile for fortress entrance
+//
+// every column within 100 tiles of the map center is scored on worker
+// threads from a snapshot of the part of the map those sites can use, and
+// the best one wins. ties go to the site closest to the center, then to
+// the lowest x, then the lowest y, so the result does not depend on the
+// number of threads.
+command_result Plan::scan_fort_entrance(color_ostream & out)
+{
+    // map center
+    int16_t cx = world->map.x_count / 2;
+    int16_t cy = world->map.y_count / 2;
+
+    // candidate sites, and around them the area their fort body may cover
+    df::coord2d min(std::max(0, cx - 100), std::max(0, cy - 100));
+    df::coord2d max(std::min(world->map.x_count - 1, cx + 100), std::min(world->map.y_count - 1, cy + 100));
+    df::coord2d snap_min(std::max(0, min.x + Plan::MinX), std::max(0, min.y + Plan::MinY));
+    df::coord2d snap_max(std::min(world->map.x_count - 1, max.x + Plan::MaxX), std::min(world->map.y_count - 1, max.y + Plan::MaxY));
+
+    // the snapshot is at most 297x245 columns by the surface height plus
+    // MaxZ + 1 levels, one byte per tile, and each summed_volume takes two
+    // bytes per tile. with 200 levels that is about 15 MB for the
+    // snapshot and 29 MB per table (103 MB in all), freed on return.
+    fort_site_snapshot snap;
+    snapshot_fort_sites(this, snap, allow_ice, snap_min, snap_max);
+    summed_volume deep(snap, fort_site_snapshot::body_deep);
+    summed_volume shallow(snap, fort_site_snapshot::body_shallow);
+    summed_volume mineral(snap, fort_site_snapshot::mineral);
+
+    // in snapshot coordinates from here on
+    cx -= snap.x0;
+    cy -= snap.y0;
+    std::vector<df::coord2d> candidates;
+    for (int16_t x = min.x; x <= max.x; x++)
+    {
+        for (int16_t y = min.y; y <= max.y; y++)
+        {
+            candidates.push_back(df::coord2d(x - snap.x0, y - snap.y0));
+        }
+    }
+
+    std::vector<fort_site_score> scores(candidates.size());
+    size_t nthreads = std::max(1u, std::min(8u, std::thread::hardware_concurrency()));
+    std::vector<std::thread> workers;
+    for (size_t w = 0; w < nthreads; w++)
+    {
+        workers.push_back(std::thread([&snap, &deep, &shallow, &mineral, &candidates, &scores, cx, cy, w, nthreads]()
                     {
-                        if (!surface_tile_at(t.x + _x, t.y + _y, true).isValid())
-                            return false;
-                    }
-                }
-                return true;
-            });
+                        for (size_t i = w; i < candidates.size(); i += nthreads)
+                        {
+                            scores[i] = score_fort_site(snap, deep, shallow, mineral, candidates[i].x, candidates[i].y, cx, cy);
+                        }
+                    }));
+    }
+    for (auto it = workers.begin(); it != workers.end(); it++)
+    {
+        it->join();
+    }
 
-    if (!ent0.isValid())
+    size_t best = candidates.size();
+    for (size_t i = 0; i < candidates.size(); i++)
+    {
+        if (!scores[i].valid)
+            continue;
+        if (best == candidates.size() || scores[i].score > scores[best].score ||
+                (scores[i].score == scores[best].score && scores[i].dist < scores[best].dist))
+        {
+            best = i;
+        }
+    }
+
+    if (best == candidates.size())
     {
         if (!allow_ice)
         {
@@ -248,11 +529,13 @@ command_result Plan::scan_fort_entrance(color_ostream & out)
             return scan_fort_entrance(out);
         }
 
-        ai->debug(out, "[ERROR] Can't find a fortress entrance spot. We need a 3x5 flat area with solid ground for at least 2 tiles on each side.");
+        ai->debug(out, "[ERROR] Can't find a fortress entrance spot. We need a 3x5 flat area with solid ground for at least 2 tiles on each side, and room for the fort below it.");
         return CR_FAILURE;
     }
 
-    df::coord ent = surface_tile_at(ent0.x, ent0.y);
+    df::coord ent(snap.x0 + candidates[best].x, snap.y0 + candidates[best].y, snap.surface[candidates[best].x + snap.xs * candidates[best].y]);
+    fort_body_z = scores[best].body_z;
+    ai->debug(out, stl_sprintf("fort site (%d, %d, %d) score %d, body at z=%d", ent.x, ent.y, ent.z, scores[best].score, fort_body_z));
 
     fort_entrance = new room(ent - df::coord(0, 1, 0), ent + df::coord(0, 1, 0), "main staircase - fort entrance");
     for (int i = 0; i < 3; i++)
@@ -275,82 +558,17 @@ command_result Plan::scan_fort_entrance(color_ostream & out)
 
 // search how much we need to dig to find a spot for the full fortress body
 // here we cheat and work as if the map was fully reveal()ed
+// the depth is found along with the entrance, see score_fort_site
 command_result Plan::scan_fort_body(color_ostream & out)
 {
-    // use a hardcoded fort layout
-    df::coord c = fort_entrance->pos();
-
-    for (int16_t cz1 = c.z; cz1 >= 0; cz1--)
+    if (fort_body_z < 0)
     {
-        bool stop = false;
-        // stop searching if we hit a cavern or an aquifer inside our main
-        // staircase
-        for (int16_t x = fort_entrance->min.x; !stop && x <= fort_entrance->max.x; x++)
-        {
-            for (int16_t y = fort_entrance->min.y; !stop && y <= fort_entrance->max.y; y++)
-            {
-                df::coord t(x, y, cz1 + MaxZ);
-                if (!map_tile_nocavern(t) || Maps::getTileDesignation(t)->bits.water_table)
-                    stop = true;
-            }
-        }
-        if (stop)
-        {
-            break;
-        }
-
-        auto check = [this, c, cz1, &stop](int16_t dx, int16_t dy, int16_t dz)
-        {
-            df::coord t = df::coord(c, cz1) + df::coord(dx, dy, dz);
-            df::tiletype tt = *Maps::getTileType(t);
-            df::tiletype_material tm = ENUM_ATTR(tiletype, material, tt);
-            if (ENUM_ATTR(tiletype, shape, tt) != tiletype_shape::WALL ||
-                    Maps::getTileDesignation(t)->bits.water_table ||
-                    (tm != tiletype_material::STONE &&
-                     tm != tiletype_material::MINERAL &&
-                     (!allow_ice || tm != tiletype_material::FROZEN_LIQUID) &&
-                     (dz < 0 || (tm != tiletype_material::SOIL &&
-                                 tm != tiletype_material::ROOT))))
-                stop = true;
-        };
-
-        for (int16_t dz = MinZ; !stop && dz <= MaxZ; dz++)
-        {
-            // scan perimeter first to quickly eliminate caverns / bad rock
-            // layers
-            for (int16_t dx = MinX; !stop && dx <= MaxX; dx++)
-            {
-                for (int16_t dy = MinY; !stop && dy <= MaxY; dy += MaxY - MinY)
-                {
-                    check(dx, dy, dz);
-                }
-            }
-            for (int16_t dx = MinX; !stop && dx <= MaxX; dx += MaxX - MinX)
-            {
-                for (int16_t dy = MinY + 1; !stop && dy <= MaxY - 1; dy++)
-                {
-                    check(dx, dy, dz);
-                }
-            }
-            // perimeter ok, full scan
-            for (int16_t dx = MinX + 1; !stop && dx <= MaxX - 1; dx++)
-            {
-                for (int16_t dy = MinY + 1; !stop && dy <= MaxY - 1; dy++)
-                {
-                    check(dx, dy, dz);
-                }
-            }
-        }
-
-        if (!stop)
-        {
-            fort_entrance->min.z = cz1;
-            return CR_OK;
-        }
+        ai->debug(out, "[ERROR] Too many caverns, cant find room for fort. We need more minerals!");
+        return CR_FAILURE;
     }
 
-    ai->debug(out, "[ERROR] Too many caverns, cant find room for fort. We need more minerals!");
-    return CR_FAILURE;
+    fort_entrance->min.z = fort_body_z;
+    return CR_OK;
 }
 
 // assign rooms in the space found by scan_fort_*
@@ -1789,36 +2007,115 @@ command_result Plan::setup_outdoor_gathering_zones(color_ostream &)
     return CR_OK;
 }
 
-command_result Plan::setup_blueprint_caverns(color_ostream & out)
+// label the hidden cavern floors of each z-level with their connected
+// regions, and remember for each region the first rock wall next to it in
+// the order the map used to be scanned: top z-level first, then x, then y
+void Plan::discover_caverns(color_ostream & out)
 {
-    df::coord wall;
-    wall.clear();
-    int16_t & z = cavern_max_level;
-    if (z == -1)
-    {
-        z = world->map.z_count - 1;
-    }
-    df::coord target;
-    for (; !wall.isValid() && z > 0; z--)
+    cavern_candidates.clear();
+
+    int16_t xs = world->map.x_count;
+    int16_t ys = world->map.y_count;
+    std::vector<uint16_t> in_rock(size_t(world->map.x_count_block) * size_t(ys));
+    std::vector<int32_t> region(size_t(xs) * size_t(ys));
+    std::vector<df::coord> stack;
+
+    for (int16_t z = world->map.z_count - 1; z > 0; z--)
     {
-        ai->debug(out, stl_sprintf("outpost: searching z-level %d", z));
-        for (int16_t x = 0; !wall.isValid() && x < world->map.x_count; x++)
+        std::fill(region.begin(), region.end(), -1);
+        int32_t regions = 0;
+        for (int16_t x = 0; x < xs; x++)
         {
-            for (int16_t y = 0; !wall.isValid() && y < world->map.y_count; y++)
+            for (int16_t y = 0; y < ys; y++)
             {
-                df::coord t(x, y, z);
-                if (!map_tile_in_rock(t))
+                if (region[x + y * xs] != -1 || !map_tile_cavernfloor(df::coord(x, y, z)))
                     continue;
-                // find a floor next to the wall
-                target = spiral_search(t, 2, 2, [this](df::coord _t) -> bool
+
+                region[x + y * xs] = regions;
+                stack.push_back(df::coord(x, y, z));
+                while (!stack.empty())
+                {
+                    df::coord t = stack.back();
+                    stack.pop_back();
+                    for (int16_t dx = -1; dx <= 1; dx++)
+                    {
+                        for (int16_t dy = -1; dy <= 1; dy++)
                         {
-                            return map_tile_cavernfloor(_t);
+                            df::coord n = t + df::coord(dx, dy, 0);
+                            if (n.x < 0 || n.y < 0 || n.x >= xs || n.y >= ys)
+                                continue;
+                            if (region[n.x + n.y * xs] != -1 || !map_tile_cavernfloor(n))
+                                continue;
+                            region[n.x + n.y * xs] = regions;
+                            stack.push_back(n);
+                        }
+                    }
+                }
+                regions++;
+            }
+        }
+        if (regions == 0)
+            continue;
+
+        for (int16_t bx = 0; bx < world->map.x_count_block; bx++)
+        {
+            for (int16_t y = 0; y < ys; y++)
+            {
+                in_rock[bx * ys + y] = mask_area_row(map_block_masks::rock, bx, y, z);
+            }
+        }
+
+        std::vector<bool> found(regions, false);
+        int32_t left = regions;
+        for (int16_t x = 0; left > 0 && x < xs; x++)
+        {
+            for (int16_t y = 0; left > 0 && y < ys; y++)
+            {
+                if (!((in_rock[(x >> 4) * ys + y] >> (x & 0xf)) & 1))
+                    continue;
+                df::coord t(x, y, z);
+                // find a floor of a new region next to the wall
+                df::coord target = spiral_search(t, 2, 2, [this, &region, &found, xs](df::coord _t) -> bool
+                        {
+                            return map_tile_cavernfloor(_t) && !found[region[_t.x + _t.y * xs]];
                         });
                 if (target.isValid())
-                    wall = t;
+                {
+                    found[region[target.x + target.y * xs]] = true;
+                    left--;
+                    cavern_candidates.push_back(std::make_pair(t, target));
+                }
             }
         }
     }
+
+    // pop from the back
+    std::reverse(cavern_candidates.begin(), cavern_candidates.end());
+    caverns_discovered = true;
+
+    ai->debug(out, stl_sprintf("outpost: found %d cavern wall tiles", int(cavern_candidates.size())));
+}
+
+command_result Plan::setup_blueprint_caverns(color_ostream & out)
+{
+    if (!caverns_discovered)
+    {
+        discover_caverns(out);
+    }
+
+    df::coord wall, target;
+    wall.clear();
+    while (!wall.isValid() && !cavern_candidates.empty())
+    {
+        auto c = cavern_candidates.back();
+        cavern_candidates.pop_back();
+        // the cavern may have been found or dug into since
+        if (map_tile_in_rock(c.first) && map_tile_cavernfloor(c.second))
+        {
+            wall = c.first;
+            target = c.second;
+        }
+    }
     if (!wall.isValid())
     {
         ai->debug(out, "outpost: could not find a cavern wall tile");
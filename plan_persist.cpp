@@ -0,0 +1,1603 @@
+#include "ai.h"
+#include "plan.h"
+#include "population.h"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdio>
+#include <fstream>
+#include <list>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <unordered_map>
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+#include "jsoncpp.h"
+
+#include "modules/World.h"
+
+// df-ai-plan.dat starts with plan_magic and a version number, followed by
+// the snapshot id, the room, furniture and task counts and then one record
+// per object. Files with another version are not read.
+// Every record is prefixed with its length in bytes. Fields are only
+// ever added at the end of a record, so older readers skip them and
+// newer readers use defaults for fields missing from older files.
+// Integers are LEB128 varints, signed ones zigzag encoded. Enums are
+// saved by name.
+// Files that do not start with plan_magic are read as legacy JSON.
+//
+// Autosaves between snapshots append to df-ai-plan.journal instead. Each
+// journal entry is a journal_entry record holding the snapshot id, the
+// room and furniture records that changed (prefixed with their index),
+// the task list if it changed (after a journal_tasks record), and a
+// journal_end record. Entries for another snapshot, cut short by a crash
+// or holding an unreadable record are ignored.
+static const char plan_magic[4] = { 'D', 'F', 'A', 'I' };
+static const uint32_t plan_version = 3;
+
+enum journal_record
+{
+    journal_entry = 1,
+    journal_room,
+    journal_furniture,
+    journal_task,
+    journal_end,
+    journal_tasks,
+};
+
+struct plan_writer
+{
+    std::ostream & out;
+    std::string record;
+
+    plan_writer(std::ostream & out) : out(out), record() {}
+
+    static void put_uint(std::string & buf, uint64_t v)
+    {
+        while (v >= 0x80)
+        {
+            buf.push_back(char(uint8_t(v) | 0x80));
+            v >>= 7;
+        }
+        buf.push_back(char(v));
+    }
+    void varuint(uint64_t v) { put_uint(record, v); }
+    void varint(int64_t v) { varuint((uint64_t(v) << 1) ^ uint64_t(v >> 63)); }
+    void boolean(bool v) { record.push_back(v ? 1 : 0); }
+    void str(const std::string & v)
+    {
+        varuint(v.size());
+        record += v;
+    }
+    void coord(df::coord v)
+    {
+        varint(v.x);
+        varint(v.y);
+        varint(v.z);
+    }
+    void ids(const std::set<int32_t> & v)
+    {
+        varuint(v.size());
+        for (auto it = v.begin(); it != v.end(); it++)
+        {
+            varint(*it);
+        }
+    }
+    // write the current record (or the header) and start a new one
+    void end_record(bool length_prefix = true)
+    {
+        if (length_prefix)
+        {
+            std::string len;
+            put_uint(len, record.size());
+            out.write(len.data(), len.size());
+        }
+        out.write(record.data(), record.size());
+        record.clear();
+    }
+};
+
+struct plan_reader
+{
+    std::istream & in;
+    std::string record;
+    size_t pos;
+
+    plan_reader(std::istream & in) : in(in), record(), pos(0) {}
+
+    // bytes left in the stream, or -1 if it cannot seek
+    static std::streamoff remaining(std::istream & in)
+    {
+        std::streampos here = in.tellg();
+        if (here == std::streampos(-1))
+            return -1;
+        in.seekg(0, std::ios::end);
+        std::streampos end = in.tellg();
+        in.seekg(here);
+        return end - here;
+    }
+
+    static bool get_uint(std::istream & in, uint64_t & v)
+    {
+        v = 0;
+        for (int shift = 0; shift < 64; shift += 7)
+        {
+            int c = in.get();
+            if (c == EOF)
+                return false;
+            v |= uint64_t(c & 0x7f) << shift;
+            if (!(c & 0x80))
+                return true;
+        }
+        return false;
+    }
+    // read the next length-prefixed record, false at the end of the file
+    // or if the record is cut short
+    bool next_record()
+    {
+        uint64_t len;
+        pos = 0;
+        record.clear();
+        if (!get_uint(in, len))
+            return false;
+        // a corrupt length must not allocate more than the file holds
+        std::streamoff left = remaining(in);
+        if (left >= 0 && len > uint64_t(left))
+            return false;
+        record.resize(size_t(len));
+        in.read(&record[0], std::streamsize(len));
+        return in.gcount() == std::streamsize(len);
+    }
+    bool more() const { return pos < record.size(); }
+    // past the end of the record, return defaults
+    uint64_t varuint()
+    {
+        uint64_t v = 0;
+        for (int shift = 0; shift < 64 && pos < record.size(); shift += 7)
+        {
+            uint8_t c = uint8_t(record[pos++]);
+            v |= uint64_t(c & 0x7f) << shift;
+            if (!(c & 0x80))
+                break;
+        }
+        return v;
+    }
+    int64_t varint()
+    {
+        uint64_t v = varuint();
+        return int64_t(v >> 1) ^ -int64_t(v & 1);
+    }
+    bool boolean() { return pos < record.size() && record[pos++] != 0; }
+    std::string str()
+    {
+        size_t len = size_t(varuint());
+        if (len > record.size() - pos)
+            len = record.size() - pos;
+        std::string v = record.substr(pos, len);
+        pos += len;
+        return v;
+    }
+    df::coord coord()
+    {
+        df::coord v;
+        v.x = int16_t(varint());
+        v.y = int16_t(varint());
+        v.z = int16_t(varint());
+        return v;
+    }
+    void ids(std::set<int32_t> & v)
+    {
+        for (uint64_t n = varuint(); n > 0 && more(); n--)
+        {
+            v.insert(int32_t(varint()));
+        }
+    }
+};
+
+// number every room and furniture, corridors first
+void Plan::index_plan(std::vector<room *> & all_rooms, std::vector<furniture *> & all_furniture, std::unordered_map<room *, size_t> & room_index, std::unordered_map<furniture *, size_t> & furniture_index)
+{
+    auto add_furniture = [&all_furniture, &furniture_index](furniture *f)
+    {
+        if (furniture_index.count(f))
+            return;
+        furniture_index[f] = all_furniture.size();
+        all_furniture.push_back(f);
+    };
+
+    auto add_room = [add_furniture, &all_rooms, &room_index](room *r)
+    {
+        if (room_index.count(r))
+            return;
+        room_index[r] = all_rooms.size();
+        all_rooms.push_back(r);
+
+        for (auto it = r->layout.begin(); it != r->layout.end(); it++)
+        {
+            add_furniture(*it);
+        }
+    };
+
+    for (auto it = corridors.begin(); it != corridors.end(); it++)
+    {
+        add_room(*it);
+    }
+    for (auto it = rooms.begin(); it != rooms.end(); it++)
+    {
+        add_room(*it);
+    }
+}
+
+// 0 is null, anything else is index + 1
+template<typename T>
+static uint64_t write_ref(const std::unordered_map<T *, size_t> & index, T *p)
+{
+    return p ? index.at(p) + 1 : 0;
+}
+
+// false if the index is out of range
+template<typename T>
+static bool read_ref(const std::vector<T *> & all, uint64_t i, T *& p)
+{
+    if (i > all.size())
+        return false;
+    p = i ? all[size_t(i - 1)] : nullptr;
+    return true;
+}
+
+// plugin enums are saved by their operator<< name, so reordering them
+// keeps old saves readable
+template<typename T>
+static std::string enum_name(T v)
+{
+    std::ostringstream s;
+    s << v;
+    return s.str();
+}
+
+template<typename T>
+static bool read_enum_name(const std::string & name, T & v, int count)
+{
+    static std::map<std::string, T> names;
+    if (names.empty())
+    {
+        for (int i = 0; i < count; i++)
+        {
+            names[enum_name(T(i))] = T(i);
+        }
+    }
+    auto it = names.find(name);
+    if (it == names.end())
+    {
+        return false;
+    }
+    v = it->second;
+    return true;
+}
+
+// rooms, furniture and tasks as copied out of the plan on the game thread,
+// with their references numbered as by write_ref, for the save thread to
+// encode
+struct room_image
+{
+    room_status::status status;
+    room_type::type type;
+    std::string subtype;
+    std::string comment;
+    df::coord min, max;
+    std::vector<uint64_t> accesspath;
+    std::vector<uint64_t> layout;
+    int32_t owner;
+    int32_t bld_id;
+    int32_t squad_id;
+    int32_t level;
+    int32_t noblesuite;
+    uint64_t workshop;
+    std::set<int32_t> users;
+    df::coord channel_enable;
+    std::set<df::stockpile_list> stock_disable;
+    bool stock_specific1;
+    bool stock_specific2;
+    bool has_users;
+    bool furnished;
+    bool queue_dig;
+    bool temporary;
+    bool outdoor;
+    bool channeled;
+};
+
+struct furniture_image
+{
+    // with a null target, see target
+    furniture f;
+    uint64_t target;
+};
+
+struct task_image
+{
+    task_type::type type;
+    uint64_t r;
+    uint64_t f;
+};
+
+static void copy_room(room_image & img, room *r, const std::unordered_map<room *, size_t> & room_index, const std::unordered_map<furniture *, size_t> & furniture_index)
+{
+    img.status = r->status;
+    img.type = r->type;
+    img.subtype = r->subtype;
+    img.comment = r->comment;
+    img.min = r->min;
+    img.max = r->max;
+    for (auto it = r->accesspath.begin(); it != r->accesspath.end(); it++)
+    {
+        img.accesspath.push_back(write_ref(room_index, *it));
+    }
+    for (auto it = r->layout.begin(); it != r->layout.end(); it++)
+    {
+        img.layout.push_back(write_ref(furniture_index, *it));
+    }
+    img.owner = r->owner;
+    img.bld_id = r->bld_id;
+    img.squad_id = r->squad_id;
+    img.level = r->level;
+    img.noblesuite = r->noblesuite;
+    img.workshop = write_ref(room_index, r->workshop);
+    img.users = r->users;
+    img.channel_enable = r->channel_enable;
+    img.stock_disable = r->stock_disable;
+    img.stock_specific1 = r->stock_specific1;
+    img.stock_specific2 = r->stock_specific2;
+    img.has_users = r->has_users;
+    img.furnished = r->furnished;
+    img.queue_dig = r->queue_dig;
+    img.temporary = r->temporary;
+    img.outdoor = r->outdoor;
+    img.channeled = r->channeled;
+}
+
+static void copy_furniture(furniture_image & img, furniture *f, const std::unordered_map<furniture *, size_t> & furniture_index)
+{
+    img.f = *f;
+    img.f.target = nullptr;
+    img.target = write_ref(furniture_index, f->target);
+}
+
+static void write_room(plan_writer & w, const room_image & r)
+{
+    w.str(enum_name(r.status));
+    w.str(enum_name(r.type));
+    w.str(r.subtype);
+    w.str(r.comment);
+    w.coord(r.min);
+    w.coord(r.max);
+    w.varuint(r.accesspath.size());
+    for (auto it = r.accesspath.begin(); it != r.accesspath.end(); it++)
+    {
+        w.varuint(*it);
+    }
+    w.varuint(r.layout.size());
+    for (auto it = r.layout.begin(); it != r.layout.end(); it++)
+    {
+        w.varuint(*it);
+    }
+    w.varint(r.owner);
+    w.varint(r.bld_id);
+    w.varint(r.squad_id);
+    w.varint(r.level);
+    w.varint(r.noblesuite);
+    w.varuint(r.workshop);
+    w.ids(r.users);
+    w.coord(r.channel_enable);
+    w.varuint(r.stock_disable.size());
+    for (auto it = r.stock_disable.begin(); it != r.stock_disable.end(); it++)
+    {
+        w.str(ENUM_KEY_STR(stockpile_list, *it));
+    }
+    w.boolean(r.stock_specific1);
+    w.boolean(r.stock_specific2);
+    w.boolean(r.has_users);
+    w.boolean(r.furnished);
+    w.boolean(r.queue_dig);
+    w.boolean(r.temporary);
+    w.boolean(r.outdoor);
+    w.boolean(r.channeled);
+}
+
+static bool read_room_fields(plan_reader & r, room *rm, const std::vector<room *> & all_rooms, const std::vector<furniture *> & all_furniture)
+{
+    if (!read_enum_name(r.str(), rm->status, room_status::_room_status_count) ||
+            !read_enum_name(r.str(), rm->type, room_type::_room_type_count))
+    {
+        return false;
+    }
+    rm->subtype = r.str();
+    rm->comment = r.str();
+    rm->min = r.coord();
+    rm->max = r.coord();
+    for (uint64_t n = r.varuint(); n > 0 && r.more(); n--)
+    {
+        room *a;
+        if (!read_ref(all_rooms, r.varuint(), a))
+            return false;
+        rm->accesspath.push_back(a);
+    }
+    for (uint64_t n = r.varuint(); n > 0 && r.more(); n--)
+    {
+        furniture *f;
+        if (!read_ref(all_furniture, r.varuint(), f))
+            return false;
+        rm->layout.push_back(f);
+    }
+    rm->owner = int32_t(r.varint());
+    rm->bld_id = int32_t(r.varint());
+    rm->squad_id = int32_t(r.varint());
+    rm->level = int32_t(r.varint());
+    rm->noblesuite = int32_t(r.varint());
+    if (!read_ref(all_rooms, r.varuint(), rm->workshop))
+        return false;
+    r.ids(rm->users);
+    rm->channel_enable = r.coord();
+    for (uint64_t n = r.varuint(); n > 0 && r.more(); n--)
+    {
+        df::stockpile_list disable;
+        if (find_enum_item(&disable, r.str()))
+        {
+            rm->stock_disable.insert(disable);
+        }
+    }
+    rm->stock_specific1 = r.boolean();
+    rm->stock_specific2 = r.boolean();
+    rm->has_users = r.boolean();
+    rm->furnished = r.boolean();
+    rm->queue_dig = r.boolean();
+    rm->temporary = r.boolean();
+    rm->outdoor = r.boolean();
+    rm->channeled = r.boolean();
+    return true;
+}
+
+// read a room record into rm, or only check it when rm is null. returns
+// false, leaving rm alone, if the record has an unknown status or type or
+// a reference out of range.
+static bool read_room(plan_reader & r, room *rm, const std::vector<room *> & all_rooms, const std::vector<furniture *> & all_furniture)
+{
+    room tmp(df::coord(), df::coord());
+    bool ok = read_room_fields(r, &tmp, all_rooms, all_furniture);
+    if (ok && rm)
+    {
+        *rm = tmp;
+    }
+    // the furniture is not ours to delete
+    tmp.layout.clear();
+    return ok;
+}
+
+static void write_furniture(plan_writer & w, const furniture_image & img)
+{
+    const furniture & f = img.f;
+    w.str(f.item);
+    w.str(f.subtype);
+    w.str(ENUM_KEY_STR(construction_type, f.construction));
+    w.str(ENUM_KEY_STR(tile_dig_designation, f.dig));
+    w.str(f.direction);
+    w.str(f.way);
+    w.varint(f.bld_id);
+    w.varint(f.x);
+    w.varint(f.y);
+    w.varint(f.z);
+    w.varuint(img.target);
+    w.ids(f.users);
+    w.boolean(f.has_users);
+    w.boolean(f.ignore);
+    w.boolean(f.makeroom);
+    w.boolean(f.internal);
+}
+
+static void write_task(plan_writer & w, const task_image & t)
+{
+    w.str(enum_name(t.type));
+    w.varuint(t.r);
+    w.varuint(t.f);
+}
+
+// same as read_room
+static bool read_furniture(plan_reader & r, furniture *f, const std::vector<furniture *> & all_furniture)
+{
+    furniture tmp;
+    tmp.item = r.str();
+    tmp.subtype = r.str();
+    find_enum_item(&tmp.construction, r.str());
+    find_enum_item(&tmp.dig, r.str());
+    tmp.direction = r.str();
+    tmp.way = r.str();
+    tmp.bld_id = int32_t(r.varint());
+    tmp.x = int16_t(r.varint());
+    tmp.y = int16_t(r.varint());
+    tmp.z = int16_t(r.varint());
+    if (!read_ref(all_furniture, r.varuint(), tmp.target))
+        return false;
+    r.ids(tmp.users);
+    tmp.has_users = r.boolean();
+    tmp.ignore = r.boolean();
+    tmp.makeroom = r.boolean();
+    tmp.internal = r.boolean();
+    if (f)
+    {
+        *f = tmp;
+    }
+    return true;
+}
+
+// what Plan::persist hands to the save thread
+struct plan_save_job
+{
+    uint64_t snapshot_id;
+    // a full df-ai-plan.dat, or an entry appended to the journal
+    bool full;
+    // every room and furniture in index_plan order for a snapshot, only
+    // the dirty ones at the indices in room_at and furniture_at for a
+    // journal entry
+    std::vector<room_image> rooms;
+    std::vector<size_t> room_at;
+    std::vector<furniture_image> furniture;
+    std::vector<size_t> furniture_at;
+    // the task list, left out of a journal entry if it did not change
+    bool has_tasks;
+    std::vector<task_image> tasks;
+    // save folder to copy the files to as well
+    std::string mirror_folder;
+};
+
+static bool write_file(const std::string & path, const std::string & data, bool append, std::string & error)
+{
+    FILE *f = std::fopen(path.c_str(), append ? "ab" : "wb");
+    if (!f)
+    {
+        error = "cannot open " + path;
+        return false;
+    }
+    bool ok = std::fwrite(data.data(), 1, data.size(), f) == data.size() && std::fflush(f) == 0;
+#ifdef _WIN32
+    ok = ok && _commit(_fileno(f)) == 0;
+#else
+    ok = ok && fsync(fileno(f)) == 0;
+#endif
+    if (std::fclose(f) != 0)
+    {
+        ok = false;
+    }
+    if (!ok)
+    {
+        error = "cannot write " + path;
+    }
+    return ok;
+}
+
+// write to a temporary file, then rename it over path
+static bool replace_file(const std::string & path, const std::string & data, std::string & error)
+{
+    std::string tmp = path + ".tmp";
+    if (!write_file(tmp, data, false, error))
+    {
+        std::remove(tmp.c_str());
+        return false;
+    }
+#ifdef _WIN32
+    // rename does not replace existing files on windows
+    std::remove(path.c_str());
+#endif
+    if (std::rename(tmp.c_str(), path.c_str()) != 0)
+    {
+        error = "cannot rename " + tmp;
+        std::remove(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+static bool read_file(const std::string & path, std::string & data)
+{
+    std::ifstream f(path, std::ifstream::binary);
+    if (!f.good())
+    {
+        return false;
+    }
+    std::ostringstream s;
+    s << f.rdbuf();
+    data = s.str();
+    return true;
+}
+
+// returns an error message, or an empty string on success
+static std::string write_save(bool full, const std::string & data, const std::string & mirror_folder)
+{
+    const std::string dat = "data/save/current/df-ai-plan.dat";
+    const std::string journal = "data/save/current/df-ai-plan.journal";
+    std::string error;
+
+    if (full)
+    {
+        if (!replace_file(dat, data, error))
+        {
+            return error;
+        }
+        // entries for the previous snapshot would be ignored anyway
+        std::remove(journal.c_str());
+    }
+    else if (!write_file(journal, data, true, error))
+    {
+        return error;
+    }
+
+    if (!mirror_folder.empty())
+    {
+        std::string copy;
+        if (read_file(dat, copy) && !replace_file(mirror_folder + "/df-ai-plan.dat", copy, error))
+        {
+            return error;
+        }
+        if (read_file(journal, copy))
+        {
+            if (!replace_file(mirror_folder + "/df-ai-plan.journal", copy, error))
+            {
+                return error;
+            }
+        }
+        else
+        {
+            std::remove((mirror_folder + "/df-ai-plan.journal").c_str());
+        }
+    }
+
+    return std::string();
+}
+
+// the save thread, and what it knows about the files it wrote. jobs are
+// written in the order they were queued.
+struct plan_saver
+{
+    AI *ai;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::list<plan_save_job *> queue;
+    bool stop;
+    // the snapshot in df-ai-plan.dat, 0 if the last write failed. set by
+    // the save thread, read by Plan::save_image.
+    std::atomic<uint64_t> written_id;
+    // the journal grew larger than the snapshot
+    std::atomic<bool> journal_full;
+    // only used by the save thread: the size of the snapshot, and the
+    // bytes written to the journal since
+    size_t snapshot_rooms;
+    size_t snapshot_furniture;
+    size_t snapshot_size;
+    size_t journal_size;
+    std::thread thread;
+
+    plan_saver(AI *ai) :
+        ai(ai),
+        mutex(),
+        wake(),
+        queue(),
+        stop(false),
+        written_id(0),
+        journal_full(false),
+        snapshot_rooms(0),
+        snapshot_furniture(0),
+        snapshot_size(0),
+        journal_size(0),
+        thread()
+    {
+        thread = std::thread(&plan_saver::run, this);
+    }
+    // writes whatever is still queued first
+    ~plan_saver()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stop = true;
+        }
+        wake.notify_one();
+        thread.join();
+    }
+
+    void push(plan_save_job *job)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            queue.push_back(job);
+        }
+        wake.notify_one();
+    }
+
+    void run();
+    std::string save(const plan_save_job & job, size_t & size);
+    void encode_snapshot(plan_writer & w, const plan_save_job & job);
+    bool encode_journal(plan_writer & w, const plan_save_job & job);
+};
+
+void plan_saver::run()
+{
+    for (;;)
+    {
+        plan_save_job *job;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            wake.wait(lock, [this]() -> bool { return stop || !queue.empty(); });
+            if (queue.empty())
+            {
+                return;
+            }
+            job = queue.front();
+            queue.pop_front();
+        }
+
+        size_t size = 0;
+        std::string error = save(*job, size);
+        bool full = job->full;
+        delete job;
+
+        AI *ai = this->ai;
+        events.onupdate_post([ai, error, full, size](color_ostream & out)
+                {
+                    if (!error.empty())
+                    {
+                        ai->debug(out, "[ERROR] saving plan failed: " + error);
+                    }
+                    Json::Value payload(Json::objectValue);
+                    payload["ok"] = error.empty();
+                    payload["full"] = full;
+                    payload["bytes"] = Json::UInt64(size);
+                    ai->event("plan saved", payload);
+                });
+    }
+}
+
+// returns an error message, or an empty string on success
+std::string plan_saver::save(const plan_save_job & job, size_t & size)
+{
+    std::ostringstream buf(std::ios::out | std::ios::binary);
+    plan_writer w(buf);
+    if (job.full)
+    {
+        encode_snapshot(w, job);
+    }
+    else if (job.snapshot_id != written_id || !encode_journal(w, job))
+    {
+        // the changes in this entry are lost, start over from a snapshot
+        written_id = 0;
+        return "the snapshot of this journal entry was not written";
+    }
+    buf.flush();
+    std::string data = buf.str();
+    size = data.size();
+
+    std::string error = write_save(job.full, data, job.mirror_folder);
+    if (!error.empty())
+    {
+        // the changes in this entry are lost, start over from a snapshot
+        written_id = 0;
+        return error;
+    }
+    if (job.full)
+    {
+        written_id = job.snapshot_id;
+    }
+    journal_full = journal_size > snapshot_size;
+    return std::string();
+}
+
+// a full snapshot, the journal starts over from it
+void plan_saver::encode_snapshot(plan_writer & w, const plan_save_job & job)
+{
+    snapshot_rooms = job.rooms.size();
+    snapshot_furniture = job.furniture.size();
+    snapshot_size = 0;
+    journal_size = 0;
+
+    w.record.append(plan_magic, sizeof(plan_magic));
+    w.varuint(plan_version);
+    w.varuint(job.snapshot_id);
+    w.varuint(job.rooms.size());
+    w.varuint(job.furniture.size());
+    w.varuint(job.tasks.size());
+    snapshot_size += w.record.size();
+    w.end_record(false);
+
+    for (auto it = job.rooms.begin(); it != job.rooms.end(); it++)
+    {
+        write_room(w, *it);
+        snapshot_size += w.record.size();
+        w.end_record();
+    }
+
+    for (auto it = job.furniture.begin(); it != job.furniture.end(); it++)
+    {
+        write_furniture(w, *it);
+        snapshot_size += w.record.size();
+        w.end_record();
+    }
+
+    for (auto it = job.tasks.begin(); it != job.tasks.end(); it++)
+    {
+        write_task(w, *it);
+        snapshot_size += w.record.size();
+        w.end_record();
+    }
+}
+
+// the rooms, furniture and task list that changed since the last save.
+// returns false if the job does not match the snapshot.
+bool plan_saver::encode_journal(plan_writer & w, const plan_save_job & job)
+{
+    if (job.room_at.size() != job.rooms.size() || job.furniture_at.size() != job.furniture.size())
+    {
+        return false;
+    }
+    for (auto it = job.room_at.begin(); it != job.room_at.end(); it++)
+    {
+        if (*it >= snapshot_rooms)
+            return false;
+    }
+    for (auto it = job.furniture_at.begin(); it != job.furniture_at.end(); it++)
+    {
+        if (*it >= snapshot_furniture)
+            return false;
+    }
+
+    w.varuint(journal_entry);
+    w.varuint(job.snapshot_id);
+    journal_size += w.record.size();
+    w.end_record();
+
+    for (size_t i = 0; i < job.rooms.size(); i++)
+    {
+        w.varuint(journal_room);
+        w.varuint(job.room_at[i]);
+        write_room(w, job.rooms[i]);
+        journal_size += w.record.size();
+        w.end_record();
+    }
+
+    for (size_t i = 0; i < job.furniture.size(); i++)
+    {
+        w.varuint(journal_furniture);
+        w.varuint(job.furniture_at[i]);
+        write_furniture(w, job.furniture[i]);
+        journal_size += w.record.size();
+        w.end_record();
+    }
+
+    if (job.has_tasks)
+    {
+        w.varuint(journal_tasks);
+        w.varuint(job.tasks.size());
+        journal_size += w.record.size();
+        w.end_record();
+        for (auto it = job.tasks.begin(); it != job.tasks.end(); it++)
+        {
+            w.varuint(journal_task);
+            write_task(w, *it);
+            journal_size += w.record.size();
+            w.end_record();
+        }
+    }
+
+    w.varuint(journal_end);
+    w.end_record();
+    return true;
+}
+
+// copy the plan here, and leave encoding and the disk to the save thread
+command_result Plan::persist(color_ostream &)
+{
+    if (corridors.empty())
+    {
+        // we haven't initialized yet.
+        return CR_OK;
+    }
+
+    if (!saver)
+    {
+        saver = new plan_saver(ai);
+    }
+
+    plan_save_job *job = new plan_save_job();
+    save_image(*job);
+    // the game copies data/save/current to the save folder, on autosave
+    // and from the options screen alike, maybe before the save thread is
+    // done. so update the save folder itself as well.
+    job->mirror_folder = "data/save/" + World::ReadWorldFolder();
+    saver->push(job);
+    return CR_OK;
+}
+
+// write the queued saves and stop the save thread
+void Plan::persist_wait()
+{
+    delete saver;
+    saver = nullptr;
+}
+
+command_result Plan::unpersist(color_ostream &)
+{
+    persist_wait();
+    std::remove("data/save/current/df-ai-plan.dat");
+    std::remove("data/save/current/df-ai-plan.journal");
+    std::remove(("data/save/" + World::ReadWorldFolder() + "/df-ai-plan.dat").c_str());
+    std::remove(("data/save/" + World::ReadWorldFolder() + "/df-ai-plan.journal").c_str());
+    return CR_OK;
+}
+
+// copy the plan into job: a journal entry with what was marked dirty since
+// the last save, on top of the last snapshot if the save thread wrote it
+// and no rooms or furniture were added or reordered since. a full
+// snapshot otherwise. a snapshot that is still queued does not count yet.
+void Plan::save_image(plan_save_job & job)
+{
+    std::vector<room *> all_rooms;
+    std::vector<furniture *> all_furniture;
+    std::unordered_map<room *, size_t> room_index;
+    std::unordered_map<furniture *, size_t> furniture_index;
+    index_plan(all_rooms, all_furniture, room_index, furniture_index);
+
+    job.full = !saver || snapshot_id == 0 || saver->written_id != snapshot_id || saver->journal_full ||
+        all_rooms != snapshot_rooms || all_furniture != snapshot_furniture;
+    if (job.full)
+    {
+        snapshot_id++;
+    }
+    job.snapshot_id = snapshot_id;
+
+    if (job.full)
+    {
+        job.rooms.resize(all_rooms.size());
+        for (size_t i = 0; i < all_rooms.size(); i++)
+        {
+            copy_room(job.rooms[i], all_rooms[i], room_index, furniture_index);
+        }
+        job.furniture.resize(all_furniture.size());
+        for (size_t i = 0; i < all_furniture.size(); i++)
+        {
+            copy_furniture(job.furniture[i], all_furniture[i], furniture_index);
+        }
+    }
+    else
+    {
+        for (auto it = dirty_rooms.begin(); it != dirty_rooms.end(); it++)
+        {
+            auto idx = room_index.find(*it);
+            if (idx == room_index.end())
+                continue;
+            job.room_at.push_back(idx->second);
+            job.rooms.push_back(room_image());
+            copy_room(job.rooms.back(), *it, room_index, furniture_index);
+        }
+        for (auto it = dirty_furniture.begin(); it != dirty_furniture.end(); it++)
+        {
+            auto idx = furniture_index.find(*it);
+            if (idx == furniture_index.end())
+                continue;
+            job.furniture_at.push_back(idx->second);
+            job.furniture.push_back(furniture_image());
+            copy_furniture(job.furniture.back(), *it, furniture_index);
+        }
+    }
+
+    job.has_tasks = job.full || dirty_tasks;
+    if (job.has_tasks)
+    {
+        for (int p = 0; p < task_priority::_task_priority_count; p++)
+        {
+            for (auto it = tasks[p].begin(); it != tasks[p].end(); it++)
+            {
+                task_image t;
+                t.type = (*it)->type;
+                t.r = write_ref(room_index, (*it)->r);
+                t.f = write_ref(furniture_index, (*it)->f);
+                job.tasks.push_back(t);
+            }
+        }
+    }
+
+    dirty_rooms.clear();
+    dirty_furniture.clear();
+    dirty_tasks = false;
+    if (job.full)
+    {
+        snapshot_rooms.swap(all_rooms);
+        snapshot_furniture.swap(all_furniture);
+    }
+}
+
+// returns false, leaving the plan empty, if the file is unreadable
+bool Plan::load(std::istream & in)
+{
+    clear_tasks();
+    for (auto it = rooms.begin(); it != rooms.end(); it++)
+    {
+        delete *it;
+    }
+    rooms.clear();
+    for (auto it = corridors.begin(); it != corridors.end(); it++)
+    {
+        delete *it;
+    }
+    corridors.clear();
+
+    snapshot_id = 0;
+    snapshot_rooms.clear();
+    snapshot_furniture.clear();
+
+    if (in.peek() == plan_magic[0])
+    {
+        if (!load_binary(in))
+        {
+            return false;
+        }
+    }
+    else
+    {
+        load_json(in);
+    }
+
+    if (corridors.empty())
+    {
+        // no fort entrance to plan around
+        clear_tasks();
+        for (auto it = rooms.begin(); it != rooms.end(); it++)
+        {
+            delete *it;
+        }
+        rooms.clear();
+        return false;
+    }
+
+    fort_entrance = corridors.at(0);
+    categorize_all();
+    return true;
+}
+
+bool Plan::load_binary(std::istream & in)
+{
+    char magic[sizeof(plan_magic)];
+    in.read(magic, sizeof(magic));
+
+    plan_reader r(in);
+
+    uint64_t version, id, nrooms, nfurniture, ntasks;
+    if (in.gcount() != std::streamsize(sizeof(magic)) ||
+            !std::equal(magic, magic + sizeof(magic), plan_magic) ||
+            !plan_reader::get_uint(in, version) ||
+            version != plan_version ||
+            !plan_reader::get_uint(in, id) ||
+            !plan_reader::get_uint(in, nrooms) ||
+            !plan_reader::get_uint(in, nfurniture) ||
+            !plan_reader::get_uint(in, ntasks))
+    {
+        return false;
+    }
+
+    // every record takes at least a byte, do not allocate for a corrupt count
+    std::streamoff left = plan_reader::remaining(in);
+    if (left >= 0 && (nrooms > uint64_t(left) || nfurniture > uint64_t(left) || ntasks > uint64_t(left) ||
+                nrooms + nfurniture + ntasks > uint64_t(left)))
+    {
+        return false;
+    }
+
+    std::vector<room *> all_rooms;
+    std::vector<furniture *> all_furniture;
+
+    // a record is missing or unreadable: throw away everything read so far
+    auto fail = [this, &all_rooms, &all_furniture]() -> bool
+    {
+        clear_tasks();
+        rooms.clear();
+        corridors.clear();
+        for (auto it = all_rooms.begin(); it != all_rooms.end(); it++)
+        {
+            // furniture is deleted below, even if no layout holds it
+            (*it)->layout.clear();
+            delete *it;
+        }
+        for (auto it = all_furniture.begin(); it != all_furniture.end(); it++)
+        {
+            delete *it;
+        }
+        return false;
+    };
+
+    for (uint64_t i = nrooms; i > 0; i--)
+    {
+        all_rooms.push_back(new room(df::coord(), df::coord()));
+    }
+    for (uint64_t i = nfurniture; i > 0; i--)
+    {
+        all_furniture.push_back(new furniture());
+    }
+
+    for (auto it = all_rooms.begin(); it != all_rooms.end(); it++)
+    {
+        room *rm = *it;
+        if (!r.next_record())
+        {
+            return fail();
+        }
+        if (!read_room(r, rm, all_rooms, all_furniture))
+        {
+            return fail();
+        }
+        if (rm->type == room_type::pasture)
+        {
+            ai->pop->pet_check.insert(rm->users.begin(), rm->users.end());
+        }
+
+        if (rm->type == room_type::corridor)
+        {
+            corridors.push_back(rm);
+        }
+        else
+        {
+            rooms.push_back(rm);
+        }
+    }
+
+    for (auto it = all_furniture.begin(); it != all_furniture.end(); it++)
+    {
+        if (!r.next_record())
+        {
+            return fail();
+        }
+        if (!read_furniture(r, *it, all_furniture))
+        {
+            return fail();
+        }
+        ai->pop->citizen.insert((*it)->users.begin(), (*it)->users.end());
+    }
+
+    for (uint64_t i = ntasks; i > 0; i--)
+    {
+        if (!r.next_record())
+        {
+            return fail();
+        }
+        task_type::type type;
+        bool known = read_enum_name(r.str(), type, task_type::_task_type_count);
+        room *tr;
+        furniture *tf;
+        if (!read_ref(all_rooms, r.varuint(), tr) || !read_ref(all_furniture, r.varuint(), tf))
+        {
+            return fail();
+        }
+        if (known)
+        {
+            add_task(type, tr, tf);
+        }
+    }
+
+    // kept for load_journal
+    snapshot_id = id;
+    snapshot_rooms.swap(all_rooms);
+    snapshot_furniture.swap(all_furniture);
+    return true;
+}
+
+// replay the journal entries written since the snapshot we just loaded
+void Plan::load_journal(std::istream & in)
+{
+    if (snapshot_id == 0)
+    {
+        return;
+    }
+
+    // apply one record of an entry, or only check it. returns false if the
+    // record is unreadable.
+    auto replay = [this, &in](const std::string & record, bool apply, bool & new_tasks) -> bool
+    {
+        plan_reader e(in);
+        e.record = record;
+        uint64_t kind = e.varuint();
+        if (kind == journal_room)
+        {
+            room *rm;
+            if (!read_ref(snapshot_rooms, e.varuint() + 1, rm) || !rm ||
+                    !read_room(e, apply ? rm : nullptr, snapshot_rooms, snapshot_furniture))
+            {
+                return false;
+            }
+            if (apply && rm->type == room_type::pasture)
+            {
+                ai->pop->pet_check.insert(rm->users.begin(), rm->users.end());
+            }
+            return true;
+        }
+        if (kind == journal_furniture)
+        {
+            furniture *f;
+            if (!read_ref(snapshot_furniture, e.varuint() + 1, f) || !f ||
+                    !read_furniture(e, apply ? f : nullptr, snapshot_furniture))
+            {
+                return false;
+            }
+            if (apply)
+            {
+                ai->pop->citizen.insert(f->users.begin(), f->users.end());
+            }
+            return true;
+        }
+        if (kind == journal_tasks)
+        {
+            // the task list changed, possibly to nothing
+            if (apply)
+            {
+                clear_tasks();
+            }
+            new_tasks = true;
+            return true;
+        }
+        if (kind == journal_task)
+        {
+            task_type::type type;
+            bool known = read_enum_name(e.str(), type, task_type::_task_type_count);
+            room *tr;
+            furniture *tf;
+            if (!new_tasks || !read_ref(snapshot_rooms, e.varuint(), tr) || !read_ref(snapshot_furniture, e.varuint(), tf))
+            {
+                return false;
+            }
+            if (apply && known)
+            {
+                add_task(type, tr, tf);
+            }
+            return true;
+        }
+        return false;
+    };
+
+    plan_reader r(in);
+    std::vector<std::string> entry;
+    bool in_entry = false;
+
+    while (r.next_record())
+    {
+        uint64_t kind = r.varuint();
+        if (kind == journal_entry)
+        {
+            entry.clear();
+            in_entry = r.varuint() == snapshot_id;
+            continue;
+        }
+        if (!in_entry)
+        {
+            continue;
+        }
+        if (kind != journal_end)
+        {
+            entry.push_back(r.record);
+            continue;
+        }
+        in_entry = false;
+
+        // check the whole entry first, so that a bad one is not applied
+        // halfway
+        bool ok = true;
+        bool new_tasks = false;
+        for (auto it = entry.begin(); ok && it != entry.end(); it++)
+        {
+            ok = replay(*it, false, new_tasks);
+        }
+        new_tasks = false;
+        for (auto it = entry.begin(); ok && it != entry.end(); it++)
+        {
+            replay(*it, true, new_tasks);
+        }
+        entry.clear();
+    }
+
+    categorize_all();
+}
+
+void Plan::save_json(std::ostream & out)
+{
+    std::vector<room *> all_rooms;
+    std::vector<furniture *> all_furniture;
+    std::unordered_map<room *, size_t> room_index;
+    std::unordered_map<furniture *, size_t> furniture_index;
+    index_plan(all_rooms, all_furniture, room_index, furniture_index);
+
+    Json::Value converted_tasks(Json::arrayValue);
+    for (int p = 0; p < task_priority::_task_priority_count; p++)
+    {
+        for (auto it = tasks[p].begin(); it != tasks[p].end(); it++)
+        {
+            Json::Value t(Json::objectValue);
+            t["t"] = enum_name((*it)->type);
+            if ((*it)->r)
+            {
+                t["r"] = Json::Int(room_index.at((*it)->r));
+            }
+            if ((*it)->f)
+            {
+                t["f"] = Json::Int(furniture_index.at((*it)->f));
+            }
+            converted_tasks.append(t);
+        }
+    }
+
+    std::ostringstream stringify;
+
+    Json::Value converted_rooms(Json::arrayValue);
+    for (auto it = all_rooms.begin(); it != all_rooms.end(); it++)
+    {
+        Json::Value r(Json::objectValue);
+        stringify.str(std::string());
+        stringify.clear();
+        stringify << (*it)->status;
+        r["status"] = stringify.str();
+        stringify.str(std::string());
+        stringify.clear();
+        stringify << (*it)->type;
+        r["type"] = stringify.str();
+        r["subtype"] = (*it)->subtype;
+        r["comment"] = (*it)->comment;
+        Json::Value r_min(Json::arrayValue);
+        r_min.append(Json::Int((*it)->min.x));
+        r_min.append(Json::Int((*it)->min.y));
+        r_min.append(Json::Int((*it)->min.z));
+        r["min"] = r_min;
+        Json::Value r_max(Json::arrayValue);
+        r_max.append(Json::Int((*it)->max.x));
+        r_max.append(Json::Int((*it)->max.y));
+        r_max.append(Json::Int((*it)->max.z));
+        r["max"] = r_max;
+        Json::Value r_accesspath(Json::arrayValue);
+        for (auto it_ = (*it)->accesspath.begin(); it_ != (*it)->accesspath.end(); it_++)
+        {
+            r_accesspath.append(Json::Int(room_index.at(*it_)));
+        }
+        r["accesspath"] = r_accesspath;
+        Json::Value r_layout(Json::arrayValue);
+        for (auto it_ = (*it)->layout.begin(); it_ != (*it)->layout.end(); it_++)
+        {
+            r_layout.append(Json::Int(furniture_index.at(*it_)));
+        }
+        r["layout"] = r_layout;
+        r["owner"] = Json::Int((*it)->owner);
+        r["bld_id"] = Json::Int((*it)->bld_id);
+        r["squad_id"] = Json::Int((*it)->squad_id);
+        r["level"] = Json::Int((*it)->level);
+        r["noblesuite"] = Json::Int((*it)->noblesuite);
+        if ((*it)->workshop)
+        {
+            r["workshop"] = Json::Int(room_index.at((*it)->workshop));
+        }
+        Json::Value r_users(Json::arrayValue);
+        for (auto it_ = (*it)->users.begin(); it_ != (*it)->users.end(); it_++)
+        {
+            r_users.append(Json::Int(*it_));
+        }
+        r["users"] = r_users;
+        Json::Value r_channel_enable(Json::arrayValue);
+        r_channel_enable.append(Json::Int((*it)->channel_enable.x));
+        r_channel_enable.append(Json::Int((*it)->channel_enable.y));
+        r_channel_enable.append(Json::Int((*it)->channel_enable.z));
+        r["channel_enable"] = r_channel_enable;
+        Json::Value r_stock_disable(Json::arrayValue);
+        for (auto it_ = (*it)->stock_disable.begin(); it_ != (*it)->stock_disable.end(); it_++)
+        {
+            r_stock_disable.append(ENUM_KEY_STR(stockpile_list, *it_));
+        }
+        r["stock_disable"] = r_stock_disable;
+        r["stock_specific1"] = (*it)->stock_specific1;
+        r["stock_specific2"] = (*it)->stock_specific2;
+        r["has_users"] = (*it)->has_users;
+        r["furnished"] = (*it)->furnished;
+        r["queue_dig"] = (*it)->queue_dig;
+        r["temporary"] = (*it)->temporary;
+        r["outdoor"] = (*it)->outdoor;
+        r["channeled"] = (*it)->channeled;
+        converted_rooms.append(r);
+    }
+
+    Json::Value converted_furniture(Json::arrayValue);
+    for (auto it = all_furniture.begin(); it != all_furniture.end(); it++)
+    {
+        Json::Value f(Json::objectValue);
+        f["item"] = (*it)->item;
+        f["subtype"] = (*it)->subtype;
+        f["construction"] = ENUM_KEY_STR(construction_type, (*it)->construction);
+        f["dig"] = ENUM_KEY_STR(tile_dig_designation, (*it)->dig);
+        f["direction"] = (*it)->direction;
+        f["way"] = (*it)->way;
+        f["bld_id"] = Json::Int((*it)->bld_id);
+        f["x"] = Json::Int((*it)->x);
+        f["y"] = Json::Int((*it)->y);
+        f["z"] = Json::Int((*it)->z);
+        if ((*it)->target)
+        {
+            f["target"] = Json::Int(furniture_index.at((*it)->target));
+        }
+        Json::Value f_users(Json::arrayValue);
+        for (auto it_ = (*it)->users.begin(); it_ != (*it)->users.end(); it_++)
+        {
+            f_users.append(Json::Int(*it_));
+        }
+        f["users"] = f_users;
+        f["has_users"] = (*it)->has_users;
+        f["ignore"] = (*it)->ignore;
+        f["makeroom"] = (*it)->makeroom;
+        f["internal"] = (*it)->internal;
+        converted_furniture.append(f);
+    }
+
+    Json::Value all(Json::objectValue);
+    all["t"] = converted_tasks;
+    all["r"] = converted_rooms;
+    all["f"] = converted_furniture;
+
+    out << all;
+}
+
+void Plan::load_json(std::istream & in)
+{
+    Json::Value all(Json::objectValue);
+    in >> all;
+
+    std::vector<room *> all_rooms;
+    std::vector<furniture *> all_furniture;
+
+    for (unsigned int i = all["r"].size(); i > 0; i--)
+    {
+        all_rooms.push_back(new room(df::coord(), df::coord()));
+    }
+    for (unsigned int i = all["f"].size(); i > 0; i--)
+    {
+        all_furniture.push_back(new furniture());
+    }
+
+    std::ostringstream stringify;
+
+    std::map<std::string, room_status::status> statuses;
+    for (int i = 0; i < room_status::_room_status_count; i++)
+    {
+        stringify.str(std::string());
+        stringify.clear();
+        stringify << room_status::status(i);
+        statuses[stringify.str()] = room_status::status(i);
+    }
+    std::map<std::string, room_type::type> types;
+    for (int i = 0; i < room_type::_room_type_count; i++)
+    {
+        stringify.str(std::string());
+        stringify.clear();
+        stringify << room_type::type(i);
+        types[stringify.str()] = room_type::type(i);
+    }
+
+    for (auto it = all_rooms.begin(); it != all_rooms.end(); it++)
+    {
+        const Json::Value & r = all["r"][it - all_rooms.begin()];
+        (*it)->status = statuses.at(r["status"].asString());
+        (*it)->type = types.at(r["type"].asString());
+        (*it)->subtype = r["subtype"].asString();
+        (*it)->comment = r["comment"].asString();
+        (*it)->min.x = r["min"][0].asInt();
+        (*it)->min.y = r["min"][1].asInt();
+        (*it)->min.z = r["min"][2].asInt();
+        (*it)->max.x = r["max"][0].asInt();
+        (*it)->max.y = r["max"][1].asInt();
+        (*it)->max.z = r["max"][2].asInt();
+        for (auto it_ = r["accesspath"].begin(); it_ != r["accesspath"].end(); it_++)
+        {
+            (*it)->accesspath.push_back(all_rooms.at(it_->asInt()));
+        }
+        for (auto it_ = r["layout"].begin(); it_ != r["layout"].end(); it_++)
+        {
+            (*it)->layout.push_back(all_furniture.at(it_->asInt()));
+        }
+        (*it)->owner = r["owner"].asInt();
+        (*it)->bld_id = r["bld_id"].asInt();
+        (*it)->squad_id = r["squad_id"].asInt();
+        (*it)->level = r["level"].asInt();
+        (*it)->noblesuite = r["noblesuite"].asInt();
+        if (r.isMember("workshop"))
+        {
+            (*it)->workshop = all_rooms.at(r["workshop"].asInt());
+        }
+        for (auto it_ = r["users"].begin(); it_ != r["users"].end(); it_++)
+        {
+            (*it)->users.insert(it_->asInt());
+        }
+        if ((*it)->type == room_type::pasture)
+        {
+            ai->pop->pet_check.insert((*it)->users.begin(), (*it)->users.end());
+        }
+        (*it)->channel_enable.x = r["channel_enable"][0].asInt();
+        (*it)->channel_enable.y = r["channel_enable"][1].asInt();
+        (*it)->channel_enable.z = r["channel_enable"][2].asInt();
+        for (auto it_ = r["stock_disable"].begin(); it_ != r["stock_disable"].end(); it_++)
+        {
+            df::stockpile_list disable;
+            if (find_enum_item(&disable, it_->asString()))
+            {
+                (*it)->stock_disable.insert(disable);
+            }
+        }
+        (*it)->stock_specific1 = r["stock_specific1"].asBool();
+        (*it)->stock_specific2 = r["stock_specific2"].asBool();
+        (*it)->has_users = r["has_users"].asBool();
+        (*it)->furnished = r["furnished"].asBool();
+        (*it)->queue_dig = r["queue_dig"].asBool();
+        (*it)->temporary = r["temporary"].asBool();
+        (*it)->outdoor = r["outdoor"].asBool();
+        (*it)->channeled = r["channeled"].asBool();
+
+        if ((*it)->type == room_type::corridor)
+        {
+            corridors.push_back(*it);
+        }
+        else
+        {
+            rooms.push_back(*it);
+        }
+    }
+
+    for (auto it = all_furniture.begin(); it != all_furniture.end(); it++)
+    {
+        const Json::Value & f = all["f"][it - all_furniture.begin()];
+        (*it)->item = f["item"].asString();
+        (*it)->subtype = f["subtype"].asString();
+        find_enum_item(&(*it)->construction, f["construction"].asString());
+        find_enum_item(&(*it)->dig, f["dig"].asString());
+        (*it)->direction = f["direction"].asString();
+        (*it)->way = f["way"].asString();
+        (*it)->bld_id = f["bld_id"].asInt();
+        (*it)->x = f["x"].asInt();
+        (*it)->y = f["y"].asInt();
+        (*it)->z = f["z"].asInt();
+        if (f.isMember("target"))
+        {
+            (*it)->target = all_furniture.at(f["target"].asInt());
+        }
+        for (auto it_ = f["users"].begin(); it_ != f["users"].end(); it_++)
+        {
+            ai->pop->citizen.insert(it_->asInt());
+            (*it)->users.insert(it_->asInt());
+        }
+        (*it)->has_users = f["has_users"].asBool();
+        (*it)->ignore = f["ignore"].asBool();
+        (*it)->makeroom = f["makeroom"].asBool();
+        (*it)->internal = f["internal"].asBool();
+    }
+
+    for (auto it = all["t"].begin(); it != all["t"].end(); it++)
+    {
+        task_type::type type;
+        if (!read_enum_name((*it)["t"].asString(), type, task_type::_task_type_count))
+        {
+            continue;
+        }
+        room *tr = nullptr;
+        furniture *tf = nullptr;
+        if (it->isMember("r"))
+        {
+            tr = all_rooms.at((*it)["r"].asInt());
+        }
+        if (it->isMember("f"))
+        {
+            tf = all_furniture.at((*it)["f"].asInt());
+        }
+        add_task(type, tr, tf);
+    }
+}
+
+
+// vim: et:sw=4:ts=4
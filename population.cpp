@@ -40,7 +40,6 @@
 #include "df/incident.h"
 #include "df/itemdef_weaponst.h"
 #include "df/job.h"
-#include "df/manager_order.h"
 #include "df/occupation.h"
 #include "df/reaction.h"
 #include "df/squad.h"
@@ -1222,19 +1221,8 @@ df::entity_position_assignment *Population::assign_new_noble(color_ostream & out
 
 void Population::update_pets(color_ostream & out)
 {
-    int32_t needmilk = 0;
-    int32_t needshear = 0;
-    for (auto mo = world->manager_orders.begin(); mo != world->manager_orders.end(); mo++)
-    {
-        if ((*mo)->job_type == job_type::MilkCreature)
-        {
-            needmilk -= (*mo)->amount_left;
-        }
-        else if ((*mo)->job_type == job_type::ShearCreature)
-        {
-            needshear -= (*mo)->amount_left;
-        }
-    }
+    int32_t needmilk = -ai->stocks->count_manager_orders_job(job_type::MilkCreature).left;
+    int32_t needshear = -ai->stocks->count_manager_orders_job(job_type::ShearCreature).left;
 
     std::map<df::caste_raw *, std::set<std::pair<int32_t, df::unit *>>> forSlaughter;
 
@@ -2,6 +2,7 @@
 #include "room.h"
 #include "ai.h"
 #include "plan.h"
+#include "map_query.h"
 
 #include "modules/Maps.h"
 
@@ -159,7 +160,9 @@ room::~room()
 
 void room::dig(bool plan, bool channel)
 {
-    for (int16_t x = min.x; x <= max.x; x++)
+    // outside corridors, only walls get designated in the room box
+    bool box = channel || type == room_type::corridor || MapQuery::any(MapQuery::wall, min, max);
+    for (int16_t x = min.x; box && x <= max.x; x++)
     {
         for (int16_t y = min.y; y <= max.y; y++)
         {
@@ -259,6 +262,8 @@ df::tile_dig_designation room::dig_mode(df::coord t) const
 bool room::is_dug(df::tiletype_shape_basic want) const
 {
     std::set<df::coord> holes;
+    // walls and wanted shapes on the holes inside the room box
+    int32_t hole_walls = 0, hole_want = 0;
     for (auto it = layout.begin(); it != layout.end(); it++)
     {
         furniture *f = *it;
@@ -269,7 +274,14 @@ bool room::is_dug(df::tiletype_shape_basic want) const
 
         if (f->dig == tile_dig_designation::No)
         {
-            holes.insert(ft);
+            if (include(ft) && holes.insert(ft).second)
+            {
+                df::tiletype_shape s = ENUM_ATTR(tiletype, shape, *Maps::getTileType(ft));
+                if (s == tiletype_shape::WALL)
+                    hole_walls++;
+                if (ENUM_ATTR(tiletype_shape, basic_shape, s) == want)
+                    hole_want++;
+            }
             continue;
         }
 
@@ -285,6 +297,21 @@ bool room::is_dug(df::tiletype_shape_basic want) const
                 break;
         }
     }
+
+    if (MapQuery::count(MapQuery::wall, min, max) != hole_walls)
+    {
+        return false;
+    }
+    if (want == tiletype_shape_basic::None)
+    {
+        return true;
+    }
+    if (want == tiletype_shape_basic::Open || want == tiletype_shape_basic::Floor)
+    {
+        int32_t size = int32_t(max.x - min.x + 1) * int32_t(max.y - min.y + 1) * int32_t(max.z - min.z + 1);
+        return MapQuery::count(want == tiletype_shape_basic::Open ? MapQuery::open : MapQuery::floor, min, max) - hole_want == size - int32_t(holes.size());
+    }
+
     for (int16_t x = min.x; x <= max.x; x++)
     {
         for (int16_t y = min.y; y <= max.y; y++)
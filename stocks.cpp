@@ -91,134 +91,162 @@ REQUIRE_GLOBAL(cur_year_tick);
 REQUIRE_GLOBAL(ui);
 REQUIRE_GLOBAL(world);
 
+std::ostream & operator <<(std::ostream & stream, stock_kind::kind kind)
+{
+    if (kind >= 0 && kind < stock_kind::_stock_kind_count)
+    {
+        return stream << stock_kind::name(kind);
+    }
+    return stream << "???";
+}
+
+bool find_stock_kind(const std::string & name, stock_kind::kind & kind)
+{
+    // names are sorted, see STOCK_KINDS
+    auto begin = std::begin(stock_kind::names);
+    auto end = std::end(stock_kind::names);
+    auto it = std::lower_bound(begin, end, name, [](const char *a, const std::string & b) -> bool { return a < b; });
+    if (it == end || name != *it)
+    {
+        return false;
+    }
+    kind = stock_kind::kind(it - begin);
+    return true;
+}
+
 const static struct Watch
 {
-    std::map<std::string, int32_t> Needed;
-    std::map<std::string, int32_t> NeededPerDwarf; // per 100 dwarves, actually
-    std::map<std::string, int32_t> WatchStock;
-    std::set<std::string> AlsoCount;
-
-    Watch()
-    {
-        Needed["door"] = 4;
-        Needed["bed"] = 4;
-        Needed["bin"] = 4;
-        Needed["barrel"] = 4;
-        Needed["cabinet"] = 4;
-        Needed["chest"] = 4;
-        Needed["mechanism"] = 4;
-        Needed["bag"] = 3;
-        Needed["table"] = 3;
-        Needed["chair"] = 3;
-        Needed["cage"] = 3;
-        Needed["coffin"] = 2;
-        Needed["coffin_bld"] = 3;
-        Needed["coffin_bld_pet"] = 1;
-        Needed["food"] = 20;
-        Needed["drink"] = 20;
-        Needed["goblet"] = 10;
-        Needed["wood"] = 16;
-        Needed["bucket"] = 2;
-        Needed["thread_seeds"] = 10;
-        Needed["dye_seeds"] = 10;
-        Needed["dye"] = 10;
-        Needed["weapon"] = 2;
-        Needed["armor_torso"] = 2;
-        Needed["clothes_torso"] = 2;
-        Needed["block"] = 6;
-        Needed["quiver"] = 2;
-        Needed["flask"] = 2;
-        Needed["backpack"] = 2;
-        Needed["wheelbarrow"] = 1;
-        Needed["splint"] = 1;
-        Needed["crutch"] = 1;
-        Needed["rope"] = 1;
-        Needed["weaponrack"] = 1;
-        Needed["armorstand"] = 1;
-        Needed["floodgate"] = 1;
-        Needed["traction_bench"] = 1;
-        Needed["soap"] = 1;
-        Needed["lye"] = 1;
-        Needed["ash"] = 1;
-        Needed["plasterpowder"] = 1;
-        Needed["coal"] = 3;
-        Needed["raw_coke"] = 1;
-        Needed["gypsum"] = 1;
-        Needed["slab"] = 1;
-        Needed["giant_corkscrew"] = 1;
-        Needed["pipe_section"] = 1;
-        Needed["anvil"] = 1;
-        Needed["quern"] = 3;
-        Needed["minecart"] = 1;
-        Needed["nestbox"] = 1;
-        Needed["hive"] = 1;
-        Needed["jug"] = 1;
-        Needed["stepladder"] = 2;
-        Needed["pick"] = 2;
-        Needed["axe"] = 2;
-        Needed["armor_head"] = 2;
-        Needed["clothes_head"] = 2;
-        Needed["armor_legs"] = 2;
-        Needed["clothes_legs"] = 2;
-        Needed["armor_hands"] = 2;
-        Needed["clothes_hands"] = 2;
-        Needed["armor_feet"] = 2;
-        Needed["clothes_feet"] = 2;
-        Needed["armor_shield"] = 2;
-        Needed["bookcase"] = 1;
-        Needed["slurry"] = 5;
-        Needed["paper"] = 5;
-        Needed["quire"] = 5;
-        Needed["rock_pot"] = 4;
-
-        NeededPerDwarf["food"] = 100;
-        NeededPerDwarf["drink"] = 200;
-        NeededPerDwarf["slab"] = 10;
-        NeededPerDwarf["soap"] = 20;
-        NeededPerDwarf["weapon"] = 5;
-        NeededPerDwarf["cloth"] = 20;
-        NeededPerDwarf["clothes_torso"] = 20;
-        NeededPerDwarf["clothes_legs"] = 20;
-        NeededPerDwarf["clothes_feet"] = 20;
-        NeededPerDwarf["clothes_hands"] = 20;
-        NeededPerDwarf["clothes_head"] = 20;
-        NeededPerDwarf["armor_shield"] = 3;
-        NeededPerDwarf["armor_torso"] = 3;
-        NeededPerDwarf["armor_legs"] = 3;
-        NeededPerDwarf["armor_feet"] = 3;
-        NeededPerDwarf["armor_hands"] = 3;
-        NeededPerDwarf["armor_head"] = 3;
-
-        WatchStock["roughgem"] = 6;
-        WatchStock["thread_plant"] = 10;
-        WatchStock["cloth_nodye"] = 10;
-        WatchStock["mill_plant"] = 4;
-        WatchStock["bag_plant"] = 4;
-        WatchStock["milk"] = 1;
-        WatchStock["metal_ore"] = 6;
-        WatchStock["raw_coke"] = 2;
-        WatchStock["raw_adamantine"] = 2;
-        WatchStock["skull"] = 2;
-        WatchStock["bone"] = 8;
-        WatchStock["food_ingredients"] = 2;
-        WatchStock["drink_plant"] = 5;
-        WatchStock["drink_fruit"] = 5;
-        WatchStock["honey"] = 1;
-        WatchStock["honeycomb"] = 1;
-        WatchStock["wool"] = 1;
-        WatchStock["tallow"] = 1;
-        WatchStock["shell"] = 1;
-        WatchStock["raw_fish"] = 1;
-        WatchStock["clay"] = 1;
-
-        AlsoCount.insert("dye_plant");
-        AlsoCount.insert("cloth");
-        AlsoCount.insert("leather");
-        AlsoCount.insert("crossbow");
-        AlsoCount.insert("bonebolts");
-        AlsoCount.insert("stone");
-        AlsoCount.insert("dead_dwarf");
-        AlsoCount.insert("slurry_plant");
+    // 0 for the kinds that are not needed/watched
+    stock_array<int32_t> Needed;
+    stock_array<int32_t> NeededPerDwarf; // per 100 dwarves, actually
+    stock_array<int32_t> WatchStock;
+    stock_array<bool> AlsoCount;
+
+    Watch() :
+        Needed(),
+        NeededPerDwarf(),
+        WatchStock(),
+        AlsoCount()
+    {
+        Needed[stock_kind::door] = 4;
+        Needed[stock_kind::bed] = 4;
+        Needed[stock_kind::bin] = 4;
+        Needed[stock_kind::barrel] = 4;
+        Needed[stock_kind::cabinet] = 4;
+        Needed[stock_kind::chest] = 4;
+        Needed[stock_kind::mechanism] = 4;
+        Needed[stock_kind::bag] = 3;
+        Needed[stock_kind::table] = 3;
+        Needed[stock_kind::chair] = 3;
+        Needed[stock_kind::cage] = 3;
+        Needed[stock_kind::coffin] = 2;
+        Needed[stock_kind::coffin_bld] = 3;
+        Needed[stock_kind::coffin_bld_pet] = 1;
+        Needed[stock_kind::food] = 20;
+        Needed[stock_kind::drink] = 20;
+        Needed[stock_kind::goblet] = 10;
+        Needed[stock_kind::wood] = 16;
+        Needed[stock_kind::bucket] = 2;
+        Needed[stock_kind::thread_seeds] = 10;
+        Needed[stock_kind::dye_seeds] = 10;
+        Needed[stock_kind::dye] = 10;
+        Needed[stock_kind::weapon] = 2;
+        Needed[stock_kind::armor_torso] = 2;
+        Needed[stock_kind::clothes_torso] = 2;
+        Needed[stock_kind::block] = 6;
+        Needed[stock_kind::quiver] = 2;
+        Needed[stock_kind::flask] = 2;
+        Needed[stock_kind::backpack] = 2;
+        Needed[stock_kind::wheelbarrow] = 1;
+        Needed[stock_kind::splint] = 1;
+        Needed[stock_kind::crutch] = 1;
+        Needed[stock_kind::rope] = 1;
+        Needed[stock_kind::weaponrack] = 1;
+        Needed[stock_kind::armorstand] = 1;
+        Needed[stock_kind::floodgate] = 1;
+        Needed[stock_kind::traction_bench] = 1;
+        Needed[stock_kind::soap] = 1;
+        Needed[stock_kind::lye] = 1;
+        Needed[stock_kind::ash] = 1;
+        Needed[stock_kind::plasterpowder] = 1;
+        Needed[stock_kind::coal] = 3;
+        Needed[stock_kind::raw_coke] = 1;
+        Needed[stock_kind::gypsum] = 1;
+        Needed[stock_kind::slab] = 1;
+        Needed[stock_kind::giant_corkscrew] = 1;
+        Needed[stock_kind::pipe_section] = 1;
+        Needed[stock_kind::anvil] = 1;
+        Needed[stock_kind::quern] = 3;
+        Needed[stock_kind::minecart] = 1;
+        Needed[stock_kind::nestbox] = 1;
+        Needed[stock_kind::hive] = 1;
+        Needed[stock_kind::jug] = 1;
+        Needed[stock_kind::stepladder] = 2;
+        Needed[stock_kind::pick] = 2;
+        Needed[stock_kind::axe] = 2;
+        Needed[stock_kind::armor_head] = 2;
+        Needed[stock_kind::clothes_head] = 2;
+        Needed[stock_kind::armor_legs] = 2;
+        Needed[stock_kind::clothes_legs] = 2;
+        Needed[stock_kind::armor_hands] = 2;
+        Needed[stock_kind::clothes_hands] = 2;
+        Needed[stock_kind::armor_feet] = 2;
+        Needed[stock_kind::clothes_feet] = 2;
+        Needed[stock_kind::armor_shield] = 2;
+        Needed[stock_kind::bookcase] = 1;
+        Needed[stock_kind::slurry] = 5;
+        Needed[stock_kind::paper] = 5;
+        Needed[stock_kind::quire] = 5;
+        Needed[stock_kind::rock_pot] = 4;
+
+        NeededPerDwarf[stock_kind::food] = 100;
+        NeededPerDwarf[stock_kind::drink] = 200;
+        NeededPerDwarf[stock_kind::slab] = 10;
+        NeededPerDwarf[stock_kind::soap] = 20;
+        NeededPerDwarf[stock_kind::weapon] = 5;
+        NeededPerDwarf[stock_kind::cloth] = 20;
+        NeededPerDwarf[stock_kind::clothes_torso] = 20;
+        NeededPerDwarf[stock_kind::clothes_legs] = 20;
+        NeededPerDwarf[stock_kind::clothes_feet] = 20;
+        NeededPerDwarf[stock_kind::clothes_hands] = 20;
+        NeededPerDwarf[stock_kind::clothes_head] = 20;
+        NeededPerDwarf[stock_kind::armor_shield] = 3;
+        NeededPerDwarf[stock_kind::armor_torso] = 3;
+        NeededPerDwarf[stock_kind::armor_legs] = 3;
+        NeededPerDwarf[stock_kind::armor_feet] = 3;
+        NeededPerDwarf[stock_kind::armor_hands] = 3;
+        NeededPerDwarf[stock_kind::armor_head] = 3;
+
+        WatchStock[stock_kind::roughgem] = 6;
+        WatchStock[stock_kind::thread_plant] = 10;
+        WatchStock[stock_kind::cloth_nodye] = 10;
+        WatchStock[stock_kind::mill_plant] = 4;
+        WatchStock[stock_kind::bag_plant] = 4;
+        WatchStock[stock_kind::milk] = 1;
+        WatchStock[stock_kind::metal_ore] = 6;
+        WatchStock[stock_kind::raw_coke] = 2;
+        WatchStock[stock_kind::raw_adamantine] = 2;
+        WatchStock[stock_kind::skull] = 2;
+        WatchStock[stock_kind::bone] = 8;
+        WatchStock[stock_kind::food_ingredients] = 2;
+        WatchStock[stock_kind::drink_plant] = 5;
+        WatchStock[stock_kind::drink_fruit] = 5;
+        WatchStock[stock_kind::honey] = 1;
+        WatchStock[stock_kind::honeycomb] = 1;
+        WatchStock[stock_kind::wool] = 1;
+        WatchStock[stock_kind::tallow] = 1;
+        WatchStock[stock_kind::shell] = 1;
+        WatchStock[stock_kind::raw_fish] = 1;
+        WatchStock[stock_kind::clay] = 1;
+
+        AlsoCount[stock_kind::dye_plant] = true;
+        AlsoCount[stock_kind::cloth] = true;
+        AlsoCount[stock_kind::leather] = true;
+        AlsoCount[stock_kind::crossbow] = true;
+        AlsoCount[stock_kind::bonebolts] = true;
+        AlsoCount[stock_kind::stone] = true;
+        AlsoCount[stock_kind::dead_dwarf] = true;
+        AlsoCount[stock_kind::slurry_plant] = true;
     }
 } Watch;
 
@@ -332,6 +360,17 @@ Stocks::Stocks(AI *ai) :
     onupdate_handle(nullptr),
     updating(),
     updating_count(),
+    census(),
+    updating_census(),
+    census_count(),
+    census_free(),
+    census_items(),
+    census_layout(),
+    census_check(),
+    census_checking(false),
+    census_since_full(0),
+    census_generation(0),
+    census_full(true),
     lastupdating(0),
     farmplots(),
     seeds(),
@@ -339,23 +378,17 @@ Stocks::Stocks(AI *ai) :
     last_unforbidall_year(*cur_year),
     last_managerstall(*cur_year_tick / 28 / 1200),
     last_managerorder(job_type::NONE),
+    pending_orders(),
     updating_seeds(false),
     updating_plants(false),
     updating_corpses(false),
     updating_slabs(false),
-    updating_farmplots(),
+    updating_farmplots(false),
     manager_subtype(),
-    last_treelist([ai](df::coord a, df::coord b) -> bool
-            {
-                df::coord fe = ai->plan->fort_entrance->pos();
-                int16_t ascore = (a.x - fe.x) * (a.x - fe.x) + (a.y - fe.y) * (a.y - fe.y) + (a.z - fe.z) * (a.z - fe.z) * 16;
-                int16_t bscore = (b.x - fe.x) * (b.x - fe.x) + (b.y - fe.y) * (b.y - fe.y) + (b.z - fe.z) * (b.z - fe.z) * 16;
-                if (ascore < bscore)
-                    return true;
-                if (ascore > bscore)
-                    return false;
-                return a < b;
-            }),
+    trees(),
+    tree_seen(),
+    trees_generation(0),
+    trees_origin(),
     last_cutpos(),
     last_warn_food(std::time(nullptr) - 610),
     drink_plants(),
@@ -367,9 +400,17 @@ Stocks::Stocks(AI *ai) :
     slurry_plants(),
     grow_plants(),
     milk_creatures(),
+    edible_plants(),
+    food_crops(),
+    drink_food_crops(),
+    thread_crops(),
+    cloth_crops(),
+    metal_ore_stones(),
+    gypsum_stones(),
     clay_stones(),
     raw_coke(),
     raw_coke_inv(),
+    bar_reactions(),
     metal_digger_pref(),
     metal_weapon_pref(),
     metal_armor_pref(),
@@ -378,6 +419,7 @@ Stocks::Stocks(AI *ai) :
     complained_about_no_plants()
 {
     last_cutpos.clear();
+    trees_origin.clear();
     events.onstatechange_register([this](color_ostream &, state_change_event st)
             {
                 if (st == SC_WORLD_LOADED)
@@ -389,13 +431,20 @@ Stocks::Stocks(AI *ai) :
 
 Stocks::~Stocks()
 {
+    for (auto it = pending_orders.begin(); it != pending_orders.end(); it++)
+    {
+        delete *it;
+    }
 }
 
 void Stocks::reset()
 {
     updating.clear();
+    updating_census.clear();
+    census_items.clear();
+    census_layout.clear();
     lastupdating = 0;
-    count.clear();
+    count.fill(0);
     farmplots.clear();
     seeds.clear();
     plants.clear();
@@ -405,6 +454,7 @@ command_result Stocks::startup(color_ostream & out)
 {
     update_kitchen(out);
     update_plants(out);
+    update_inorganics(out);
     update_simple_metal_ores(out);
     ui->stockpile.reserved_barrels = 5;
     return CR_OK;
@@ -429,10 +479,13 @@ std::string Stocks::status()
 
     bool first = true;
     s << "need: ";
-    for (auto it = Watch.Needed.begin(); it != Watch.Needed.end(); it++)
+    for (int k = 0; k < stock_kind::_stock_kind_count; k++)
     {
-        int32_t want = num_needed(it->first);
-        int32_t have = count[it->first];
+        if (!Watch.Needed[k])
+            continue;
+
+        int32_t want = num_needed(stock_kind::kind(k));
+        int32_t have = count[k];
 
         if (have >= want)
             continue;
@@ -442,16 +495,16 @@ std::string Stocks::status()
         else
             s << ", ";
 
-        s << it->first;
+        s << stock_kind::kind(k);
     }
 
     first = true;
     s << "; use: ";
-    for (auto it = Watch.WatchStock.begin(); it != Watch.WatchStock.end(); it++)
+    for (int k = 0; k < stock_kind::_stock_kind_count; k++)
     {
-        int32_t want = it->second;
-        int32_t have = count[it->first];
-        if (have <= want)
+        int32_t want = Watch.WatchStock[k];
+        int32_t have = count[k];
+        if (!want || have <= want)
             continue;
 
         if (first)
@@ -459,7 +512,7 @@ std::string Stocks::status()
         else
             s << ", ";
 
-        s << it->first;
+        s << stock_kind::kind(k);
     }
 
     return s.str();
@@ -470,21 +523,30 @@ std::string Stocks::report()
     std::ostringstream s;
 
     s << "## Need\n";
-    for (auto it = Watch.Needed.begin(); it != Watch.Needed.end(); it++)
+    for (int k = 0; k < stock_kind::_stock_kind_count; k++)
     {
-        s << "- " << it->first << ": " << count[it->first] << " / " << num_needed(it->first) << "\n";
+        if (Watch.Needed[k])
+        {
+            s << "- " << stock_kind::kind(k) << ": " << count[k] << " / " << num_needed(stock_kind::kind(k)) << "\n";
+        }
     }
     s << "\n";
     s << "## Watch\n";
-    for (auto it = Watch.WatchStock.begin(); it != Watch.WatchStock.end(); it++)
+    for (int k = 0; k < stock_kind::_stock_kind_count; k++)
     {
-        s << "- " << it->first << ": " << count[it->first] << " / " << it->second << "\n";
+        if (Watch.WatchStock[k])
+        {
+            s << "- " << stock_kind::kind(k) << ": " << count[k] << " / " << Watch.WatchStock[k] << "\n";
+        }
     }
     s << "\n";
     s << "## Track\n";
-    for (auto it = Watch.AlsoCount.begin(); it != Watch.AlsoCount.end(); it++)
+    for (int k = 0; k < stock_kind::_stock_kind_count; k++)
     {
-        s << "- " << *it << ": " << count[*it] << "\n";
+        if (Watch.AlsoCount[k])
+        {
+            s << "- " << stock_kind::kind(k) << ": " << count[k] << "\n";
+        }
     }
     s << "\n";
     s << "## Orders\n";
@@ -546,30 +608,36 @@ void Stocks::update(color_ostream & out)
     }
 
     updating.clear();
-    for (auto it = Watch.Needed.begin(); it != Watch.Needed.end(); it++)
+    for (int k = 0; k < stock_kind::_stock_kind_count; k++)
     {
-        updating.push_back(it->first);
+        if (Watch.Needed[k])
+        {
+            updating.push_back(stock_kind::kind(k));
+        }
     }
-    for (auto it = Watch.WatchStock.begin(); it != Watch.WatchStock.end(); it++)
+    for (int k = 0; k < stock_kind::_stock_kind_count; k++)
     {
-        updating.push_back(it->first);
+        if (Watch.WatchStock[k])
+        {
+            updating.push_back(stock_kind::kind(k));
+        }
     }
     updating_count = updating;
-    updating_count.insert(updating_count.end(), Watch.AlsoCount.begin(), Watch.AlsoCount.end());
+    for (int k = 0; k < stock_kind::_stock_kind_count; k++)
+    {
+        if (Watch.AlsoCount[k])
+        {
+            updating_count.push_back(stock_kind::kind(k));
+        }
+    }
+    census_setup();
     updating_seeds = true;
     updating_plants = true;
     updating_corpses = true;
     updating_slabs = true;
-    updating_farmplots.clear();
+    updating_farmplots = true;
 
-    ai->plan->find_room(room_type::farmplot, [this](room *r) -> bool
-            {
-                if (r->dfbuilding())
-                {
-                    updating_farmplots.push_back(r);
-                }
-                return false; // search all farm plots
-            });
+    index_manager_orders();
 
     ai->debug(out, "updating stocks");
 
@@ -597,7 +665,7 @@ void Stocks::update(color_ostream & out)
     }
 
     // do stocks accounting 'in the background' (ie one bit at a time)
-    events.onupdate_register_once("df-ai stocks bg", 8, [this](color_ostream & out) -> bool
+    events.onupdate_register_budgeted("df-ai stocks bg", 8, [this](color_ostream & out) -> bool
             {
                 if (updating_seeds)
                 {
@@ -619,50 +687,65 @@ void Stocks::update(color_ostream & out)
                     update_slabs(out);
                     return false;
                 }
+                if (!updating_census.empty())
+                {
+                    df::items_other_id id = updating_census.back();
+                    updating_census.pop_back();
+                    count_census(out, id);
+                    if (updating_census.empty())
+                    {
+                        census_finish(out);
+                    }
+                    return false;
+                }
                 if (!updating_count.empty())
                 {
-                    std::string key = updating_count.back();
+                    stock_kind::kind key = updating_count.back();
                     updating_count.pop_back();
                     count[key] = count_stocks(out, key);
                     return false;
                 }
                 if (!updating.empty())
                 {
-                    std::string key = updating.back();
+                    stock_kind::kind key = updating.back();
                     updating.pop_back();
                     act(out, key);
                     return false;
                 }
-                if (!updating_farmplots.empty())
+                if (updating_farmplots)
                 {
-                    room *r = updating_farmplots.back();
-                    updating_farmplots.pop_back();
-                    farmplot(out, r, false);
+                    plan_farmplots(out);
                     return false;
                 }
                 if (ai->eventsJson.is_open())
                 {
                     Json::Value payload(Json::objectValue);
-                    for (auto it = Watch.Needed.begin(); it != Watch.Needed.end(); it++)
+                    for (int k = 0; k < stock_kind::_stock_kind_count; k++)
                     {
+                        if (!Watch.Needed[k])
+                            continue;
                         Json::Value needed(Json::arrayValue);
-                        needed.append(count.at(it->first));
-                        needed.append(num_needed(it->first));
-                        payload[it->first] = needed;
+                        needed.append(count[k]);
+                        needed.append(num_needed(stock_kind::kind(k)));
+                        payload[stock_kind::names[k]] = needed;
                     }
-                    for (auto it = Watch.WatchStock.begin(); it != Watch.WatchStock.end(); it++)
+                    for (int k = 0; k < stock_kind::_stock_kind_count; k++)
                     {
+                        if (!Watch.WatchStock[k])
+                            continue;
                         Json::Value watch(Json::arrayValue);
-                        watch.append(count.at(it->first));
-                        watch.append(-it->second);
-                        payload[it->first] = watch;
+                        watch.append(count[k]);
+                        watch.append(-Watch.WatchStock[k]);
+                        payload[stock_kind::names[k]] = watch;
                     }
-                    for (auto it = Watch.AlsoCount.begin(); it != Watch.AlsoCount.end(); it++)
+                    for (int k = 0; k < stock_kind::_stock_kind_count; k++)
                     {
+                        if (!Watch.AlsoCount[k])
+                            continue;
                         Json::Value also(Json::arrayValue);
-                        also.append(count.at(*it));
+                        also.append(count[k]);
                         also.append(0);
-                        payload[*it] = also;
+                        payload[stock_kind::names[k]] = also;
                     }
                     ai->event("stocks update", payload);
                 }
@@ -699,7 +782,17 @@ void Stocks::update_plants(color_ostream &)
     slurry_plants.clear();
     grow_plants.clear();
     milk_creatures.clear();
-    clay_stones.clear();
+    edible_plants.clear();
+    for (int subterranean = 0; subterranean < 2; subterranean++)
+    {
+        for (int8_t season = 0; season < 4; season++)
+        {
+            food_crops[subterranean][season].clear();
+            drink_food_crops[subterranean][season].clear();
+            thread_crops[subterranean][season].clear();
+            cloth_crops[subterranean][season].clear();
+        }
+    }
     for (size_t i = 0; i < world->raws.plants.all.size(); i++)
     {
         df::plant_raw *p = world->raws.plants.all[i];
@@ -747,6 +840,55 @@ void Stocks::update_plants(color_ostream &)
         {
             grow_plants[i] = basic.type;
         }
+
+        bool edible = basic.material->flags.is_set(material_flags::EDIBLE_RAW) || basic.material->flags.is_set(material_flags::EDIBLE_COOKED);
+        if (!edible && p->flags.is_set(plant_raw_flags::MILL))
+        {
+            MaterialInfo mill(p->material_defs.type_mill, p->material_defs.idx_mill);
+            edible = mill.material->flags.is_set(material_flags::EDIBLE_RAW) || mill.material->flags.is_set(material_flags::EDIBLE_COOKED);
+        }
+        for (size_t bi = 0; !edible && bi < basic.material->reaction_product.id.size(); bi++)
+        {
+            if (*basic.material->reaction_product.id[bi] == "BAG_ITEM")
+            {
+                MaterialInfo bag(basic.material->reaction_product.material.mat_type[bi], basic.material->reaction_product.material.mat_index[bi]);
+                edible = bag.material->flags.is_set(material_flags::EDIBLE_RAW) || bag.material->flags.is_set(material_flags::EDIBLE_COOKED);
+            }
+        }
+        if (edible)
+        {
+            edible_plants.insert(i);
+        }
+
+        if (p->flags.is_set(plant_raw_flags::TREE) || !p->flags.is_set(plant_raw_flags::SEED))
+        {
+            continue;
+        }
+        int subterranean = p->flags.is_set(plant_raw_flags::BIOME_SUBTERRANEAN_WATER) ? 1 : 0;
+        for (int8_t season = 0; season < 4; season++)
+        {
+            // season numbers are also the 1st 4 flags
+            if (!p->flags.is_set(df::plant_raw_flags(season)))
+            {
+                continue;
+            }
+            if (edible || p->flags.is_set(plant_raw_flags::DRINK))
+            {
+                food_crops[subterranean][season].push_back(i);
+            }
+            if (basic.material->flags.is_set(material_flags::EDIBLE_RAW) && p->flags.is_set(plant_raw_flags::DRINK))
+            {
+                drink_food_crops[subterranean][season].push_back(i);
+            }
+            if (thread_plants.count(i))
+            {
+                thread_crops[subterranean][season].push_back(i);
+            }
+            if (thread_plants.count(i) || dye_plants.count(i))
+            {
+                cloth_crops[subterranean][season].push_back(i);
+            }
+        }
     }
     for (size_t i = 0; i < world->raws.creatures.all.size(); i++)
     {
@@ -761,12 +903,96 @@ void Stocks::update_plants(color_ostream &)
             }
         }
     }
-    for (size_t i = 0; i < world->raws.inorganics.size(); i++)
+}
+
+static bool has_reaction_class(df::material *m, const std::string & cls)
+{
+    for (auto it = m->reaction_class.begin(); it != m->reaction_class.end(); it++)
+    {
+        if (**it == cls)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+// raws do not change once the world is loaded, so everything the stocks code
+// asks about stones and metals is looked up once here
+void Stocks::update_inorganics(color_ostream &)
+{
+    size_t count = world->raws.inorganics.size();
+    metal_ore_stones.assign(count, false);
+    gypsum_stones.assign(count, false);
+    clay_stones.assign(count, false);
+    raw_coke.assign(count, "");
+    raw_coke_inv.clear();
+    bar_reactions.assign(count, std::vector<std::pair<df::reaction *, int32_t>>());
+
+    for (size_t i = 0; i < count; i++)
+    {
+        df::inorganic_raw *raw = world->raws.inorganics[i];
+        metal_ore_stones[i] = raw->flags.is_set(inorganic_flags::METAL_ORE);
+        gypsum_stones[i] = has_reaction_class(&raw->material, "GYPSUM");
+        clay_stones[i] = has_reaction_product(&raw->material, "FIRED_MAT");
+    }
+
+    for (auto r = world->raws.reactions.begin(); r != world->raws.reactions.end(); r++)
     {
-        if (has_reaction_product(&world->raws.inorganics[i]->material, "FIRED_MAT"))
+        // XXX choose best reaction from all reactions
+        for (auto rp = (*r)->products.begin(); rp != (*r)->products.end(); rp++)
+        {
+            df::reaction_product_itemst *rpi = virtual_cast<df::reaction_product_itemst>(*rp);
+            if (rpi && rpi->item_type == item_type::BAR && rpi->mat_type == 0 && rpi->mat_index >= 0 && size_t(rpi->mat_index) < count)
+            {
+                // a reaction may make bars of several metals, but is only
+                // listed once for each
+                auto & reactions = bar_reactions[rpi->mat_index];
+                if (reactions.empty() || reactions.back().first != *r)
+                {
+                    reactions.push_back(std::make_pair(*r, int32_t(rpi->product_dimension)));
+                }
+            }
+        }
+
+        if ((*r)->reagents.size() != 1)
+            continue;
+
+        int32_t mat;
+
+        bool found = false;
+        for (auto rr = (*r)->reagents.begin(); rr != (*r)->reagents.end(); rr++)
+        {
+            df::reaction_reagent_itemst *rri = virtual_cast<df::reaction_reagent_itemst>(*rr);
+            if (rri && rri->item_type == item_type::BOULDER && rri->mat_type == 0)
+            {
+                mat = rri->mat_index;
+                found = true;
+                break;
+            }
+        }
+        if (!found)
+            continue;
+
+        found = false;
+        for (auto rp = (*r)->products.begin(); rp != (*r)->products.end(); rp++)
+        {
+            df::reaction_product_itemst *rpi = virtual_cast<df::reaction_product_itemst>(*rp);
+            if (rpi && rpi->item_type == item_type::BAR && MaterialInfo(rpi).material->id == "COAL")
+            {
+                found = true;
+                break;
+            }
+        }
+        if (!found)
+            continue;
+
+        // XXX check input size vs output size ?
+        if (mat >= 0 && size_t(mat) < count)
         {
-            clay_stones.insert(i);
+            raw_coke[mat] = (*r)->code;
         }
+        raw_coke_inv[(*r)->code] = mat;
     }
 }
 
@@ -909,6 +1135,7 @@ void Stocks::update_slabs(color_ostream & out)
                 std::vector<df::item *> item;
                 item.push_back(i);
                 Buildings::constructWithItems(bld, item);
+                AI::jobs_changed();
                 ai->debug(out, "slabbing " + AI::describe_unit(df::unit::find(df::historical_figure::find(i->topic)->unit_id)) + ": " + i->description);
             }
         }
@@ -916,114 +1143,113 @@ void Stocks::update_slabs(color_ostream & out)
     updating_slabs = false;
 }
 
-int32_t Stocks::num_needed(const std::string & key)
+int32_t Stocks::num_needed(stock_kind::kind key)
 {
-    int32_t amount = Watch.Needed.at(key);
-    if (Watch.NeededPerDwarf.count(key))
+    int32_t amount = Watch.Needed[key];
+    if (Watch.NeededPerDwarf[key])
     {
-        amount += ai->pop->citizen.size() * Watch.NeededPerDwarf.at(key) / 100;
+        amount += ai->pop->citizen.size() * Watch.NeededPerDwarf[key] / 100;
     }
 
-    if (key == "coffin" && count.count("dead_dwarf") && count.count("coffin_bld"))
+    if (key == stock_kind::coffin)
     {
-        amount = std::max(amount, count.at("dead_dwarf") - count.at("coffin_bld"));
+        amount = std::max(amount, count[stock_kind::dead_dwarf] - count[stock_kind::coffin_bld]);
     }
-    else if (key == "coffin_bld" && count.count("dead_dwarf"))
+    else if (key == stock_kind::coffin_bld)
     {
-        amount = std::max(amount, count.at("dead_dwarf"));
+        amount = std::max(amount, count[stock_kind::dead_dwarf]);
     }
-    else if (key == "barrel" && need_more("bed"))
+    else if (key == stock_kind::barrel && need_more(stock_kind::bed))
     {
         amount = 0;
     }
     return amount;
 }
 
-void Stocks::act(color_ostream & out, std::string key)
+void Stocks::act(color_ostream & out, stock_kind::kind key)
 {
-    if (Watch.Needed.count(key))
+    if (Watch.Needed[key])
     {
         int32_t amount = num_needed(key);
-        if (count.at(key) < amount)
+        if (count[key] < amount)
         {
-            queue_need(out, key, amount * 3 / 2 - count.at(key));
+            queue_need(out, key, amount * 3 / 2 - count[key]);
         }
     }
 
-    if (Watch.WatchStock.count(key))
+    if (Watch.WatchStock[key])
     {
-        int32_t amount = Watch.WatchStock.at(key);
-        if (count.at(key) > amount)
+        int32_t amount = Watch.WatchStock[key];
+        if (count[key] > amount)
         {
-            queue_use(out, key, count.at(key) - amount);
+            queue_use(out, key, count[key] - amount);
         }
     }
 }
 
-// count unused stocks of one type of item
-int32_t Stocks::count_stocks(color_ostream & out, std::string k)
+// census_item::keys has one bit per census key of a vector
+static const size_t census_max_keys = 64;
+static_assert(sizeof(census_item::keys) * 8 >= census_max_keys, "census_item::keys is too small");
+
+// pick out the keys of this update that are a plain count of free items in
+// one items_other_id vector, and group them by vector so that count_census
+// walks each vector once for all of them
+void Stocks::census_setup()
 {
-    int32_t n = 0;
-    auto add = [this, &n](df::item *i)
+    if (!updating_census.empty())
+    {
+        // the last update was cut short, its totals are incomplete
+        census_since_full = config.census_full_interval;
+    }
+    census.clear();
+    census_free.clear();
+    updating_census.clear();
+
+    stock_array<bool> wanted = stock_array<bool>();
+    for (auto it = updating_count.begin(); it != updating_count.end(); it++)
+    {
+        wanted[*it] = true;
+    }
+    stock_array<bool> added = stock_array<bool>();
+    auto add = [this, &wanted, &added](stock_kind::kind k, df::items_other_id id, std::function<bool(df::item *)> pred)
     {
-        if (is_item_free(i))
+        if (!wanted[k] || added[k])
         {
-            n += virtual_cast<df::item_actual>(i)->stack_size;
+            return;
         }
+        auto & keys = census[id];
+        // count_stocks cannot count census keys, so every one needs a bit
+        assert(keys.size() < census_max_keys);
+        added[k] = true;
+        keys.push_back(std::make_pair(k, pred));
     };
     auto yes_i_mean_all = [](df::item *) -> bool { return true; };
-    auto add_all = [add](df::items_other_id id, std::function<bool(df::item *)> pred)
-    {
-        for (auto it = world->items.other[id].begin(); it != world->items.other[id].end(); it++)
-        {
-            if (pred(*it))
+    auto no_such_item = [](df::item *) -> bool { return false; };
+
+    add(stock_kind::bin, items_other_id::BIN, [](df::item *i) -> bool
             {
-                add(*it);
-            }
-        }
-    };
-    if (k == "bin")
-    {
-        add_all(items_other_id::BIN, [](df::item *i) -> bool
-                {
-                    return virtual_cast<df::item_binst>(i)->stockpile.id == -1;
-                });
-    }
-    else if (k == "barrel")
-    {
-        add_all(items_other_id::BARREL, [](df::item *i) -> bool
-                {
-                    return virtual_cast<df::item_barrelst>(i)->stockpile.id == -1;
-                });
-    }
-    else if (k == "bag")
-    {
-        add_all(items_other_id::BOX, [](df::item *i) -> bool
-                {
-                    MaterialInfo mat(i);
-                    return mat.isAnyCloth() || mat.material->flags.is_set(material_flags::LEATHER);
-                });
-    }
-    else if (k == "rope")
-    {
-        add_all(items_other_id::CHAIN, [](df::item *i) -> bool
-                {
-                    MaterialInfo mat(i);
-                    return mat.isAnyCloth();
-                });
-    }
-    else if (k == "bucket")
-    {
-        add_all(items_other_id::BUCKET, yes_i_mean_all);
-    }
-    else if (k == "food")
-    {
-        add_all(items_other_id::ANY_GOOD_FOOD, [](df::item *i) -> bool
-                {
-                    return virtual_cast<df::item_foodst>(i);
-                });
-    }
-    else if (k == "food_ingredients")
+                return virtual_cast<df::item_binst>(i)->stockpile.id == -1;
+            });
+    add(stock_kind::barrel, items_other_id::BARREL, [](df::item *i) -> bool
+            {
+                return virtual_cast<df::item_barrelst>(i)->stockpile.id == -1;
+            });
+    add(stock_kind::bag, items_other_id::BOX, [](df::item *i) -> bool
+            {
+                MaterialInfo mat(i);
+                return mat.isAnyCloth() || mat.material->flags.is_set(material_flags::LEATHER);
+            });
+    add(stock_kind::rope, items_other_id::CHAIN, [](df::item *i) -> bool
+            {
+                MaterialInfo mat(i);
+                return mat.isAnyCloth();
+            });
+    add(stock_kind::bucket, items_other_id::BUCKET, yes_i_mean_all);
+    add(stock_kind::food, items_other_id::ANY_GOOD_FOOD, [](df::item *i) -> bool
+            {
+                return virtual_cast<df::item_foodst>(i);
+            });
+    if (wanted[stock_kind::food_ingredients])
     {
         std::set<std::tuple<df::item_type, int16_t, int16_t, int32_t>> forbidden;
         for (size_t i = 0; i < ui->kitchen.item_types.size(); i++)
@@ -1034,7 +1260,7 @@ int32_t Stocks::count_stocks(color_ostream & out, std::string k)
             }
         }
 
-        add_all(items_other_id::ANY_COOKABLE, [forbidden](df::item *i) -> bool
+        add(stock_kind::food_ingredients, items_other_id::ANY_COOKABLE, [forbidden](df::item *i) -> bool
                 {
                     if (virtual_cast<df::item_flaskst>(i))
                         return false;
@@ -1053,165 +1279,416 @@ int32_t Stocks::count_stocks(color_ostream & out, std::string k)
                     return !forbidden.count(std::make_tuple(i->getType(), i->getSubtype(), i->getMaterial(), i->getMaterialIndex()));
                 });
     }
-    else if (k == "drink")
-    {
-        add_all(items_other_id::DRINK, yes_i_mean_all);
-    }
-    else if (k == "goblet")
+    add(stock_kind::drink, items_other_id::DRINK, yes_i_mean_all);
+    add(stock_kind::goblet, items_other_id::GOBLET, yes_i_mean_all);
+    std::pair<stock_kind::kind, const char *> bars[] =
     {
-        add_all(items_other_id::GOBLET, yes_i_mean_all);
-    }
-    else if (k == "soap" || k == "coal" || k == "ash")
+        std::make_pair(stock_kind::soap, "SOAP"),
+        std::make_pair(stock_kind::coal, "COAL"),
+        std::make_pair(stock_kind::ash, "ASH"),
+    };
+    for (auto bar = std::begin(bars); bar != std::end(bars); bar++)
     {
-        std::string mat_id = k == "soap" ? "SOAP" : k == "coal" ? "COAL" : "ASH";
-        add_all(items_other_id::BAR, [mat_id](df::item *i) -> bool
+        std::string mat_id = bar->second;
+        add(bar->first, items_other_id::BAR, [mat_id](df::item *i) -> bool
                 {
                     MaterialInfo mat(i);
                     return mat.material && mat.material->id == mat_id;
                 });
     }
-    else if (k == "wood")
-    {
-        add_all(items_other_id::WOOD, yes_i_mean_all);
-    }
-    else if (k == "roughgem")
+    add(stock_kind::wood, items_other_id::WOOD, yes_i_mean_all);
+    add(stock_kind::roughgem, items_other_id::ROUGH, [](df::item *i) -> bool
+            {
+                return i->getMaterial() == 0;
+            });
+    add(stock_kind::metal_ore, items_other_id::BOULDER, [this](df::item *i) -> bool
+            {
+                return is_metal_ore(i);
+            });
+    add(stock_kind::raw_coke, items_other_id::BOULDER, [this](df::item *i) -> bool
+            {
+                return !is_raw_coke(i).empty();
+            });
+    add(stock_kind::gypsum, items_other_id::BOULDER, [this](df::item *i) -> bool
+            {
+                return is_gypsum(i);
+            });
+    MaterialInfo candy;
+    if (candy.findInorganic("RAW_ADAMANTINE"))
     {
-        add_all(items_other_id::ROUGH, [](df::item *i) -> bool
+        add(stock_kind::raw_adamantine, items_other_id::BOULDER, [candy](df::item *i) -> bool
                 {
-                    return i->getMaterial() == 0;
+                    return i->getMaterialIndex() == candy.index;
                 });
     }
-    else if (k == "metal_ore")
+    else
     {
-        add_all(items_other_id::BOULDER, [this](df::item *i) -> bool
-                {
-                    return is_metal_ore(i);
-                });
+        add(stock_kind::raw_adamantine, items_other_id::BOULDER, no_such_item);
     }
-    else if (k == "raw_coke")
+    add(stock_kind::stone, items_other_id::BOULDER, [](df::item *i) -> bool
+            {
+                return !ui->economic_stone[i->getMaterialIndex()];
+            });
+    add(stock_kind::raw_fish, items_other_id::FISH_RAW, yes_i_mean_all);
+    add(stock_kind::splint, items_other_id::SPLINT, yes_i_mean_all);
+    add(stock_kind::crutch, items_other_id::CRUTCH, yes_i_mean_all);
+    if (manager_subtype.count("MakeBoneCrossbow"))
     {
-        add_all(items_other_id::BOULDER, [this](df::item *i) -> bool
+        int16_t crossbow = manager_subtype.at("MakeBoneCrossbow");
+        add(stock_kind::crossbow, items_other_id::WEAPON, [crossbow](df::item *i) -> bool
                 {
-                    return !is_raw_coke(i).empty();
+                    return virtual_cast<df::item_weaponst>(i)->subtype->subtype == crossbow;
                 });
     }
-    else if (k == "gypsum")
+    else
     {
-        add_all(items_other_id::BOULDER, [this](df::item *i) -> bool
-                {
-                    return is_gypsum(i);
-                });
+        add(stock_kind::crossbow, items_other_id::WEAPON, no_such_item);
     }
-    else if (k == "raw_adamantine")
+    add(stock_kind::clay, items_other_id::BOULDER, [this](df::item *i) -> bool
+            {
+                int32_t mi = i->getMaterialIndex();
+                return mi >= 0 && size_t(mi) < clay_stones.size() && clay_stones[mi];
+            });
+    std::pair<stock_kind::kind, std::map<int32_t, int16_t> *> plant_keys[] =
     {
-        MaterialInfo candy;
-        if (candy.findInorganic("RAW_ADAMANTINE"))
-            add_all(items_other_id::BOULDER, [candy](df::item *i) -> bool
-                    {
-                        return i->getMaterialIndex() == candy.index;
-                    });
-    }
-    else if (k == "stone")
+        std::make_pair(stock_kind::drink_plant, &drink_plants),
+        std::make_pair(stock_kind::thread_plant, &thread_plants),
+        std::make_pair(stock_kind::mill_plant, &mill_plants),
+        std::make_pair(stock_kind::bag_plant, &bag_plants),
+        std::make_pair(stock_kind::slurry_plant, &slurry_plants),
+    };
+    for (auto pk = std::begin(plant_keys); pk != std::end(plant_keys); pk++)
     {
-        add_all(items_other_id::BOULDER, [](df::item *i) -> bool
+        const std::map<int32_t, int16_t> *plant = pk->second;
+        add(pk->first, items_other_id::PLANT, [plant](df::item *i) -> bool
                 {
-                    return !ui->economic_stone[i->getMaterialIndex()];
+                    auto p = plant->find(i->getMaterialIndex());
+                    return p != plant->end() && p->second == i->getMaterial();
                 });
     }
-    else if (k == "raw_fish")
-    {
-        add_all(items_other_id::FISH_RAW, yes_i_mean_all);
-    }
-    else if (k == "splint")
+    add(stock_kind::drink_fruit, items_other_id::PLANT_GROWTH, [this](df::item *i) -> bool
+            {
+                return drink_fruits.count(i->getMaterialIndex()) && drink_fruits.at(i->getMaterialIndex()) == i->getMaterial();
+            });
+    MaterialInfo honey;
+    if (honey.findCreature("HONEY_BEE", "HONEY"))
     {
-        add_all(items_other_id::SPLINT, yes_i_mean_all);
+        add(stock_kind::honey, items_other_id::LIQUID_MISC, [honey](df::item *i) -> bool
+                {
+                    return i->getMaterialIndex() == honey.index && i->getMaterial() == honey.type;
+                });
     }
-    else if (k == "crutch")
+    else
     {
-        add_all(items_other_id::CRUTCH, yes_i_mean_all);
+        add(stock_kind::honey, items_other_id::LIQUID_MISC, no_such_item);
     }
-    else if (k == "crossbow")
-    {
-        if (manager_subtype.count("MakeBoneCrossbow"))
-            add_all(items_other_id::WEAPON, [this](df::item *i) -> bool
+    add(stock_kind::milk, items_other_id::LIQUID_MISC, [this](df::item *i) -> bool
+            {
+                return milk_creatures.count(i->getMaterialIndex()) && milk_creatures.at(i->getMaterialIndex()) == i->getMaterial();
+            });
+    add(stock_kind::dye_plant, items_other_id::PLANT, [this](df::item *i) -> bool
+            {
+                return mill_plants.count(i->getMaterialIndex()) && mill_plants.at(i->getMaterialIndex()) == i->getMaterial() && dye_plants.count(i->getMaterialIndex());
+            });
+    add(stock_kind::thread_seeds, items_other_id::SEEDS, [this](df::item *i) -> bool
+            {
+                return thread_plants.count(i->getMaterialIndex()) && grow_plants.count(i->getMaterialIndex());
+            });
+    add(stock_kind::dye_seeds, items_other_id::SEEDS, [this](df::item *i) -> bool
+            {
+                return dye_plants.count(i->getMaterialIndex()) && grow_plants.count(i->getMaterialIndex());
+            });
+    add(stock_kind::dye, items_other_id::POWDER_MISC, [this](df::item *i) -> bool
+            {
+                return dye_plants.count(i->getMaterialIndex()) && dye_plants.at(i->getMaterialIndex()) == i->getMaterial();
+            });
+    add(stock_kind::block, items_other_id::BLOCKS, yes_i_mean_all);
+    // XXX exclude dwarf skulls ?
+    add(stock_kind::skull, items_other_id::CORPSEPIECE, [](df::item *item) -> bool
+            {
+                df::item_corpsepiecest *i = virtual_cast<df::item_corpsepiecest>(item);
+                return i->corpse_flags.bits.skull && !i->corpse_flags.bits.unbutchered;
+            });
+    // used for SpinThread which currently ignores the material_amount
+    // note: if it didn't, use either HairWool or Yarn but not both
+    add(stock_kind::wool, items_other_id::CORPSEPIECE, [](df::item *item) -> bool
+            {
+                df::item_corpsepiecest *i = virtual_cast<df::item_corpsepiecest>(item);
+                return i->corpse_flags.bits.hair_wool || i->corpse_flags.bits.yarn;
+            });
+    add(stock_kind::bonebolts, items_other_id::AMMO, [](df::item *i) -> bool
+            {
+                return virtual_cast<df::item_ammost>(i)->skill_used == job_skill::BONECARVE;
+            });
+    add(stock_kind::cloth, items_other_id::CLOTH, yes_i_mean_all);
+    add(stock_kind::cloth_nodye, items_other_id::CLOTH, [this](df::item *i) -> bool
+            {
+                df::item_clothst *c = virtual_cast<df::item_clothst>(i);
+                for (auto imp = c->improvements.begin(); imp != c->improvements.end(); imp++)
+                {
+                    if (dye_plants.count((*imp)->mat_index) && dye_plants.at((*imp)->mat_index) == (*imp)->mat_type)
                     {
-                        return virtual_cast<df::item_weaponst>(i)->subtype->subtype == manager_subtype.at("MakeBoneCrossbow");
-                    });
-    }
-    else if (k == "clay")
+                        return false;
+                    }
+                }
+                return true;
+            });
+    add(stock_kind::mechanism, items_other_id::TRAPPARTS, yes_i_mean_all);
+    add(stock_kind::cage, items_other_id::CAGE, [](df::item *i) -> bool
+            {
+                for (auto ref = i->general_refs.begin(); ref != i->general_refs.end(); ref++)
+                {
+                    if (virtual_cast<df::general_ref_contains_unitst>(*ref))
+                        return false;
+                    if (virtual_cast<df::general_ref_contains_itemst>(*ref))
+                        return false;
+                    df::general_ref_building_holderst *bh = virtual_cast<df::general_ref_building_holderst>(*ref);
+                    if (bh && virtual_cast<df::building_trapst>(bh->getBuilding()))
+                        return false;
+                }
+                return true;
+            });
+    add(stock_kind::lye, items_other_id::LIQUID_MISC, [](df::item *i) -> bool
+            {
+                MaterialInfo mat(i);
+                return mat.material && mat.material->id == "LYE";
+                // TODO check container has no water
+            });
+    add(stock_kind::plasterpowder, items_other_id::POWDER_MISC, [](df::item *i) -> bool
+            {
+                MaterialInfo mat(i);
+                return mat.material && mat.material->id == "PLASTER";
+            });
+    stock_kind::kind tools[] = { stock_kind::wheelbarrow, stock_kind::minecart, stock_kind::nestbox, stock_kind::hive, stock_kind::jug, stock_kind::stepladder, stock_kind::bookcase, stock_kind::quire, stock_kind::rock_pot };
+    for (auto tool = std::begin(tools); tool != std::end(tools); tool++)
     {
-        add_all(items_other_id::BOULDER, [this](df::item *i) -> bool
+        std::string ord = furniture_order(stock_kind::name(*tool));
+        if (!manager_subtype.count(ord))
+        {
+            add(*tool, items_other_id::TOOL, no_such_item);
+            continue;
+        }
+        int16_t subtype = manager_subtype.at(ord);
+        add(*tool, items_other_id::TOOL, [subtype](df::item *item) -> bool
                 {
-                    return clay_stones.count(i->getMaterialIndex());
+                    df::item_toolst *i = virtual_cast<df::item_toolst>(item);
+                    return i->subtype->subtype == subtype &&
+                        i->stockpile.id == -1 &&
+                        (i->vehicle_id == -1 || df::vehicle::find(i->vehicle_id)->route_id == -1);
                 });
     }
-    else if (k == "drink_plant" || k == "thread_plant" || k == "mill_plant" || k == "bag_plant" || k == "slurry_plant")
+    add(stock_kind::honeycomb, items_other_id::TOOL, [](df::item *i) -> bool
+            {
+                return virtual_cast<df::item_toolst>(i)->subtype->id == "ITE_TOOL_HONEYCOMB";
+            });
+    add(stock_kind::quiver, items_other_id::QUIVER, yes_i_mean_all);
+    add(stock_kind::flask, items_other_id::FLASK, yes_i_mean_all);
+    add(stock_kind::backpack, items_other_id::BACKPACK, yes_i_mean_all);
+    add(stock_kind::leather, items_other_id::SKIN_TANNED, yes_i_mean_all);
+    add(stock_kind::tallow, items_other_id::GLOB, [](df::item *i) -> bool
+            {
+                MaterialInfo mat(i);
+                return mat.material && mat.material->id == "TALLOW";
+            });
+    if (manager_subtype.count("MakeGiantCorkscrew"))
     {
-        std::map<int32_t, int16_t> & plant = k == "drink_plant" ? drink_plants : k == "thread_plant" ? thread_plants : k == "mill_plant" ? mill_plants : k == "bag_plant" ? bag_plants : slurry_plants;
-        add_all(items_other_id::PLANT, [plant](df::item *i) -> bool
+        int16_t corkscrew = manager_subtype.at("MakeGiantCorkscrew");
+        add(stock_kind::giant_corkscrew, items_other_id::TRAPCOMP, [corkscrew](df::item *item) -> bool
                 {
-                    return plant.count(i->getMaterialIndex()) && plant.at(i->getMaterialIndex()) == i->getMaterial();
+                    df::item_trapcompst *i = virtual_cast<df::item_trapcompst>(item);
+                    return i && i->subtype->subtype == corkscrew;
                 });
     }
-    else if (k == "drink_fruit")
+    else
     {
-        add_all(items_other_id::PLANT_GROWTH, [this](df::item *i) -> bool
+        add(stock_kind::giant_corkscrew, items_other_id::TRAPCOMP, no_such_item);
+    }
+    add(stock_kind::pipe_section, items_other_id::PIPE_SECTION, yes_i_mean_all);
+    add(stock_kind::anvil, items_other_id::ANVIL, yes_i_mean_all);
+    add(stock_kind::slab, items_other_id::SLAB, [](df::item *i) -> bool { return i->getSlabEngravingType() == slab_engraving_type::Slab; });
+    add(stock_kind::slurry, items_other_id::GLOB, [](df::item *i) -> bool
+            {
+                if (!virtual_cast<df::item_globst>(i)->mat_state.bits.paste)
                 {
-                    return drink_fruits.count(i->getMaterialIndex()) && drink_fruits.at(i->getMaterialIndex()) == i->getMaterial();
-                });
+                    return false;
+                }
+                MaterialInfo mat(i);
+                for (auto it = mat.material->reaction_class.begin(); it != mat.material->reaction_class.end(); it++)
+                {
+                    if (**it == "PAPER_SLURRY")
+                    {
+                        return true;
+                    }
+                }
+                return false;
+            });
+    add(stock_kind::paper, items_other_id::SHEET, yes_i_mean_all);
+
+    updating_count.erase(std::remove_if(updating_count.begin(), updating_count.end(), [&added](stock_kind::kind k) -> bool { return added[k]; }), updating_count.end());
+
+    std::vector<std::pair<df::items_other_id, stock_kind::kind>> layout;
+    for (auto it = census.begin(); it != census.end(); it++)
+    {
+        updating_census.push_back(it->first);
+        for (auto k = it->second.begin(); k != it->second.end(); k++)
+        {
+            layout.push_back(std::make_pair(it->first, k->first));
+        }
     }
-    else if (k == "honey")
+
+    // the per-item key bits are only meaningful for the same layout
+    if (layout != census_layout)
     {
-        MaterialInfo honey;
-        if (honey.findCreature("HONEY_BEE", "HONEY"))
-            add_all(items_other_id::LIQUID_MISC, [honey](df::item *i) -> bool
-                    {
-                        return i->getMaterialIndex() == honey.index && i->getMaterial() == honey.type;
-                    });
+        census_items.clear();
+        census_layout.swap(layout);
+        census_since_full = config.census_full_interval;
     }
-    else if (k == "milk")
+
+    census_generation++;
+    census_full = census_since_full >= config.census_full_interval;
+    if (!census_full)
     {
-        add_all(items_other_id::LIQUID_MISC, [this](df::item *i) -> bool
-                {
-                    return milk_creatures.count(i->getMaterialIndex()) && milk_creatures.at(i->getMaterialIndex()) == i->getMaterial();
-                });
+        census_since_full++;
+        return;
     }
-    else if (k == "dye_plant")
+
+    census_since_full = 0;
+    census_count.fill(0);
+    census_check.fill(0);
+    census_checking = config.debug && !census_items.empty();
+}
+
+// the census keys of this vector that a free item counts towards
+static uint64_t census_match(const std::vector<std::pair<stock_kind::kind, std::function<bool(df::item *)>>> & keys, df::item *i, std::unordered_map<int32_t, bool> & free_cache)
+{
+    uint64_t match = 0;
+    int is_free = -1;
+    for (size_t k = 0; k < keys.size(); k++)
     {
-        add_all(items_other_id::PLANT, [this](df::item *i) -> bool
-                {
-                    return mill_plants.count(i->getMaterialIndex()) && mill_plants.at(i->getMaterialIndex()) == i->getMaterial() && dye_plants.count(i->getMaterialIndex());
-                });
+        if (!keys[k].second(i))
+        {
+            continue;
+        }
+        if (is_free == -1)
+        {
+            // items are in several vectors, only check them once
+            auto cached = free_cache.find(i->id);
+            if (cached == free_cache.end())
+            {
+                cached = free_cache.insert(std::make_pair(i->id, Stocks::is_item_free(i))).first;
+            }
+            is_free = cached->second ? 1 : 0;
+        }
+        if (!is_free)
+        {
+            return 0;
+        }
+        match |= uint64_t(1) << k;
     }
-    else if (k == "thread_seeds" || k == "dye_seeds")
+    return match;
+}
+
+static void census_add(const std::vector<int32_t *> & n, uint64_t keys, int32_t stack)
+{
+    for (size_t k = 0; keys; k++, keys >>= 1)
     {
-        std::map<int32_t, int16_t> & plant = k == "thread_seeds" ? thread_plants : dye_plants;
-        add_all(items_other_id::SEEDS, [this, plant](df::item *i) -> bool
-                {
-                    return plant.count(i->getMaterialIndex()) && grow_plants.count(i->getMaterialIndex());
-                });
+        if (keys & 1)
+        {
+            *n.at(k) += stack;
+        }
     }
-    else if (k == "dye")
+}
+
+// count every census key of one item vector in a single walk
+void Stocks::count_census(color_ostream &, df::items_other_id id)
+{
+    const auto & keys = census.at(id);
+    std::vector<int32_t *> n;
+    std::vector<int32_t *> check;
+    for (auto k = keys.begin(); k != keys.end(); k++)
     {
-        add_all(items_other_id::POWDER_MISC, [this](df::item *i) -> bool
-                {
-                    return dye_plants.count(i->getMaterialIndex()) && dye_plants.at(i->getMaterialIndex()) == i->getMaterial();
-                });
+        n.push_back(&census_count[k->first]);
+        if (census_checking)
+        {
+            check.push_back(&census_check[k->first]);
+        }
     }
-    else if (k == "block")
+
+    auto & tracked = census_items[id];
+    for (auto it = world->items.other[id].begin(); it != world->items.other[id].end(); it++)
     {
-        add_all(items_other_id::BLOCKS, yes_i_mean_all);
+        df::item *i = *it;
+        uint32_t flags = i->flags.whole;
+        int32_t stack = virtual_cast<df::item_actual>(i)->stack_size;
+        auto t = tracked.find(i->id);
+        bool changed = t == tracked.end() || t->second.flags != flags || t->second.stack != stack;
+        if (!changed)
+        {
+            t->second.seen = census_generation;
+            if (!census_full)
+            {
+                continue;
+            }
+        }
+
+        uint64_t match = census_match(keys, i, census_free);
+        if (census_full)
+        {
+            if (!check.empty())
+            {
+                // what the incremental census would have counted
+                census_add(check, changed ? match : t->second.keys, stack);
+            }
+        }
+        else if (t != tracked.end())
+        {
+            census_add(n, t->second.keys, -t->second.stack);
+        }
+        census_add(n, match, stack);
+
+        census_item & item = tracked[i->id];
+        item.flags = flags;
+        item.stack = stack;
+        item.keys = match;
+        item.seen = census_generation;
     }
-    else if (k == "skull")
+
+    // forget items that left the vector
+    for (auto t = tracked.begin(); t != tracked.end(); )
     {
-        // XXX exclude dwarf skulls ?
-        add_all(items_other_id::CORPSEPIECE, [](df::item *item) -> bool
-                {
-                    df::item_corpsepiecest *i = virtual_cast<df::item_corpsepiecest>(item);
-                    return i->corpse_flags.bits.skull && !i->corpse_flags.bits.unbutchered;
-                });
+        if (t->second.seen == census_generation)
+        {
+            t++;
+            continue;
+        }
+        if (!census_full)
+        {
+            census_add(n, t->second.keys, -t->second.stack);
+        }
+        t = tracked.erase(t);
     }
-    else if (k == "bone")
+}
+
+void Stocks::census_finish(color_ostream & out)
+{
+    for (auto it = census_layout.begin(); it != census_layout.end(); it++)
+    {
+        stock_kind::kind k = it->second;
+        count[k] = census_count[k];
+        if (census_checking && census_check[k] != census_count[k])
+        {
+            ai->debug(out, stl_sprintf("stocks: incremental count of %s was %d, full count is %d", stock_kind::name(k), census_check[k], census_count[k]));
+        }
+    }
+    census_free.clear();
+    census_checking = false;
+}
+
+// count unused stocks of one type of item that census_setup does not handle
+int32_t Stocks::count_stocks(color_ostream & out, stock_kind::kind k)
+{
+    int32_t n = 0;
+    if (k == stock_kind::bone)
     {
         for (auto it = world->items.other[items_other_id::CORPSEPIECE].begin(); it != world->items.other[items_other_id::CORPSEPIECE].end(); it++)
         {
@@ -1222,7 +1699,7 @@ int32_t Stocks::count_stocks(color_ostream & out, std::string k)
             }
         }
     }
-    else if (k == "shell")
+    else if (k == stock_kind::shell)
     {
         for (auto it = world->items.other[items_other_id::CORPSEPIECE].begin(); it != world->items.other[items_other_id::CORPSEPIECE].end(); it++)
         {
@@ -1233,64 +1710,7 @@ int32_t Stocks::count_stocks(color_ostream & out, std::string k)
             }
         }
     }
-    else if (k == "wool")
-    {
-        // used for SpinThread which currently ignores the material_amount
-        // note: if it didn't, use either HairWool or Yarn but not both
-        add_all(items_other_id::CORPSEPIECE, [](df::item *item) -> bool
-                {
-                    df::item_corpsepiecest *i = virtual_cast<df::item_corpsepiecest>(item);
-                    return i->corpse_flags.bits.hair_wool || i->corpse_flags.bits.yarn;
-                });
-    }
-    else if (k == "bonebolts")
-    {
-        add_all(items_other_id::AMMO, [](df::item *i) -> bool
-                {
-                    return virtual_cast<df::item_ammost>(i)->skill_used == job_skill::BONECARVE;
-                });
-    }
-    else if (k == "cloth")
-    {
-        add_all(items_other_id::CLOTH, yes_i_mean_all);
-    }
-    else if (k == "cloth_nodye")
-    {
-        add_all(items_other_id::CLOTH, [this](df::item *i) -> bool
-                {
-                    df::item_clothst *c = virtual_cast<df::item_clothst>(i);
-                    for (auto imp = c->improvements.begin(); imp != c->improvements.end(); imp++)
-                    {
-                        if (dye_plants.count((*imp)->mat_index) && dye_plants.at((*imp)->mat_index) == (*imp)->mat_type)
-                        {
-                            return false;
-                        }
-                    }
-                    return true;
-                });
-    }
-    else if (k == "mechanism")
-    {
-        add_all(items_other_id::TRAPPARTS, yes_i_mean_all);
-    }
-    else if (k == "cage")
-    {
-        add_all(items_other_id::CAGE, [](df::item *i) -> bool
-                {
-                    for (auto ref = i->general_refs.begin(); ref != i->general_refs.end(); ref++)
-                    {
-                        if (virtual_cast<df::general_ref_contains_unitst>(*ref))
-                            return false;
-                        if (virtual_cast<df::general_ref_contains_itemst>(*ref))
-                            return false;
-                        df::general_ref_building_holderst *bh = virtual_cast<df::general_ref_building_holderst>(*ref);
-                        if (bh && virtual_cast<df::building_trapst>(bh->getBuilding()))
-                            return false;
-                    }
-                    return true;
-                });
-    }
-    else if (k == "coffin_bld")
+    else if (k == stock_kind::coffin_bld)
     {
         // count free constructed coffin buildings, not items
         for (auto bld = world->buildings.other[buildings_other_id::COFFIN].begin(); bld != world->buildings.other[buildings_other_id::COFFIN].end(); bld++)
@@ -1301,7 +1721,7 @@ int32_t Stocks::count_stocks(color_ostream & out, std::string k)
             }
         }
     }
-    else if (k == "coffin_bld_pet")
+    else if (k == stock_kind::coffin_bld_pet)
     {
         for (auto bld = world->buildings.other[buildings_other_id::COFFIN].begin(); bld != world->buildings.other[buildings_other_id::COFFIN].end(); bld++)
         {
@@ -1312,149 +1732,68 @@ int32_t Stocks::count_stocks(color_ostream & out, std::string k)
             }
         }
     }
-    else if (k == "weapon")
+    else if (k == stock_kind::weapon)
     {
         return count_stocks_weapon(out);
     }
-    else if (k == "pick")
+    else if (k == stock_kind::pick)
     {
         return count_stocks_weapon(out, job_skill::MINING);
     }
-    else if (k == "axe")
+    else if (k == stock_kind::axe)
     {
         return count_stocks_weapon(out, job_skill::AXE);
     }
-    else if (k == "armor_torso")
+    else if (k == stock_kind::armor_torso)
     {
         return count_stocks_armor(out, items_other_id::ARMOR);
     }
-    else if (k == "clothes_torso")
+    else if (k == stock_kind::clothes_torso)
     {
         return count_stocks_clothes(out, items_other_id::ARMOR);
     }
-    else if (k == "armor_legs")
+    else if (k == stock_kind::armor_legs)
     {
         return count_stocks_armor(out, items_other_id::PANTS);
     }
-    else if (k == "clothes_legs")
+    else if (k == stock_kind::clothes_legs)
     {
         return count_stocks_clothes(out, items_other_id::PANTS);
     }
-    else if (k == "armor_head")
+    else if (k == stock_kind::armor_head)
     {
         return count_stocks_armor(out, items_other_id::HELM);
     }
-    else if (k == "clothes_head")
+    else if (k == stock_kind::clothes_head)
     {
         return count_stocks_clothes(out, items_other_id::HELM);
     }
-    else if (k == "armor_hands")
+    else if (k == stock_kind::armor_hands)
     {
         return count_stocks_armor(out, items_other_id::GLOVES);
     }
-    else if (k == "clothes_hands")
+    else if (k == stock_kind::clothes_hands)
     {
         return count_stocks_clothes(out, items_other_id::GLOVES);
     }
-    else if (k == "armor_feet")
+    else if (k == stock_kind::armor_feet)
     {
         return count_stocks_armor(out, items_other_id::SHOES);
     }
-    else if (k == "clothes_feet")
+    else if (k == stock_kind::clothes_feet)
     {
         return count_stocks_clothes(out, items_other_id::SHOES);
     }
-    else if (k == "armor_shield")
+    else if (k == stock_kind::armor_shield)
     {
         return count_stocks_armor(out, items_other_id::SHIELD);
     }
-    else if (k == "lye")
-    {
-        add_all(items_other_id::LIQUID_MISC, [](df::item *i) -> bool
-                {
-                    MaterialInfo mat(i);
-                    return mat.material && mat.material->id == "LYE";
-                    // TODO check container has no water
-                });
-    }
-    else if (k == "plasterpowder")
-    {
-        add_all(items_other_id::POWDER_MISC, [](df::item *i) -> bool
-                {
-                    MaterialInfo mat(i);
-                    return mat.material && mat.material->id == "PLASTER";
-                });
-    }
-    else if (k == "wheelbarrow" || k == "minecart" || k == "nestbox" || k == "hive" || k == "jug" || k == "stepladder" || k == "bookcase" || k == "quire" || k == "rock_pot")
-    {
-        std::string ord = furniture_order(k);
-        if (manager_subtype.count(ord))
-            add_all(items_other_id::TOOL, [this, ord](df::item *item) -> bool
-                    {
-                        df::item_toolst *i = virtual_cast<df::item_toolst>(item);
-                        return i->subtype->subtype == manager_subtype.at(ord) &&
-                            i->stockpile.id == -1 &&
-                            (i->vehicle_id == -1 || df::vehicle::find(i->vehicle_id)->route_id == -1);
-                    });
-    }
-    else if (k == "honeycomb")
-    {
-        add_all(items_other_id::TOOL, [](df::item *i) -> bool
-                {
-                    return virtual_cast<df::item_toolst>(i)->subtype->id == "ITE_TOOL_HONEYCOMB";
-                });
-    }
-    else if (k == "quiver")
-    {
-        add_all(items_other_id::QUIVER, yes_i_mean_all);
-    }
-    else if (k == "flask")
-    {
-        add_all(items_other_id::FLASK, yes_i_mean_all);
-    }
-    else if (k == "backpack")
-    {
-        add_all(items_other_id::BACKPACK, yes_i_mean_all);
-    }
-    else if (k == "leather")
-    {
-        add_all(items_other_id::SKIN_TANNED, yes_i_mean_all);
-    }
-    else if (k == "tallow")
-    {
-        add_all(items_other_id::GLOB, [](df::item *i) -> bool
-                {
-                    MaterialInfo mat(i);
-                    return mat.material && mat.material->id == "TALLOW";
-                });
-    }
-    else if (k == "giant_corkscrew")
-    {
-        if (manager_subtype.count("MakeGiantCorkscrew"))
-            add_all(items_other_id::TRAPCOMP, [this](df::item *item) -> bool
-                    {
-                        df::item_trapcompst *i = virtual_cast<df::item_trapcompst>(item);
-                        return i && i->subtype->subtype == manager_subtype.at("MakeGiantCorkscrew");
-                    });
-    }
-    else if (k == "pipe_section")
-    {
-        add_all(items_other_id::PIPE_SECTION, yes_i_mean_all);
-    }
-    else if (k == "quern")
+    else if (k == stock_kind::quern)
     {
         // include used in building
         return world->items.other[items_other_id::QUERN].size();
     }
-    else if (k == "anvil")
-    {
-        add_all(items_other_id::ANVIL, yes_i_mean_all);
-    }
-    else if (k == "slab")
-    {
-        add_all(items_other_id::SLAB, [](df::item *i) -> bool { return i->getSlabEngravingType() == slab_engraving_type::Slab; });
-    }
-    else if (k == "dead_dwarf")
+    else if (k == stock_kind::dead_dwarf)
     {
         std::set<df::unit *> units;
         for (auto it = world->items.other[items_other_id::ANY_CORPSE].begin(); it != world->items.other[items_other_id::ANY_CORPSE].end(); it++)
@@ -1476,32 +1815,9 @@ int32_t Stocks::count_stocks(color_ostream & out, std::string k)
         }
         return units.size();
     }
-    else if (k == "slurry")
-    {
-        add_all(items_other_id::GLOB, [](df::item *i) -> bool
-                {
-                    if (!virtual_cast<df::item_globst>(i)->mat_state.bits.paste)
-                    {
-                        return false;
-                    }
-                    MaterialInfo mat(i);
-                    for (auto it = mat.material->reaction_class.begin(); it != mat.material->reaction_class.end(); it++)
-                    {
-                        if (**it == "PAPER_SLURRY")
-                        {
-                            return true;
-                        }
-                    }
-                    return false;
-                });
-    }
-    else if (k == "paper")
-    {
-        add_all(items_other_id::SHEET, yes_i_mean_all);
-    }
     else
     {
-        return find_furniture_itemcount(k);
+        return find_furniture_itemcount(stock_kind::name(k));
     }
 
     return n;
@@ -1656,97 +1972,97 @@ int32_t Stocks::count_stocks_clothes(color_ostream &, df::items_other_id oidx)
 }
 
 // make it so the stocks of 'what' rises by 'amount'
-void Stocks::queue_need(color_ostream & out, std::string what, int32_t amount)
+void Stocks::queue_need(color_ostream & out, stock_kind::kind what, int32_t amount)
 {
     if (amount <= 0)
         return;
 
-    std::vector<std::string> input;
+    std::vector<stock_kind::kind> input;
     std::string order;
 
-    if (what == "weapon")
+    if (what == stock_kind::weapon)
     {
-        queue_need_weapon(out, Watch.Needed.at("weapon"));
+        queue_need_weapon(out, Watch.Needed[stock_kind::weapon]);
         return;
     }
-    else if (what == "pick")
+    else if (what == stock_kind::pick)
     {
-        queue_need_weapon(out, Watch.Needed.at("pick"), job_skill::MINING);
+        queue_need_weapon(out, Watch.Needed[stock_kind::pick], job_skill::MINING);
         return;
     }
-    else if (what == "axe")
+    else if (what == stock_kind::axe)
     {
-        queue_need_weapon(out, Watch.Needed.at("axe"), job_skill::AXE);
+        queue_need_weapon(out, Watch.Needed[stock_kind::axe], job_skill::AXE);
         return;
     }
-    else if (what == "armor_torso")
+    else if (what == stock_kind::armor_torso)
     {
         queue_need_armor(out, items_other_id::ARMOR);
         return;
     }
-    else if (what == "clothes_torso")
+    else if (what == stock_kind::clothes_torso)
     {
         queue_need_clothes(out, items_other_id::ARMOR);
         return;
     }
-    else if (what == "armor_legs")
+    else if (what == stock_kind::armor_legs)
     {
         queue_need_armor(out, items_other_id::PANTS);
         return;
     }
-    else if (what == "clothes_legs")
+    else if (what == stock_kind::clothes_legs)
     {
         queue_need_clothes(out, items_other_id::PANTS);
         return;
     }
-    else if (what == "armor_head")
+    else if (what == stock_kind::armor_head)
     {
         queue_need_armor(out, items_other_id::HELM);
         return;
     }
-    else if (what == "clothes_head")
+    else if (what == stock_kind::clothes_head)
     {
         queue_need_clothes(out, items_other_id::HELM);
         return;
     }
-    else if (what == "armor_hands")
+    else if (what == stock_kind::armor_hands)
     {
         queue_need_armor(out, items_other_id::GLOVES);
         return;
     }
-    else if (what == "clothes_hands")
+    else if (what == stock_kind::clothes_hands)
     {
         queue_need_clothes(out, items_other_id::GLOVES);
         return;
     }
-    else if (what == "armor_feet")
+    else if (what == stock_kind::armor_feet)
     {
         queue_need_armor(out, items_other_id::SHOES);
         return;
     }
-    else if (what == "clothes_feet")
+    else if (what == stock_kind::clothes_feet)
     {
         queue_need_clothes(out, items_other_id::SHOES);
         return;
     }
-    else if (what == "armor_shield")
+    else if (what == stock_kind::armor_shield)
     {
         queue_need_armor(out, items_other_id::SHIELD);
         return;
     }
-    else if (what == "anvil")
+    else if (what == stock_kind::anvil)
     {
         queue_need_anvil(out);
         return;
     }
-    else if (what == "coffin_bld")
+    else if (what == stock_kind::coffin_bld)
     {
         queue_need_coffin_bld(out, amount);
         return;
     }
-    else if (what == "coffin_bld_pet")
+    else if (what == stock_kind::coffin_bld_pet)
     {
-        if (count.at("coffin_bld") >= Watch.Needed.at("coffin_bld"))
+        if (count[stock_kind::coffin_bld] >= Watch.Needed[stock_kind::coffin_bld])
         {
             for (auto bld = world->buildings.other[buildings_other_id::COFFIN].begin(); bld != world->buildings.other[buildings_other_id::COFFIN].end(); bld++)
             {
@@ -1760,7 +2076,7 @@ void Stocks::queue_need(color_ostream & out, std::string what, int32_t amount)
         }
         return;
     }
-    else if (what == "raw_coke")
+    else if (what == stock_kind::raw_coke)
     {
         if (ai->plan->past_initial_phase)
         {
@@ -1775,7 +2091,7 @@ void Stocks::queue_need(color_ostream & out, std::string what, int32_t amount)
         }
         return;
     }
-    else if (what == "gypsum")
+    else if (what == stock_kind::gypsum)
     {
         if (ai->plan->past_initial_phase)
         {
@@ -1790,7 +2106,7 @@ void Stocks::queue_need(color_ostream & out, std::string what, int32_t amount)
         }
         return;
     }
-    else if (what == "food")
+    else if (what == stock_kind::food)
     {
         // XXX fish/hunt/cook ?
         if (last_warn_food < std::time(nullptr) - 600) // warn every 10 minutes
@@ -1800,19 +2116,19 @@ void Stocks::queue_need(color_ostream & out, std::string what, int32_t amount)
         }
         return;
     }
-    else if (what == "thread_seeds")
+    else if (what == stock_kind::thread_seeds)
     {
         // only useful at game start, with low seeds stocks
         order = "ProcessPlants";
-        input.push_back("thread_plant");
+        input.push_back(stock_kind::thread_plant);
     }
-    else if (what == "dye_seeds" || what == "dye")
+    else if (what == stock_kind::dye_seeds || what == stock_kind::dye)
     {
         order = "MillPlants";
-        input.push_back("dye_plant");
-        input.push_back("bag");
+        input.push_back(stock_kind::dye_plant);
+        input.push_back(stock_kind::bag);
     }
-    else if (what == "wood")
+    else if (what == stock_kind::wood)
     {
         amount *= 2;
         if (amount > 30)
@@ -1822,21 +2138,21 @@ void Stocks::queue_need(color_ostream & out, std::string what, int32_t amount)
 
         return;
     }
-    else if (what == "honey")
+    else if (what == stock_kind::honey)
     {
         order = "PressHoneycomb";
-        input.push_back("honeycomb");
-        input.push_back("jug");
+        input.push_back(stock_kind::honeycomb);
+        input.push_back(stock_kind::jug);
     }
-    else if (what == "drink")
+    else if (what == stock_kind::drink)
     {
-        std::map<std::string, std::string> orders;
-        orders["drink_plant"] = "BrewDrinkPlant";
-        orders["drink_fruit"] = "BrewDrinkFruit";
-        orders["honey"] = "BrewMead";
-        auto score = [this, &out](std::pair<const std::string, std::string> i) -> int32_t
+        std::map<stock_kind::kind, std::string> orders;
+        orders[stock_kind::drink_plant] = "BrewDrinkPlant";
+        orders[stock_kind::drink_fruit] = "BrewDrinkFruit";
+        orders[stock_kind::honey] = "BrewMead";
+        auto score = [this, &out](std::pair<const stock_kind::kind, std::string> i) -> int32_t
         {
-            int32_t c = count.at(i.first);
+            int32_t c = count[i.first];
             df::manager_order_template tmpl;
             tmpl.job_type = job_type::CustomReaction;
             tmpl.reaction_name = Manager.Custom.at(i.second);
@@ -1847,20 +2163,20 @@ void Stocks::queue_need(color_ostream & out, std::string what, int32_t amount)
             c -= count_manager_orders(out, tmpl);
             return c;
         };
-        auto max = std::max_element(orders.begin(), orders.end(), [score](std::pair<const std::string, std::string> a, std::pair<const std::string, std::string> b) -> bool { return score(a) < score(b); });
+        auto max = std::max_element(orders.begin(), orders.end(), [score](std::pair<const stock_kind::kind, std::string> a, std::pair<const stock_kind::kind, std::string> b) -> bool { return score(a) < score(b); });
         order = max->second;
         input.push_back(max->first);
-        if (count["barrel"] > count["rock_pot"])
+        if (count[stock_kind::barrel] > count[stock_kind::rock_pot])
         {
-            input.push_back("barrel");
+            input.push_back(stock_kind::barrel);
         }
         else
         {
-            input.push_back("rock_pot");
+            input.push_back(stock_kind::rock_pot);
         }
         amount = (amount + 4) / 5; // accounts for brewer yield, but not for input stack size
     }
-    else if (what == "block")
+    else if (what == stock_kind::block)
     {
         amount = (amount + 3) / 4;
         // no stone => make wooden blocks (needed for pumps for aquifer handling)
@@ -1881,53 +2197,53 @@ void Stocks::queue_need(color_ostream & out, std::string what, int32_t amount)
             order = "ConstructWoodenBlocks";
         }
     }
-    else if (what == "coal")
+    else if (what == stock_kind::coal)
     {
         // dont use wood -> charcoal if we have bituminous coal
         // (except for bootstraping)
-        if (amount > 2 - count.at("coal") && count.at("raw_coke") > Watch.WatchStock.at("raw_coke"))
+        if (amount > 2 - count[stock_kind::coal] && count[stock_kind::raw_coke] > Watch.WatchStock[stock_kind::raw_coke])
         {
-            amount = 2 - count.at("coal");
+            amount = 2 - count[stock_kind::coal];
         }
     }
-    else if (what == "ash")
+    else if (what == stock_kind::ash)
     {
-        input.push_back("wood");
+        input.push_back(stock_kind::wood);
     }
-    else if (what == "lye")
+    else if (what == stock_kind::lye)
     {
-        input.push_back("ash");
-        input.push_back("bucket");
+        input.push_back(stock_kind::ash);
+        input.push_back(stock_kind::bucket);
     }
-    else if (what == "soap")
+    else if (what == stock_kind::soap)
     {
-        input.push_back("lye");
-        input.push_back("tallow");
+        input.push_back(stock_kind::lye);
+        input.push_back(stock_kind::tallow);
     }
-    else if (what == "plasterpowder")
+    else if (what == stock_kind::plasterpowder)
     {
-        input.push_back("gypsum");
-        input.push_back("bag");
+        input.push_back(stock_kind::gypsum);
+        input.push_back(stock_kind::bag);
     }
-    else if (what == "slurry")
+    else if (what == stock_kind::slurry)
     {
         order = "MakeSlurryFromPlant";
-        input.push_back("slurry_plant");
+        input.push_back(stock_kind::slurry_plant);
     }
-    else if (what == "paper")
+    else if (what == stock_kind::paper)
     {
         order = "PressPlantPaper";
-        input.push_back("slurry");
+        input.push_back(stock_kind::slurry);
     }
-    else if (what == "quire")
+    else if (what == stock_kind::quire)
     {
         order = "MakeQuire";
-        input.push_back("paper");
+        input.push_back(stock_kind::paper);
     }
 
     if (order.empty())
     {
-        order = furniture_order(what);
+        order = furniture_order(stock_kind::name(what));
     }
 
     if (amount > 30)
@@ -1938,12 +2254,12 @@ void Stocks::queue_need(color_ostream & out, std::string what, int32_t amount)
         int32_t i_amount = amount;
         for (auto i = input.begin(); i != input.end(); i++)
         {
-            int32_t c = count.at(*i);
+            int32_t c = count[*i];
             if (c < i_amount)
             {
                 i_amount = c;
             }
-            if (c < amount && Watch.Needed.count(*i))
+            if (c < amount && Watch.Needed[*i])
             {
                 queue_need(out, *i, amount - c);
             }
@@ -1956,11 +2272,13 @@ void Stocks::queue_need(color_ostream & out, std::string what, int32_t amount)
         df::job_material_category matcat = Manager.MatCategory.at(order);
         df::job_type job = job_type::NONE;
         find_enum_item(&job, order);
-        std::string matcat_str = bitfield_to_string(matcat);
-        int32_t i_amount = count.at(matcat_str) - count_manager_orders_matcat(matcat, job);
-        if (i_amount < amount && Watch.Needed.count(matcat_str))
+        // materials we do not keep count of (eg. strand) have a stock of 0
+        stock_kind::kind mat = stock_kind::_stock_kind_count;
+        find_stock_kind(bitfield_to_string(matcat), mat);
+        int32_t i_amount = (mat != stock_kind::_stock_kind_count ? count[mat] : 0) - count_manager_orders_matcat(matcat, job);
+        if (i_amount < amount && mat != stock_kind::_stock_kind_count && Watch.Needed[mat])
         {
-            queue_need(out, matcat_str, amount - i_amount);
+            queue_need(out, mat, amount - i_amount);
         }
         if (amount > i_amount)
         {
@@ -1974,11 +2292,11 @@ void Stocks::queue_need(color_ostream & out, std::string what, int32_t amount)
 // forge weapons
 void Stocks::queue_need_weapon(color_ostream & out, int32_t needed, df::job_skill skill)
 {
-    if (skill == job_skill::NONE && (count.at("pick") == 0 || count.at("axe") == 0))
+    if (skill == job_skill::NONE && (count[stock_kind::pick] == 0 || count[stock_kind::axe] == 0))
         return;
 
     std::map<int32_t, int32_t> bars;
-    int32_t coal_bars = count.at("coal");
+    int32_t coal_bars = count[stock_kind::coal];
     if (!world->buildings.other[buildings_other_id::FURNACE_SMELTER_MAGMA].empty())
         coal_bars = 50000;
 
@@ -1992,14 +2310,12 @@ void Stocks::queue_need_weapon(color_ostream & out, int32_t needed, df::job_skil
     }
 
     // rough account of already queued jobs consumption
-    for (auto mo = world->manager_orders.begin(); mo != world->manager_orders.end(); mo++)
+    const manager_order_index & queued = manager_orders();
+    for (auto mo = queued.by_inorganic_total.begin(); mo != queued.by_inorganic_total.end(); mo++)
     {
-        if ((*mo)->mat_type == 0)
-        {
-            bars[(*mo)->mat_index] -= 4 * (*mo)->amount_total;
-            coal_bars -= (*mo)->amount_total;
-        }
+        bars[mo->first] -= 4 * mo->second;
     }
+    coal_bars -= queued.inorganic_total;
 
     if (metal_digger_pref.empty())
     {
@@ -2051,13 +2367,7 @@ void Stocks::queue_need_weapon(color_ostream & out, int32_t needed, df::job_skil
                     cnt--;
                 }
             }
-            for (auto mo = world->manager_orders.begin(); mo != world->manager_orders.end(); mo++)
-            {
-                if ((*mo)->job_type == job_type::MakeWeapon && (*mo)->item_subtype == idef->subtype)
-                {
-                    cnt -= (*mo)->amount_total;
-                }
-            }
+            cnt -= count_manager_orders_job(job_type::MakeWeapon, idef->subtype).total;
             if (cnt <= 0)
                 continue;
 
@@ -2111,19 +2421,19 @@ static void queue_need_armor_helper(AI *ai, std::vector<int32_t> & metal_armor_p
 
         const static struct armor_needed
         {
-            std::map<df::items_other_id, std::string> map;
+            std::map<df::items_other_id, stock_kind::kind> map;
 
             armor_needed()
             {
-                map[items_other_id::ARMOR] = "armor_torso";
-                map[items_other_id::SHIELD] = "armor_shield";
-                map[items_other_id::HELM] = "armor_head";
-                map[items_other_id::PANTS] = "armor_legs";
-                map[items_other_id::GLOVES] = "armor_hands";
-                map[items_other_id::SHOES] = "armor_feet";
+                map[items_other_id::ARMOR] = stock_kind::armor_torso;
+                map[items_other_id::SHIELD] = stock_kind::armor_shield;
+                map[items_other_id::HELM] = stock_kind::armor_head;
+                map[items_other_id::PANTS] = stock_kind::armor_legs;
+                map[items_other_id::GLOVES] = stock_kind::armor_hands;
+                map[items_other_id::SHOES] = stock_kind::armor_feet;
             }
         } needed;
-        int32_t cnt = Watch.Needed.at(needed.map.at(oidx));
+        int32_t cnt = Watch.Needed[needed.map.at(oidx)];
         int32_t have = 0;
         for (auto item = world->items.other[oidx].begin(); item != world->items.other[oidx].end(); item++)
         {
@@ -2135,13 +2445,7 @@ static void queue_need_armor_helper(AI *ai, std::vector<int32_t> & metal_armor_p
         }
         cnt -= have / div;
 
-        for (auto mo = world->manager_orders.begin(); mo != world->manager_orders.end(); mo++)
-        {
-            if ((*mo)->job_type == job && (*mo)->item_subtype == idef->subtype)
-            {
-                cnt -= (*mo)->amount_total;
-            }
-        }
+        cnt -= ai->stocks->count_manager_orders_job(job, idef->subtype).total;
         if (cnt <= 0)
         {
             continue;
@@ -2183,7 +2487,7 @@ static void queue_need_armor_helper(AI *ai, std::vector<int32_t> & metal_armor_p
 void Stocks::queue_need_armor(color_ostream & out, df::items_other_id oidx)
 {
     std::map<int32_t, int32_t> bars;
-    int32_t coal_bars = count.at("coal");
+    int32_t coal_bars = count[stock_kind::coal];
     if (!world->buildings.other[buildings_other_id::FURNACE_SMELTER_MAGMA].empty())
         coal_bars = 50000;
 
@@ -2197,14 +2501,12 @@ void Stocks::queue_need_armor(color_ostream & out, df::items_other_id oidx)
     }
 
     // rough account of already queued jobs consumption
-    for (auto mo = world->manager_orders.begin(); mo != world->manager_orders.end(); mo++)
+    const manager_order_index & queued = manager_orders();
+    for (auto mo = queued.by_inorganic_total.begin(); mo != queued.by_inorganic_total.end(); mo++)
     {
-        if ((*mo)->mat_type == 0)
-        {
-            bars[(*mo)->mat_index] -= 4 * (*mo)->amount_total;
-            coal_bars -= (*mo)->amount_total;
-        }
+        bars[mo->first] -= 4 * mo->second;
     }
+    coal_bars -= queued.inorganic_total;
 
     if (metal_armor_pref.empty())
     {
@@ -2251,7 +2553,7 @@ void Stocks::queue_need_armor(color_ostream & out, df::items_other_id oidx)
 void Stocks::queue_need_anvil(color_ostream & out)
 {
     std::map<int32_t, int32_t> bars;
-    int32_t coal_bars = count.at("coal");
+    int32_t coal_bars = count[stock_kind::coal];
     if (!world->buildings.other[buildings_other_id::FURNACE_SMELTER_MAGMA].empty())
         coal_bars = 50000;
 
@@ -2265,14 +2567,12 @@ void Stocks::queue_need_anvil(color_ostream & out)
     }
 
     // rough account of already queued jobs consumption
-    for (auto mo = world->manager_orders.begin(); mo != world->manager_orders.end(); mo++)
+    const manager_order_index & queued = manager_orders();
+    for (auto mo = queued.by_inorganic_total.begin(); mo != queued.by_inorganic_total.end(); mo++)
     {
-        if ((*mo)->mat_type == 0)
-        {
-            bars[(*mo)->mat_index] -= 4 * (*mo)->amount_total;
-            coal_bars -= (*mo)->amount_total;
-        }
+        bars[mo->first] -= 4 * mo->second;
     }
+    coal_bars -= queued.inorganic_total;
 
     if (metal_anvil_pref.empty())
     {
@@ -2285,16 +2585,10 @@ void Stocks::queue_need_anvil(color_ostream & out)
         }
     }
 
-    int32_t cnt = Watch.Needed.at("anvil");
-    cnt -= count.at("anvil");
+    int32_t cnt = Watch.Needed[stock_kind::anvil];
+    cnt -= count[stock_kind::anvil];
 
-    for (auto mo = world->manager_orders.begin(); mo != world->manager_orders.end(); mo++)
-    {
-        if ((*mo)->job_type == job_type::ForgeAnvil)
-        {
-            cnt -= (*mo)->amount_total;
-        }
-    }
+    cnt -= count_manager_orders_job(job_type::ForgeAnvil).total;
     if (cnt <= 0)
         return;
 
@@ -2351,14 +2645,8 @@ static void queue_need_clothes_helper(AI *ai, color_ostream & out, df::items_oth
         }
         cnt -= have / div;
 
-        for (auto mo = world->manager_orders.begin(); mo != world->manager_orders.end(); mo++)
-        {
-            if ((*mo)->job_type == job && (*mo)->item_subtype == idef->subtype)
-            {
-                cnt -= (*mo)->amount_total;
-            }
-            // TODO subtract available_cloth too
-        }
+        cnt -= ai->stocks->count_manager_orders_job(job, idef->subtype).total;
+        // TODO subtract available_cloth too
         if (cnt > available_cloth)
             cnt = available_cloth;
         if (cnt <= 0)
@@ -2380,26 +2668,26 @@ static void queue_need_clothes_helper(AI *ai, color_ostream & out, df::items_oth
 void Stocks::queue_need_clothes(color_ostream & out, df::items_other_id oidx)
 {
     // try to avoid cancel spam
-    int32_t available_cloth = count.at("cloth") - 20;
+    int32_t available_cloth = count[stock_kind::cloth] - 20;
 
     auto & ue = ui->main.fortress_entity->entity_raw->equipment;
 
     switch (oidx)
     {
         case items_other_id::ARMOR:
-            queue_need_clothes_helper<df::itemdef_armorst, df::item_armorst>(ai, out, oidx, ue.armor_id, available_cloth, job_type::MakeArmor, num_needed("clothes_torso"));
+            queue_need_clothes_helper<df::itemdef_armorst, df::item_armorst>(ai, out, oidx, ue.armor_id, available_cloth, job_type::MakeArmor, num_needed(stock_kind::clothes_torso));
             return;
         case items_other_id::HELM:
-            queue_need_clothes_helper<df::itemdef_helmst, df::item_helmst>(ai, out, oidx, ue.helm_id, available_cloth, job_type::MakeHelm, num_needed("clothes_head"));
+            queue_need_clothes_helper<df::itemdef_helmst, df::item_helmst>(ai, out, oidx, ue.helm_id, available_cloth, job_type::MakeHelm, num_needed(stock_kind::clothes_head));
             return;
         case items_other_id::PANTS:
-            queue_need_clothes_helper<df::itemdef_pantsst, df::item_pantsst>(ai, out, oidx, ue.pants_id, available_cloth, job_type::MakePants, num_needed("clothes_legs"));
+            queue_need_clothes_helper<df::itemdef_pantsst, df::item_pantsst>(ai, out, oidx, ue.pants_id, available_cloth, job_type::MakePants, num_needed(stock_kind::clothes_legs));
             return;
         case items_other_id::GLOVES:
-            queue_need_clothes_helper<df::itemdef_glovesst, df::item_glovesst>(ai, out, oidx, ue.gloves_id, available_cloth, job_type::MakeGloves, num_needed("clothes_hands"), 2);
+            queue_need_clothes_helper<df::itemdef_glovesst, df::item_glovesst>(ai, out, oidx, ue.gloves_id, available_cloth, job_type::MakeGloves, num_needed(stock_kind::clothes_hands), 2);
             return;
         case items_other_id::SHOES:
-            queue_need_clothes_helper<df::itemdef_shoesst, df::item_shoesst>(ai, out, oidx, ue.shoes_id, available_cloth, job_type::MakeShoes, num_needed("clothes_feet"), 2);
+            queue_need_clothes_helper<df::itemdef_shoesst, df::item_shoesst>(ai, out, oidx, ue.shoes_id, available_cloth, job_type::MakeShoes, num_needed(stock_kind::clothes_feet), 2);
             return;
         default:
             return;
@@ -2431,62 +2719,62 @@ void Stocks::queue_need_coffin_bld(color_ostream & out, int32_t amount)
 }
 
 // make it so the stocks of 'what' decrease by 'amount'
-void Stocks::queue_use(color_ostream & out, std::string what, int32_t amount)
+void Stocks::queue_use(color_ostream & out, stock_kind::kind what, int32_t amount)
 {
     if (amount <= 0)
         return;
 
-    std::vector<std::string> input;
+    std::vector<stock_kind::kind> input;
     std::string order;
 
-    if (what == "metal_ore")
+    if (what == stock_kind::metal_ore)
     {
         queue_use_metal_ore(out, amount);
         return;
     }
-    else if (what == "raw_coke")
+    else if (what == stock_kind::raw_coke)
     {
         queue_use_raw_coke(out, amount);
         return;
     }
-    else if (what == "roughgem")
+    else if (what == stock_kind::roughgem)
     {
         queue_use_gems(out, amount);
         return;
     }
-    else if (what == "raw_adamantine")
+    else if (what == stock_kind::raw_adamantine)
     {
         order = "ExtractMetalStrands";
     }
-    else if (what == "clay")
+    else if (what == stock_kind::clay)
     {
-        input.push_back("coal"); // TODO: handle magma kilns
+        input.push_back(stock_kind::coal); // TODO: handle magma kilns
         order = "MakeClayStatue";
     }
-    else if (what == "drink_plant" || what == "drink_fruit")
+    else if (what == stock_kind::drink_plant || what == stock_kind::drink_fruit)
     {
-        order = what == "drink_plant" ? "BrewDrinkPlant" : "BrewDrinkFruit";
+        order = what == stock_kind::drink_plant ? "BrewDrinkPlant" : "BrewDrinkFruit";
         // stuff may rot/be brewed before we can process it
         if (amount > 10)
             amount /= 2;
         if (amount > 4)
             amount /= 2;
 
-        if (count["barrel"] > count["rock_pot"])
+        if (count[stock_kind::barrel] > count[stock_kind::rock_pot])
         {
-            input.push_back("barrel");
+            input.push_back(stock_kind::barrel);
         }
         else
         {
-            input.push_back("rock_pot");
+            input.push_back(stock_kind::rock_pot);
         }
 
-        if (!need_more("drink"))
+        if (!need_more(stock_kind::drink))
         {
             return;
         }
     }
-    else if (what == "thread_plant")
+    else if (what == stock_kind::thread_plant)
     {
         order = "ProcessPlants";
         // stuff may rot/be brewed before we can process it
@@ -2495,30 +2783,30 @@ void Stocks::queue_use(color_ostream & out, std::string what, int32_t amount)
         if (amount > 4)
             amount /= 2;
     }
-    else if (what == "mill_plant" || what == "bag_plant")
+    else if (what == stock_kind::mill_plant || what == stock_kind::bag_plant)
     {
-        order = what == "mill_plant" ? "MillPlants" : "ProcessPlantsBag";
+        order = what == stock_kind::mill_plant ? "MillPlants" : "ProcessPlantsBag";
         // stuff may rot/be brewed before we can process it
         if (amount > 10)
             amount /= 2;
         if (amount > 4)
             amount /= 2;
-        input.push_back("bag");
+        input.push_back(stock_kind::bag);
     }
-    else if (what == "food_ingredients")
+    else if (what == stock_kind::food_ingredients)
     {
         order = "PrepareMeal";
         amount = (amount + 4) / 5;
-        if (!need_more("food"))
+        if (!need_more(stock_kind::food))
         {
             return;
         }
     }
-    else if (what == "skull")
+    else if (what == stock_kind::skull)
     {
         order = "MakeTotem";
     }
-    else if (what == "bone")
+    else if (what == stock_kind::bone)
     {
         int32_t nhunters = 0;
         for (auto u = world->units.active.begin(); u != world->units.active.end(); u++)
@@ -2532,7 +2820,7 @@ void Stocks::queue_use(color_ostream & out, std::string what, int32_t amount)
         {
             return;
         }
-        int32_t need_crossbow = nhunters + 1 - count.at("crossbow");
+        int32_t need_crossbow = nhunters + 1 - count[stock_kind::crossbow];
         if (need_crossbow > 0)
         {
             order = "MakeBoneCrossbow";
@@ -2542,7 +2830,7 @@ void Stocks::queue_use(color_ostream & out, std::string what, int32_t amount)
         else
         {
             order = "MakeBoneBolt";
-            int32_t stock = count.at("bonebolts");
+            int32_t stock = count[stock_kind::bonebolts];
             if (amount > 1000 - stock)
                 amount = 1000 - stock;
             if (amount > 10)
@@ -2551,53 +2839,53 @@ void Stocks::queue_use(color_ostream & out, std::string what, int32_t amount)
                 amount /= 2;
         }
     }
-    else if (what == "shell")
+    else if (what == stock_kind::shell)
     {
         order = "DecorateWithShell";
     }
-    else if (what == "wool")
+    else if (what == stock_kind::wool)
     {
         order = "SpinThread";
     }
-    else if (what == "cloth_nodye")
+    else if (what == stock_kind::cloth_nodye)
     {
         order = "DyeCloth";
-        input.push_back("dye");
+        input.push_back(stock_kind::dye);
         if (amount > 10)
             amount /= 2;
         if (amount > 4)
             amount /= 2;
     }
-    else if (what == "raw_fish")
+    else if (what == stock_kind::raw_fish)
     {
         order = "PrepareRawFish";
     }
-    else if (what == "honeycomb")
+    else if (what == stock_kind::honeycomb)
     {
         order = "PressHoneycomb";
-        input.push_back("jug");
+        input.push_back(stock_kind::jug);
     }
-    else if (what == "honey")
+    else if (what == stock_kind::honey)
     {
         order = "BrewMead";
-        if (count["barrel"] > count["rock_pot"])
+        if (count[stock_kind::barrel] > count[stock_kind::rock_pot])
         {
-            input.push_back("barrel");
+            input.push_back(stock_kind::barrel);
         }
         else
         {
-            input.push_back("rock_pot");
+            input.push_back(stock_kind::rock_pot);
         }
     }
-    else if (what == "milk")
+    else if (what == stock_kind::milk)
     {
         order = "MakeCheese";
     }
-    else if (what == "tallow")
+    else if (what == stock_kind::tallow)
     {
         order = "MakeSoap";
-        input.push_back("lye");
-        if (!need_more("soap"))
+        input.push_back(stock_kind::lye);
+        if (!need_more(stock_kind::soap))
         {
             return;
         }
@@ -2611,10 +2899,10 @@ void Stocks::queue_use(color_ostream & out, std::string what, int32_t amount)
         int32_t i_amount = amount;
         for (auto i = input.begin(); i != input.end(); i++)
         {
-            int32_t c = count.at(*i);
+            int32_t c = count[*i];
             if (i_amount > c)
                 i_amount = c;
-            if (c < amount && Watch.Needed.count(*i))
+            if (c < amount && Watch.Needed[*i])
             {
                 queue_need(out, *i, amount - c);
             }
@@ -2628,12 +2916,9 @@ void Stocks::queue_use(color_ostream & out, std::string what, int32_t amount)
 // cut gems
 void Stocks::queue_use_gems(color_ostream & out, int32_t amount)
 {
-    for (auto mo = world->manager_orders.begin(); mo != world->manager_orders.end(); mo++)
+    if (count_manager_orders_job(job_type::CutGems).orders)
     {
-        if ((*mo)->job_type == job_type::CutGems)
-        {
-            return;
-        }
+        return;
     }
     df::item *base = nullptr;
     for (auto i = world->items.other[items_other_id::ROUGH].begin(); i != world->items.other[items_other_id::ROUGH].end(); i++)
@@ -2676,16 +2961,13 @@ void Stocks::queue_use_gems(color_ostream & out, int32_t amount)
 void Stocks::queue_use_metal_ore(color_ostream & out, int32_t amount)
 {
     // make coke from bituminous coal has priority
-    if (count.at("raw_coke") > Watch.WatchStock.at("raw_coke") && count.at("coal") < 100)
+    if (count[stock_kind::raw_coke] > Watch.WatchStock[stock_kind::raw_coke] && count[stock_kind::coal] < 100)
     {
         return;
     }
-    for (auto mo = world->manager_orders.begin(); mo != world->manager_orders.end(); mo++)
+    if (count_manager_orders_job(job_type::SmeltOre).orders)
     {
-        if ((*mo)->job_type == job_type::SmeltOre)
-        {
-            return;
-        }
+        return;
     }
 
     df::item *base = nullptr;
@@ -2718,8 +3000,8 @@ void Stocks::queue_use_metal_ore(color_ostream & out, int32_t amount)
 
     if (world->buildings.other[buildings_other_id::FURNACE_SMELTER_MAGMA].empty())
     {
-        if (amount > count.at("coal"))
-            amount = count.at("coal");
+        if (amount > count[stock_kind::coal])
+            amount = count[stock_kind::coal];
         if (amount <= 0)
             return;
     }
@@ -2736,10 +3018,10 @@ void Stocks::queue_use_metal_ore(color_ostream & out, int32_t amount)
 // bituminous_coal -> coke
 void Stocks::queue_use_raw_coke(color_ostream & out, int32_t amount)
 {
-    is_raw_coke(0); // populate raw_coke_inv
-    for (auto mo = world->manager_orders.begin(); mo != world->manager_orders.end(); mo++)
+    const auto & by_reaction = manager_orders().by_reaction;
+    for (auto r = raw_coke_inv.begin(); r != raw_coke_inv.end(); r++)
     {
-        if ((*mo)->job_type == job_type::CustomReaction && raw_coke_inv.count((*mo)->reaction_name))
+        if (by_reaction.count(r->first))
         {
             return;
         }
@@ -2779,7 +3061,7 @@ void Stocks::queue_use_raw_coke(color_ostream & out, int32_t amount)
     if (world->buildings.other[buildings_other_id::FURNACE_SMELTER_MAGMA].empty())
     {
         // need at least 1 unit of fuel to bootstrap
-        if (count.at("coal") <= 0)
+        if (count[stock_kind::coal] <= 0)
         {
             return;
         }
@@ -2795,17 +3077,33 @@ void Stocks::queue_use_raw_coke(color_ostream & out, int32_t amount)
     add_manager_order(out, tmpl, amount);
 }
 
+// visible tree trunks that are not next to water and can be reached
+static bool is_cuttable_tree(df::coord pos, uint16_t walkable)
+{
+    df::tiletype tt = *Maps::getTileType(pos);
+    return ENUM_ATTR(tiletype, material, tt) == tiletype_material::TREE &&
+        ENUM_ATTR(tiletype, shape, tt) == tiletype_shape::WALL &&
+        !Maps::getTileDesignation(pos)->bits.hidden &&
+        !Plan::spiral_search(pos, 1, [](df::coord t) -> bool
+            {
+                df::tile_designation *td = Maps::getTileDesignation(t);
+                return td && td->bits.flow_size > 0;
+            }).isValid() &&
+        Plan::spiral_search(pos, 1, [walkable](df::coord t) -> bool
+            {
+                return walkable == Plan::getTileWalkable(t);
+            }).isValid();
+}
+
 // designate some trees for woodcutting
 df::coord Stocks::cuttrees(color_ostream &, int32_t amount)
 {
     std::set<df::coord> jobs;
 
-    for (auto job = world->job_list.next; job; job = job->next)
+    const auto & fell = AI::jobs_by_type(job_type::FellTree);
+    for (auto job = fell.begin(); job != fell.end(); job++)
     {
-        if (job->item->job_type == job_type::FellTree)
-        {
-            jobs.insert(job->item->pos);
-        }
+        jobs.insert((*job)->pos);
     }
 
     if (last_cutpos.isValid() && (Maps::getTileDesignation(last_cutpos)->bits.dig != tile_dig_designation::No || jobs.count(last_cutpos)))
@@ -2818,23 +3116,26 @@ df::coord Stocks::cuttrees(color_ostream &, int32_t amount)
     df::coord br;
     br.clear();
 
-    auto list = tree_list();
+    update_trees();
+    uint16_t walkable = Plan::getTileWalkable(ai->plan->fort_entrance->max);
 
-    for (auto tree = list.begin(); tree != list.end(); tree++)
+    // closest trees first, only the ones we look at are checked
+    for (auto it = trees.begin(); it != trees.end(); it++)
     {
-        if (ENUM_ATTR(tiletype, material, *Maps::getTileType(*tree)) != tiletype_material::TREE)
+        df::coord tree = it->pos;
+        if (!is_cuttable_tree(tree, walkable))
         {
             continue;
         }
 
-        if (!br.isValid() || (br.x & -16) < (tree->x & -16) || ((br.x & -16) == (tree->x & -16) && (br.y & -16) < (tree->y & -16)))
+        if (!br.isValid() || (br.x & -16) < (tree.x & -16) || ((br.x & -16) == (tree.x & -16) && (br.y & -16) < (tree.y & -16)))
         {
-            br = *tree;
+            br = tree;
         }
 
-        if (Maps::getTileDesignation(*tree)->bits.dig == tile_dig_designation::No && !jobs.count(*tree))
+        if (Maps::getTileDesignation(tree)->bits.dig == tile_dig_designation::No && !jobs.count(tree))
         {
-            Plan::dig_tile(*tree, tile_dig_designation::Default);
+            Plan::dig_tile(tree, tile_dig_designation::Default);
         }
 
         amount--;
@@ -2847,48 +3148,121 @@ df::coord Stocks::cuttrees(color_ostream &, int32_t amount)
     return br;
 }
 
-// return a list of trees on the map
-// lists only visible trees, sorted by distance from the fort entrance
-// expensive method, dont call often
-std::set<df::coord, std::function<bool(df::coord, df::coord)>> Stocks::tree_list()
+// bring the tree index up to date with the plant vectors: trees that grew
+// are added, trees that were cut down or burnt are dropped, and the rest
+// keep their place
+void Stocks::update_trees()
 {
-    uint16_t walkable = Plan::getTileWalkable(ai->plan->fort_entrance->max);
-
-    auto is_walkable = [walkable](df::coord t) -> bool
+    df::coord origin = ai->plan->fort_entrance->pos();
+    if (origin != trees_origin)
     {
-        return walkable == Plan::getTileWalkable(t);
-    };
+        // distances are relative to the entrance
+        trees.clear();
+        tree_seen.clear();
+        trees_origin = origin;
+    }
 
-    auto add_from_vector = [this, is_walkable](std::vector<df::plant *> & trees)
+    trees_generation++;
+    auto add_from_vector = [this, origin](std::vector<df::plant *> & plants)
     {
-        for (auto it = trees.begin(); it != trees.end(); it++)
+        for (auto it = plants.begin(); it != plants.end(); it++)
         {
-            df::plant *p = *it;
-            df::tiletype tt = *Maps::getTileType(p->pos);
-            if (ENUM_ATTR(tiletype, material, tt) == tiletype_material::TREE &&
-                    ENUM_ATTR(tiletype, shape, tt) == tiletype_shape::WALL &&
-                    !Maps::getTileDesignation(p->pos)->bits.hidden &&
-                    !Plan::spiral_search(p->pos, 1, [](df::coord t) -> bool
-                        {
-                            df::tile_designation *td = Maps::getTileDesignation(t);
-                            return td && td->bits.flow_size > 0;
-                        }).isValid() &&
-                    Plan::spiral_search(p->pos, 1, is_walkable).isValid())
+            df::coord pos = (*it)->pos;
+            auto seen = tree_seen.insert(std::make_pair(pos, trees_generation));
+            if (!seen.second)
             {
-                last_treelist.insert(p->pos);
+                seen.first->second = trees_generation;
+                continue;
             }
+            int32_t dx = pos.x - origin.x;
+            int32_t dy = pos.y - origin.y;
+            int32_t dz = pos.z - origin.z;
+            tree_key key;
+            key.score = dx * dx + dy * dy + dz * dz * 16;
+            key.pos = pos;
+            trees.insert(key);
         }
     };
-
-    last_treelist.clear();
     add_from_vector(world->plants.tree_dry);
     add_from_vector(world->plants.tree_wet);
 
-    return last_treelist;
+    for (auto it = trees.begin(); it != trees.end(); )
+    {
+        auto seen = tree_seen.find(it->pos);
+        if (seen->second == trees_generation)
+        {
+            it++;
+            continue;
+        }
+        tree_seen.erase(seen);
+        it = trees.erase(it);
+    }
 }
 
+// is_item_free results for the current tick by item id, each only valid
+// while the item's flags word stays the same
+struct item_free_memo
+{
+    uint32_t flags;
+    // indexed by allow_nonempty, -1 if not computed yet
+    int8_t free[2];
+};
+static std::unordered_map<int32_t, item_free_memo> item_free_cache;
+static int32_t item_free_frame = -1;
+// where the fort entrance was when the cache was filled, invalid if none
+static df::coord item_free_entrance;
+static uint16_t item_free_entrance_walkable = 0;
+
+static bool is_item_free_uncached(df::item *i, bool allow_nonempty);
+
 // check if an item is free to use
 bool Stocks::is_item_free(df::item *i, bool allow_nonempty)
+{
+    extern AI *dwarfAI; // XXX
+
+    df::coord entrance;
+    if (room *r = dwarfAI->plan->fort_entrance)
+    {
+        entrance = r->max;
+    }
+    else
+    {
+        entrance.clear();
+    }
+
+    if (item_free_frame != world->frame_counter || item_free_entrance != entrance)
+    {
+        item_free_cache.clear();
+        item_free_frame = world->frame_counter;
+        item_free_entrance = entrance;
+        if (item_free_entrance.isValid())
+        {
+            item_free_entrance_walkable = Plan::getTileWalkable(item_free_entrance);
+        }
+    }
+
+    auto memo = item_free_cache.find(i->id);
+    bool known = memo != item_free_cache.end() && memo->second.flags == i->flags.whole;
+    if (known && memo->second.free[allow_nonempty] != -1)
+    {
+        return memo->second.free[allow_nonempty];
+    }
+
+    // may recurse into the container, so look the entry up again after
+    bool result = is_item_free_uncached(i, allow_nonempty);
+
+    item_free_memo & entry = item_free_cache[i->id];
+    if (!known)
+    {
+        entry.flags = i->flags.whole;
+        entry.free[0] = -1;
+        entry.free[1] = -1;
+    }
+    entry.free[allow_nonempty] = result;
+    return result;
+}
+
+static bool is_item_free_uncached(df::item *i, bool allow_nonempty)
 {
     if (i->flags.bits.trader || // merchant's item
             i->flags.bits.in_job || // current job item
@@ -2930,7 +3304,7 @@ bool Stocks::is_item_free(df::item *i, bool allow_nonempty)
                    }
                 }
             }
-            if (virtual_cast<df::general_ref_contained_in_itemst>(*ir) && !is_item_free((*ir)->getItem(), true))
+            if (virtual_cast<df::general_ref_contained_in_itemst>(*ir) && !Stocks::is_item_free((*ir)->getItem(), true))
             {
                 return false;
             }
@@ -2958,12 +3332,10 @@ bool Stocks::is_item_free(df::item *i, bool allow_nonempty)
 
     df::coord pos = Items::getPosition(i);
 
-    extern AI *dwarfAI; // XXX
-
     // If no dwarf can walk to it from the fort entrance, it's probably up in
     // a tree or down in the caverns.
-    if (dwarfAI->plan->fort_entrance &&
-            Plan::getTileWalkable(dwarfAI->plan->fort_entrance->max) !=
+    if (item_free_entrance.isValid() &&
+            item_free_entrance_walkable !=
             Plan::getTileWalkable(pos))
     {
         return false;
@@ -2975,7 +3347,7 @@ bool Stocks::is_item_free(df::item *i, bool allow_nonempty)
 
 bool Stocks::is_metal_ore(int32_t mi)
 {
-    return world->raws.inorganics[mi]->flags.is_set(inorganic_flags::METAL_ORE);
+    return mi >= 0 && size_t(mi) < metal_ore_stones.size() && metal_ore_stones[mi];
 }
 
 bool Stocks::is_metal_ore(df::item *i)
@@ -2990,48 +3362,7 @@ bool Stocks::is_metal_ore(df::item *i)
 std::string Stocks::is_raw_coke(int32_t mi)
 {
     // mat_index => custom reaction name
-    if (raw_coke.empty())
-    {
-        for (auto r = world->raws.reactions.begin(); r != world->raws.reactions.end(); r++)
-        {
-            if ((*r)->reagents.size() != 1)
-                continue;
-
-            int32_t mat;
-
-            bool found = false;
-            for (auto rr = (*r)->reagents.begin(); rr != (*r)->reagents.end(); rr++)
-            {
-                df::reaction_reagent_itemst *rri = virtual_cast<df::reaction_reagent_itemst>(*rr);
-                if (rri && rri->item_type == item_type::BOULDER && rri->mat_type == 0)
-                {
-                    mat = rri->mat_index;
-                    found = true;
-                    break;
-                }
-            }
-            if (!found)
-                continue;
-
-            found = false;
-            for (auto rp = (*r)->products.begin(); rp != (*r)->products.end(); rp++)
-            {
-                df::reaction_product_itemst *rpi = virtual_cast<df::reaction_product_itemst>(*rp);
-                if (rpi && rpi->item_type == item_type::BAR && MaterialInfo(rpi).material->id == "COAL")
-                {
-                    found = true;
-                    break;
-                }
-            }
-            if (!found)
-                continue;
-
-            // XXX check input size vs output size ?
-            raw_coke[mat] = (*r)->code;
-            raw_coke_inv[(*r)->code] = mat;
-        }
-    }
-    return raw_coke.count(mi) ? raw_coke.at(mi) : "";
+    return mi >= 0 && size_t(mi) < raw_coke.size() ? raw_coke[mi] : "";
 }
 
 std::string Stocks::is_raw_coke(df::item *i)
@@ -3045,14 +3376,7 @@ std::string Stocks::is_raw_coke(df::item *i)
 
 bool Stocks::is_gypsum(int32_t mi)
 {
-    for (auto c = world->raws.inorganics[mi]->material.reaction_class.begin(); c != world->raws.inorganics[mi]->material.reaction_class.end(); c++)
-    {
-        if (**c == "GYPSUM")
-        {
-            return true;
-        }
-    }
-    return false;
+    return mi >= 0 && size_t(mi) < gypsum_stones.size() && gypsum_stones[mi];
 }
 
 bool Stocks::is_gypsum(df::item *i)
@@ -3084,6 +3408,11 @@ void Stocks::update_simple_metal_ores(color_ostream &)
 // return the potential number of bars available (in dimensions, eg 1 bar => 150)
 int32_t Stocks::may_forge_bars(color_ostream & out, int32_t mat_index, int32_t div)
 {
+    if (mat_index < 0 || size_t(mat_index) >= simple_metal_ores.size() || size_t(mat_index) >= bar_reactions.size())
+    {
+        return -1;
+    }
+
     int32_t can_melt = 0;
     for (auto i = world->items.other[items_other_id::BOULDER].begin(); i != world->items.other[items_other_id::BOULDER].end(); i++)
     {
@@ -3093,7 +3422,7 @@ int32_t Stocks::may_forge_bars(color_ostream & out, int32_t mat_index, int32_t d
         }
     }
 
-    if (can_melt < Watch.WatchStock.at("metal_ore") && ai->plan->past_initial_phase)
+    if (can_melt < Watch.WatchStock[stock_kind::metal_ore] && ai->plan->past_initial_phase)
     {
         for (auto k = ai->plan->map_veins.begin(); k != ai->plan->map_veins.end(); k++)
         {
@@ -3104,32 +3433,22 @@ int32_t Stocks::may_forge_bars(color_ostream & out, int32_t mat_index, int32_t d
         }
     }
 
-    if (can_melt > Watch.WatchStock.at("metal_ore"))
+    if (can_melt > Watch.WatchStock[stock_kind::metal_ore])
     {
-        return 4 * 150 * (can_melt - Watch.WatchStock.at("metal_ore"));
+        return 4 * 150 * (can_melt - Watch.WatchStock[stock_kind::metal_ore]);
     }
 
     // "make <mi> bars" customreaction
-    for (auto r = world->raws.reactions.begin(); r != world->raws.reactions.end(); r++)
+    const auto & reactions = bar_reactions[mat_index];
+    for (auto it = reactions.begin(); it != reactions.end(); it++)
     {
-        // XXX choose best reaction from all reactions
-        int32_t prod_mult = -1;
-        for (auto rp = (*r)->products.begin(); rp != (*r)->products.end(); rp++)
-        {
-            df::reaction_product_itemst *rpi = virtual_cast<df::reaction_product_itemst>(*rp);
-            if (rpi && rpi->item_type == item_type::BAR && rpi->mat_type == 0 && rpi->mat_index == mat_index)
-            {
-                prod_mult = rpi->product_dimension;
-                break;
-            }
-        }
-        if (prod_mult == -1)
-            continue;
+        df::reaction *r = it->first;
+        int32_t prod_mult = it->second;
 
         bool all = true;
         int32_t can_reaction = 30;
         bool future = false;
-        for (auto rr = (*r)->reagents.begin(); rr != (*r)->reagents.end(); rr++)
+        for (auto rr = r->reagents.begin(); rr != r->reagents.end(); rr++)
         {
             // XXX may queue forge reagents[1] even if we dont handle reagents[2]
             df::reaction_reagent_itemst *rri = virtual_cast<df::reaction_reagent_itemst>(*rr);
@@ -3154,21 +3473,8 @@ int32_t Stocks::may_forge_bars(color_ostream & out, int32_t mat_index, int32_t d
                     continue;
                 if (!is_item_free(*i))
                     continue;
-                if (!rri->reaction_class.empty())
-                {
-                    MaterialInfo mi(*i);
-                    bool found = false;
-                    for (auto c = mi.material->reaction_class.begin(); c != mi.material->reaction_class.end(); c++)
-                    {
-                        if (**c == rri->reaction_class)
-                        {
-                            found = true;
-                            break;
-                        }
-                    }
-                    if (!found)
-                        continue;
-                }
+                if (!rri->reaction_class.empty() && !has_reaction_class(MaterialInfo(*i).material, rri->reaction_class))
+                    continue;
                 if (rri->metal_ore != -1 && (*i)->getMaterial() == 0)
                 {
                     bool found = false;
@@ -3228,20 +3534,11 @@ int32_t Stocks::may_forge_bars(color_ostream & out, int32_t mat_index, int32_t d
 
             if (!future)
             {
-                bool found = false;
-                for (auto mo = world->manager_orders.begin(); mo != world->manager_orders.end(); mo++)
-                {
-                    if ((*mo)->job_type == job_type::CustomReaction && (*mo)->reaction_name == (*r)->code)
-                    {
-                        found = true;
-                        break;
-                    }
-                }
-                if (!found)
+                if (!manager_orders().by_reaction.count(r->code))
                 {
                     df::manager_order_template tmpl;
                     tmpl.job_type = job_type::CustomReaction;
-                    tmpl.reaction_name = (*r)->code;
+                    tmpl.reaction_name = r->code;
                     tmpl.item_type = item_type::NONE;
                     tmpl.item_subtype = -1;
                     tmpl.mat_type = -1;
@@ -3323,17 +3620,50 @@ void Stocks::init_manager_subtype()
 // ignore inorganics, ignore order
 int32_t Stocks::count_manager_orders_matcat(const df::job_material_category & matcat, df::job_type order)
 {
+    const auto & by_matcat = manager_orders().by_matcat_total;
+    auto jobs = by_matcat.find(matcat.whole);
+    if (jobs == by_matcat.end())
+    {
+        return 0;
+    }
     int32_t cnt = 0;
-    for (auto it = world->manager_orders.begin(); it != world->manager_orders.end(); it++)
+    for (auto it = jobs->second.begin(); it != jobs->second.end(); it++)
     {
-        if ((*it)->material_category.whole == matcat.whole && (*it)->job_type != order)
+        if (it->first != int32_t(order))
         {
-            cnt += (*it)->amount_total;
+            cnt += it->second;
         }
     }
     return cnt;
 }
 
+manager_order_amount Stocks::count_manager_orders_job(df::job_type job)
+{
+    const auto & by_job = manager_orders().by_job;
+    auto it = by_job.find(int32_t(job));
+    if (it == by_job.end())
+    {
+        return manager_order_amount();
+    }
+    return it->second;
+}
+
+static int32_t job_subtype_key(df::job_type job, int16_t item_subtype)
+{
+    return int32_t(job) << 16 | uint16_t(item_subtype);
+}
+
+manager_order_amount Stocks::count_manager_orders_job(df::job_type job, int16_t item_subtype)
+{
+    const auto & by_job_subtype = manager_orders().by_job_subtype;
+    auto it = by_job_subtype.find(job_subtype_key(job, item_subtype));
+    if (it == by_job_subtype.end())
+    {
+        return manager_order_amount();
+    }
+    return it->second;
+}
+
 void Stocks::legacy_add_manager_order(color_ostream & out, std::string order, int32_t amount, int32_t)
 {
     df::manager_order_template tmpl;
@@ -3390,19 +3720,143 @@ static bool template_equals(const T *a, const df::manager_order_template *b)
     return true;
 }
 
-int32_t Stocks::count_manager_orders(color_ostream &, const df::manager_order_template & tmpl)
+// same fields as template_equals
+template<typename T>
+static manager_order_key order_key(const T *o)
 {
-    int32_t amount = 0;
+    manager_order_key key;
+    key.packed[0] = uint64_t(uint16_t(o->job_type)) |
+        uint64_t(uint16_t(o->item_type)) << 16 |
+        uint64_t(uint16_t(o->item_subtype)) << 32 |
+        uint64_t(uint16_t(o->mat_type)) << 48;
+    key.packed[1] = uint64_t(uint32_t(o->mat_index)) |
+        uint64_t(uint32_t(o->hist_figure_id)) << 32;
+    key.packed[2] = uint64_t(o->item_category.whole) |
+        uint64_t(o->material_category.whole) << 32;
+    key.reaction_name = o->reaction_name;
+    return key;
+}
+
+manager_order_index::manager_order_index() :
+    by_template(),
+    by_job(),
+    by_job_subtype(),
+    by_matcat_total(),
+    by_inorganic_total(),
+    inorganic_total(0),
+    by_reaction(),
+    indexed(0)
+{
+}
+
+void manager_order_index::clear()
+{
+    by_template.clear();
+    by_job.clear();
+    by_job_subtype.clear();
+    by_matcat_total.clear();
+    by_inorganic_total.clear();
+    inorganic_total = 0;
+    by_reaction.clear();
+    indexed = 0;
+}
+
+static void add_amount(manager_order_amount & amount, df::manager_order *order)
+{
+    amount.orders++;
+    amount.left += order->amount_left;
+    amount.total += order->amount_total;
+}
+
+void manager_order_index::add(df::manager_order *order)
+{
+    add_amount(by_template[order_key(order)], order);
+    add_amount(by_job[int32_t(order->job_type)], order);
+    add_amount(by_job_subtype[job_subtype_key(order->job_type, order->item_subtype)], order);
+    by_matcat_total[order->material_category.whole][int32_t(order->job_type)] += order->amount_total;
+    if (order->mat_type == 0)
+    {
+        by_inorganic_total[order->mat_index] += order->amount_total;
+        inorganic_total += order->amount_total;
+    }
+    if (order->job_type == job_type::CustomReaction)
+    {
+        by_reaction[order->reaction_name]++;
+    }
+}
 
+// done once per stocks update, and whenever orders were added or removed
+// by something else than add_manager_order
+void Stocks::index_manager_orders()
+{
+    orders.clear();
     for (auto it = world->manager_orders.begin(); it != world->manager_orders.end(); it++)
     {
-        if (template_equals<df::manager_order>(*it, &tmpl))
+        orders.add(*it);
+    }
+    for (auto it = pending_orders.begin(); it != pending_orders.end(); it++)
+    {
+        orders.add(*it);
+    }
+    orders.indexed = world->manager_orders.size();
+}
+
+const manager_order_index & Stocks::manager_orders()
+{
+    if (orders.indexed != world->manager_orders.size())
+    {
+        index_manager_orders();
+    }
+    return orders;
+}
+
+int32_t Stocks::count_manager_orders(color_ostream &, const df::manager_order_template & tmpl)
+{
+    const auto & by_template = manager_orders().by_template;
+    auto it = by_template.find(order_key(&tmpl));
+    if (it == by_template.end())
+    {
+        return 0;
+    }
+    return it->second.left;
+}
+
+// returns why the game would not accept an order for tmpl, or an empty string
+static std::string invalid_manager_order(const df::manager_order_template & tmpl)
+{
+    if (tmpl.job_type == job_type::NONE || !is_valid_enum_item(tmpl.job_type))
+    {
+        return "bad job type";
+    }
+    if (tmpl.job_type == job_type::CustomReaction)
+    {
+        bool found = false;
+        for (auto r = world->raws.reactions.begin(); r != world->raws.reactions.end(); r++)
         {
-            amount += (*it)->amount_left;
+            if ((*r)->code == tmpl.reaction_name)
+            {
+                found = true;
+                break;
+            }
+        }
+        if (!found)
+        {
+            return "no such reaction: " + tmpl.reaction_name;
         }
     }
-
-    return amount;
+    if (tmpl.mat_index != -1)
+    {
+        MaterialInfo mat;
+        if (!mat.decode(tmpl.mat_type, tmpl.mat_index))
+        {
+            return stl_sprintf("no such material: %d:%d", tmpl.mat_type, tmpl.mat_index);
+        }
+    }
+    if (tmpl.hist_figure_id != -1 && !df::historical_figure::find(tmpl.hist_figure_id))
+    {
+        return stl_sprintf("no such historical figure: %d", tmpl.hist_figure_id);
+    }
+    return "";
 }
 
 void Stocks::add_manager_order(color_ostream & out, const df::manager_order_template & tmpl, int32_t amount)
@@ -3413,6 +3867,39 @@ void Stocks::add_manager_order(color_ostream & out, const df::manager_order_temp
         return;
     }
 
+    if (!config.manager_orders_ui)
+    {
+        std::string invalid = invalid_manager_order(tmpl);
+        if (!invalid.empty())
+        {
+            ai->debug(out, stl_sprintf("[ERROR] cannot add manager order for %s - %s", tmpl.job_type == job_type::CustomReaction ? tmpl.reaction_name.c_str() : ENUM_ATTR(job_type, caption, tmpl.job_type), invalid.c_str()));
+            return;
+        }
+
+        df::manager_order *order = df::allocate<df::manager_order>();
+        order->id = world->manager_order_next_id++;
+        order->job_type = tmpl.job_type;
+        order->reaction_name = tmpl.reaction_name;
+        order->item_type = tmpl.item_type;
+        order->item_subtype = tmpl.item_subtype;
+        order->mat_type = tmpl.mat_type;
+        order->mat_index = tmpl.mat_index;
+        order->item_category = tmpl.item_category;
+        order->hist_figure_id = tmpl.hist_figure_id;
+        order->material_category = tmpl.material_category;
+        order->amount_left = amount;
+        order->amount_total = amount;
+
+        if (pending_orders.empty())
+        {
+            events.onupdate_post([this](color_ostream & out) { flush_manager_orders(out); });
+        }
+        pending_orders.push_back(order);
+        orders.add(order);
+        ai->debug(out, stl_sprintf("add_manager_order(%d) %s", amount, AI::describe_job(order).c_str()));
+        return;
+    }
+
     if (!ai->is_dwarfmode_viewscreen())
     {
         ai->debug(out, stl_sprintf("cannot add manager order for %s - not on main screen", tmpl.job_type == job_type::CustomReaction ? tmpl.reaction_name.c_str() : ENUM_ATTR(job_type, caption, tmpl.job_type)));
@@ -3471,6 +3958,20 @@ void Stocks::add_manager_order(color_ostream & out, const df::manager_order_temp
     ai->debug(out, stl_sprintf("add_manager_order(%d) %s", amount, AI::describe_job(world->manager_orders.back()).c_str()));
 }
 
+// the orders are left for the manager to validate, as with orders entered
+// through the jobs screen
+void Stocks::flush_manager_orders(color_ostream &)
+{
+    bool was_indexed = orders.indexed == world->manager_orders.size();
+    world->manager_orders.insert(world->manager_orders.end(), pending_orders.begin(), pending_orders.end());
+    if (was_indexed)
+    {
+        // already counted by add_manager_order
+        orders.indexed = world->manager_orders.size();
+    }
+    pending_orders.clear();
+}
+
 std::string Stocks::furniture_order(std::string k)
 {
     const static struct different_furniture_order
@@ -3525,7 +4026,7 @@ std::string Stocks::furniture_order(std::string k)
 
 std::function<bool(df::item *)> Stocks::furniture_find(std::string k)
 {
-    if (k == "chest")
+    if (k == stock_kind::chest)
     {
         return [](df::item *item) -> bool
         {
@@ -3533,7 +4034,7 @@ std::function<bool(df::item *)> Stocks::furniture_find(std::string k)
             return i && i->mat_type == 0;
         };
     }
-    if (k == "wheelbarrow" || k == "minecart" || k == "nestbox" || k == "hive" || k == "jug" || k == "stepladder" || k == "bookcase" || k == "quire" || k == "rock_pot")
+    if (k == stock_kind::wheelbarrow || k == stock_kind::minecart || k == stock_kind::nestbox || k == stock_kind::hive || k == stock_kind::jug || k == stock_kind::stepladder || k == stock_kind::bookcase || k == stock_kind::quire || k == stock_kind::rock_pot)
     {
         if (!manager_subtype.count(furniture_order(k)))
             return [](df::item *) -> bool { return false; };
@@ -3544,14 +4045,14 @@ std::function<bool(df::item *)> Stocks::furniture_find(std::string k)
             return i && i->subtype->subtype == subtype;
         };
     }
-    if (k == "trap")
+    if (k == stock_kind::trap)
     {
         return [](df::item *i) -> bool
         {
             return virtual_cast<df::item_trappartsst>(i);
         };
     }
-    if (k == "weapon")
+    if (k == stock_kind::weapon)
     {
         return [](df::item *item) -> bool
         {
@@ -3618,126 +4119,91 @@ int32_t Stocks::find_furniture_itemcount(std::string itm)
     return n;
 }
 
-void Stocks::farmplot(color_ostream & out, room *r, bool initial)
+const std::vector<int32_t> & Stocks::farm_crops(room *r, bool subterranean, int8_t season)
 {
-    df::building_farmplotst *bld = virtual_cast<df::building_farmplotst>(r->dfbuilding());
-    if (!bld)
-        return;
-
-    bool subterranean = Maps::getTileDesignation(r->pos())->bits.subterranean;
-
-    std::vector<int32_t> may;
-    for (int32_t i = 0; i < int32_t(world->raws.plants.all.size()); i++)
-    {
-        df::plant_raw *p = world->raws.plants.all[i];
-        if (p->flags.is_set(plant_raw_flags::BIOME_SUBTERRANEAN_WATER) != subterranean)
-            continue;
-        if (p->flags.is_set(plant_raw_flags::TREE) || !p->flags.is_set(plant_raw_flags::SEED))
-            continue;
-        may.push_back(i);
-    }
+    static const std::vector<int32_t> none;
 
     // XXX 1st plot = the one with a door
     bool isfirst = !r->layout.empty();
-    for (int8_t season = 0; season < 4; season++)
+    if (r->subtype == "food")
     {
-        std::vector<int32_t> pids;
-        if (r->subtype == "food")
+        return isfirst ? drink_food_crops[subterranean][season] : food_crops[subterranean][season];
+    }
+    if (r->subtype == "cloth")
+    {
+        // only grow dyes the first field if there is no cloth crop available
+        if (isfirst && !thread_crops[subterranean][season].empty())
         {
-            for (auto i = may.begin(); i != may.end(); i++)
-            {
-                df::plant_raw *p = world->raws.plants.all[*i];
+            return thread_crops[subterranean][season];
+        }
+        return cloth_crops[subterranean][season];
+    }
+    return none;
+}
 
-                // season numbers are also the 1st 4 flags
-                if (!p->flags.is_set(df::plant_raw_flags(season)))
-                {
-                    continue;
-                }
+// pick the crop we are shortest of, counting what is already planted this
+// season, or -1 if there is no candidate
+int32_t Stocks::choose_crop(int8_t season, const std::vector<int32_t> & crops)
+{
+    bool want_drink = need_more(stock_kind::drink);
+    bool want_food = need_more(stock_kind::food);
+    bool want_cloth = need_more(stock_kind::cloth);
 
-                MaterialInfo pm(p->material_defs.type_basic_mat, p->material_defs.idx_basic_mat);
-                if (isfirst)
-                {
-                    if (pm.material->flags.is_set(material_flags::EDIBLE_RAW) && p->flags.is_set(plant_raw_flags::DRINK))
-                    {
-                        pids.push_back(*i);
-                    }
-                    continue;
-                }
-                if (pm.material->flags.is_set(material_flags::EDIBLE_RAW) || pm.material->flags.is_set(material_flags::EDIBLE_COOKED) || p->flags.is_set(plant_raw_flags::DRINK))
-                {
-                    pids.push_back(*i);
-                    continue;
-                }
-                if (p->flags.is_set(plant_raw_flags::MILL))
-                {
-                    MaterialInfo mm(p->material_defs.type_mill, p->material_defs.idx_mill);
-                    if (mm.material->flags.is_set(material_flags::EDIBLE_RAW) || mm.material->flags.is_set(material_flags::EDIBLE_COOKED))
-                    {
-                        pids.push_back(*i);
-                        continue;
-                    }
-                }
-                for (size_t bi = 0; bi < pm.material->reaction_product.id.size(); bi++)
-                {
-                    if (*pm.material->reaction_product.id[bi] == "BAG_ITEM")
-                    {
-                        MaterialInfo bm(pm.material->reaction_product.material.mat_type[bi], pm.material->reaction_product.material.mat_index[bi]);
-                        if (bm.material->flags.is_set(material_flags::EDIBLE_RAW) || bm.material->flags.is_set(material_flags::EDIBLE_COOKED))
-                        {
-                            pids.push_back(*i);
-                            break;
-                        }
-                    }
-                }
-            }
+    int32_t best = -1;
+    bool best_seeds = false;
+    int32_t best_score = 0;
+    for (auto it = crops.begin(); it != crops.end(); it++)
+    {
+        int32_t pid = *it;
+        bool has_seeds = seeds.count(pid) != 0;
+        int32_t score = plants.count(pid) ? plants.at(pid) : 0;
+        if (has_seeds)
+        {
+            score -= seeds.at(pid);
         }
-        else if (r->subtype == "cloth")
+        auto planted = farmplots.find(std::make_pair(uint8_t(season), pid));
+        if (planted != farmplots.end())
         {
-            if (isfirst)
-            {
-                for (auto i = may.begin(); i != may.end(); i++)
-                {
-                    df::plant_raw *p = world->raws.plants.all[*i];
-                    if (p->flags.is_set(df::plant_raw_flags(season)) && thread_plants.count(*i))
-                    {
-                        pids.push_back(*i);
-                    }
-                }
-            }
-            // only grow dyes the first field if there is no cloth crop available
-            if (pids.empty())
-            {
-                for (auto i = may.begin(); i != may.end(); i++)
-                {
-                    df::plant_raw *p = world->raws.plants.all[*i];
-                    if (p->flags.is_set(df::plant_raw_flags(season)) && (thread_plants.count(*i) || dye_plants.count(*i)))
-                    {
-                        pids.push_back(*i);
-                    }
-                }
-            }
+            score += 3 * 3 * 2 * planted->second;
         }
-        std::sort(pids.begin(), pids.end(), [this, season](int32_t a, int32_t b) -> bool
-                {
-                    if (seeds.count(a) && !seeds.count(b))
-                        return true;
-                    if (!seeds.count(a) && seeds.count(b))
-                        return false;
-                    int32_t ascore = plants.count(a) ? plants.at(a) : 0;
-                    int32_t bscore = plants.count(b) ? plants.at(b) : 0;
-                    if (seeds.count(a))
-                    {
-                        ascore -= seeds.at(a);
-                        bscore -= seeds.at(b);
-                    }
-                    ascore += farmplots.count(std::make_pair(season, a)) ? 3 * 3 * 2 * farmplots.at(std::make_pair(season, a)) : 0;
-                    bscore += farmplots.count(std::make_pair(season, b)) ? 3 * 3 * 2 * farmplots.at(std::make_pair(season, b)) : 0;
-                    return ascore < bscore;
-                });
+        // worth one plot of plants for each stock that is short
+        if (want_drink && world->raws.plants.all[pid]->flags.is_set(plant_raw_flags::DRINK))
+        {
+            score -= 3 * 3 * 2;
+        }
+        if (want_food && edible_plants.count(pid))
+        {
+            score -= 3 * 3 * 2;
+        }
+        if (want_cloth && thread_plants.count(pid))
+        {
+            score -= 3 * 3 * 2;
+        }
+
+        if (best == -1 || (has_seeds && !best_seeds) || (has_seeds == best_seeds && score < best_score))
+        {
+            best = pid;
+            best_seeds = has_seeds;
+            best_score = score;
+        }
+    }
+    return best;
+}
+
+void Stocks::farmplot(color_ostream & out, room *r, bool initial)
+{
+    df::building_farmplotst *bld = virtual_cast<df::building_farmplotst>(r->dfbuilding());
+    if (!bld)
+        return;
+
+    bool subterranean = Maps::getTileDesignation(r->pos())->bits.subterranean;
 
-        if (pids.empty())
+    for (int8_t season = 0; season < 4; season++)
+    {
+        int32_t pid = choose_crop(season, farm_crops(r, subterranean, season));
+        if (pid == -1)
         {
-            if (!isfirst && complained_about_no_plants.insert(std::make_tuple(r->subtype, subterranean, season)).second)
+            if (r->layout.empty() && complained_about_no_plants.insert(std::make_tuple(r->subtype, subterranean, season)).second)
             {
                 ai->debug(out, stl_sprintf("[ERROR] stocks: no legal plants for %s farm plot (%s) for season %d", r->subtype.c_str(), subterranean ? "underground" : "outdoor", season));
             }
@@ -3747,11 +4213,45 @@ void Stocks::farmplot(color_ostream & out, room *r, bool initial)
             if (!initial)
             {
                 farmplots[std::make_pair(season, bld->plant_id[season])]--;
-                farmplots[std::make_pair(season, pids[0])]++;
+                farmplots[std::make_pair(season, pid)]++;
             }
-            bld->plant_id[season] = pids[0];
+            bld->plant_id[season] = pid;
+        }
+    }
+}
+
+// choose the crops of every farm plot in one go: farmplots is rebuilt as the
+// plots are assigned, so plots of the same kind spread over the candidates
+// instead of each one settling on the same crop
+void Stocks::plan_farmplots(color_ostream & out)
+{
+    std::vector<room *> plots;
+    ai->plan->find_room(room_type::farmplot, [&plots](room *r) -> bool
+            {
+                if (virtual_cast<df::building_farmplotst>(r->dfbuilding()))
+                {
+                    plots.push_back(r);
+                }
+                return false; // search all farm plots
+            });
+    // the first plots have the shortest candidate lists, serve them first
+    std::stable_sort(plots.begin(), plots.end(), [](room *a, room *b) -> bool
+            {
+                return !a->layout.empty() && b->layout.empty();
+            });
+
+    farmplots.clear();
+    for (auto it = plots.begin(); it != plots.end(); it++)
+    {
+        farmplot(out, *it, true);
+
+        df::building_farmplotst *bld = virtual_cast<df::building_farmplotst>((*it)->dfbuilding());
+        for (uint8_t season = 0; season < 4; season++)
+        {
+            farmplots[std::make_pair(season, bld->plant_id[season])]++;
         }
     }
+    updating_farmplots = false;
 }
 
 void Stocks::queue_slab(color_ostream & out, int32_t histfig_id)
@@ -3775,13 +4275,13 @@ void Stocks::queue_slab(color_ostream & out, int32_t histfig_id)
     add_manager_order(out, tmpl);
 }
 
-bool Stocks::need_more(std::string type)
+bool Stocks::need_more(stock_kind::kind type)
 {
-    int32_t want = Watch.Needed.count(type) ? num_needed(type) : Watch.WatchStock.count(type) ? Watch.WatchStock.at(type) : 10;
-    if (Watch.NeededPerDwarf.count(type))
-        want += Watch.NeededPerDwarf.at(type) * ai->pop->citizen.size() / 100 * 9;
+    int32_t want = Watch.Needed[type] ? num_needed(type) : Watch.WatchStock[type] ? Watch.WatchStock[type] : 10;
+    if (Watch.NeededPerDwarf[type])
+        want += Watch.NeededPerDwarf[type] * ai->pop->citizen.size() / 100 * 9;
 
-    return (count.count(type) ? count.at(type) : 0) < want;
+    return count[type] < want;
 }
 
 // vim: et:sw=4:ts=4
@@ -2,9 +2,11 @@
 
 #include "event_manager.h"
 
+#include <array>
 #include <map>
 #include <set>
 #include <tuple>
+#include <unordered_map>
 
 #include "df/items_other_id.h"
 #include "df/job_material_category.h"
@@ -15,20 +17,244 @@ namespace df
 {
     struct manager_order;
     struct manager_order_template;
+    struct reaction;
 }
 
 class AI;
 struct room;
 
+// every kind of stock the AI keeps count of, sorted by name
+#define STOCK_KINDS \
+    STOCK_KIND(anvil) \
+    STOCK_KIND(armor_feet) \
+    STOCK_KIND(armor_hands) \
+    STOCK_KIND(armor_head) \
+    STOCK_KIND(armor_legs) \
+    STOCK_KIND(armor_shield) \
+    STOCK_KIND(armor_torso) \
+    STOCK_KIND(armorstand) \
+    STOCK_KIND(ash) \
+    STOCK_KIND(axe) \
+    STOCK_KIND(backpack) \
+    STOCK_KIND(bag) \
+    STOCK_KIND(bag_plant) \
+    STOCK_KIND(barrel) \
+    STOCK_KIND(bed) \
+    STOCK_KIND(bin) \
+    STOCK_KIND(block) \
+    STOCK_KIND(bone) \
+    STOCK_KIND(bonebolts) \
+    STOCK_KIND(bookcase) \
+    STOCK_KIND(bucket) \
+    STOCK_KIND(cabinet) \
+    STOCK_KIND(cage) \
+    STOCK_KIND(chair) \
+    STOCK_KIND(chest) \
+    STOCK_KIND(clay) \
+    STOCK_KIND(cloth) \
+    STOCK_KIND(cloth_nodye) \
+    STOCK_KIND(clothes_feet) \
+    STOCK_KIND(clothes_hands) \
+    STOCK_KIND(clothes_head) \
+    STOCK_KIND(clothes_legs) \
+    STOCK_KIND(clothes_torso) \
+    STOCK_KIND(coal) \
+    STOCK_KIND(coffin) \
+    STOCK_KIND(coffin_bld) \
+    STOCK_KIND(coffin_bld_pet) \
+    STOCK_KIND(crossbow) \
+    STOCK_KIND(crutch) \
+    STOCK_KIND(dead_dwarf) \
+    STOCK_KIND(door) \
+    STOCK_KIND(drink) \
+    STOCK_KIND(drink_fruit) \
+    STOCK_KIND(drink_plant) \
+    STOCK_KIND(dye) \
+    STOCK_KIND(dye_plant) \
+    STOCK_KIND(dye_seeds) \
+    STOCK_KIND(flask) \
+    STOCK_KIND(floodgate) \
+    STOCK_KIND(food) \
+    STOCK_KIND(food_ingredients) \
+    STOCK_KIND(giant_corkscrew) \
+    STOCK_KIND(goblet) \
+    STOCK_KIND(gypsum) \
+    STOCK_KIND(hive) \
+    STOCK_KIND(honey) \
+    STOCK_KIND(honeycomb) \
+    STOCK_KIND(jug) \
+    STOCK_KIND(leather) \
+    STOCK_KIND(lye) \
+    STOCK_KIND(mechanism) \
+    STOCK_KIND(metal_ore) \
+    STOCK_KIND(milk) \
+    STOCK_KIND(mill_plant) \
+    STOCK_KIND(minecart) \
+    STOCK_KIND(nestbox) \
+    STOCK_KIND(paper) \
+    STOCK_KIND(pick) \
+    STOCK_KIND(pipe_section) \
+    STOCK_KIND(plasterpowder) \
+    STOCK_KIND(quern) \
+    STOCK_KIND(quire) \
+    STOCK_KIND(quiver) \
+    STOCK_KIND(raw_adamantine) \
+    STOCK_KIND(raw_coke) \
+    STOCK_KIND(raw_fish) \
+    STOCK_KIND(rock_pot) \
+    STOCK_KIND(rope) \
+    STOCK_KIND(roughgem) \
+    STOCK_KIND(shell) \
+    STOCK_KIND(skull) \
+    STOCK_KIND(slab) \
+    STOCK_KIND(slurry) \
+    STOCK_KIND(slurry_plant) \
+    STOCK_KIND(soap) \
+    STOCK_KIND(splint) \
+    STOCK_KIND(stepladder) \
+    STOCK_KIND(stone) \
+    STOCK_KIND(table) \
+    STOCK_KIND(tallow) \
+    STOCK_KIND(thread_plant) \
+    STOCK_KIND(thread_seeds) \
+    STOCK_KIND(traction_bench) \
+    STOCK_KIND(weapon) \
+    STOCK_KIND(weaponrack) \
+    STOCK_KIND(wheelbarrow) \
+    STOCK_KIND(wood) \
+    STOCK_KIND(wool)
+
+namespace stock_kind
+{
+    enum kind
+    {
+#define STOCK_KIND(k) k,
+        STOCK_KINDS
+#undef STOCK_KIND
+        _stock_kind_count
+    };
+
+    constexpr const char *const names[] =
+    {
+#define STOCK_KIND(k) #k,
+        STOCK_KINDS
+#undef STOCK_KIND
+    };
+
+    constexpr const char *name(kind k)
+    {
+        return names[k];
+    }
+}
+
+std::ostream & operator <<(std::ostream & stream, stock_kind::kind kind);
+bool find_stock_kind(const std::string & name, stock_kind::kind & kind);
+
+template<typename T>
+using stock_array = std::array<T, stock_kind::_stock_kind_count>;
+
+// what an item counted towards in the last census of its item vector
+struct census_item
+{
+    uint32_t flags;
+    int32_t stack;
+    // bit n is set if the item counts towards the vector's nth census key
+    uint64_t keys;
+    uint32_t seen;
+};
+
+// the fields of a manager order template that add_manager_order matches,
+// packed into integers
+struct manager_order_key
+{
+    uint64_t packed[3];
+    std::string reaction_name;
+
+    bool operator==(const manager_order_key & other) const
+    {
+        return packed[0] == other.packed[0] && packed[1] == other.packed[1] && packed[2] == other.packed[2] && reaction_name == other.reaction_name;
+    }
+
+    struct hash
+    {
+        size_t operator()(const manager_order_key & key) const
+        {
+            size_t h = std::hash<std::string>()(key.reaction_name);
+            for (size_t i = 0; i < 3; i++)
+            {
+                h = h * 31 + std::hash<uint64_t>()(key.packed[i]);
+            }
+            return h;
+        }
+    };
+};
+
+struct manager_order_amount
+{
+    int32_t orders;
+    int32_t left;
+    int32_t total;
+};
+
+// queued manager orders, summed up by template and by the fields the
+// stocks code looks at
+struct manager_order_index
+{
+    std::unordered_map<manager_order_key, manager_order_amount, manager_order_key::hash> by_template;
+    std::unordered_map<int32_t, manager_order_amount> by_job;
+    // job type in the high bits, item subtype in the low bits
+    std::unordered_map<int32_t, manager_order_amount> by_job_subtype;
+    // material category, then job type
+    std::unordered_map<uint32_t, std::unordered_map<int32_t, int32_t>> by_matcat_total;
+    // amount_total of the orders for inorganic materials, by mat_index
+    std::unordered_map<int32_t, int32_t> by_inorganic_total;
+    int32_t inorganic_total;
+    std::unordered_map<std::string, int32_t> by_reaction;
+    // number of entries of world->manager_orders in the index
+    size_t indexed;
+
+    manager_order_index();
+    void clear();
+    void add(df::manager_order *order);
+};
+
+// a tree on the map, ordered by distance from the fort entrance
+struct tree_key
+{
+    int32_t score;
+    df::coord pos;
+
+    bool operator<(const tree_key & other) const
+    {
+        if (score != other.score)
+            return score < other.score;
+        return pos < other.pos;
+    }
+};
+
 class Stocks
 {
     AI *ai;
 public:
-    std::map<std::string, int32_t> count;
+    stock_array<int32_t> count;
 private:
     OnupdateCallback *onupdate_handle;
-    std::vector<std::string> updating;
-    std::vector<std::string> updating_count;
+    std::vector<stock_kind::kind> updating;
+    std::vector<stock_kind::kind> updating_count;
+    // keys counted by walking each item vector once, see census_setup
+    std::map<df::items_other_id, std::vector<std::pair<stock_kind::kind, std::function<bool(df::item *)>>>> census;
+    std::vector<df::items_other_id> updating_census;
+    stock_array<int32_t> census_count;
+    std::unordered_map<int32_t, bool> census_free;
+    // between full censuses, only items that are new or whose flags or
+    // stack size changed are looked at again
+    std::map<df::items_other_id, std::unordered_map<int32_t, census_item>> census_items;
+    std::vector<std::pair<df::items_other_id, stock_kind::kind>> census_layout;
+    stock_array<int32_t> census_check;
+    bool census_checking;
+    int32_t census_since_full;
+    uint32_t census_generation;
+    bool census_full;
     size_t lastupdating;
     std::map<std::pair<uint8_t, int32_t>, size_t> farmplots;
     std::map<int32_t, size_t> seeds;
@@ -36,16 +262,24 @@ private:
     int32_t last_unforbidall_year;
     int32_t last_managerstall;
     df::job_type last_managerorder;
+    // orders created since the last onupdate, added to the game all at once
+    std::vector<df::manager_order *> pending_orders;
+    manager_order_index orders;
     bool updating_seeds;
     bool updating_plants;
     bool updating_corpses;
     bool updating_slabs;
-    std::vector<room *> updating_farmplots;
+    bool updating_farmplots;
 public:
     // depends on raws.itemdefs, wait until a world is loaded
     std::map<std::string, int16_t> manager_subtype;
 private:
-    std::set<df::coord, std::function<bool(df::coord, df::coord)>> last_treelist;
+    // every tree on the map, see update_trees
+    std::set<tree_key> trees;
+    // tree position => last update_trees call that saw it
+    std::map<df::coord, uint32_t> tree_seen;
+    uint32_t trees_generation;
+    df::coord trees_origin;
     df::coord last_cutpos;
     std::time_t last_warn_food;
 
@@ -58,9 +292,24 @@ private:
     std::map<int32_t, int16_t> slurry_plants;
     std::map<int32_t, int16_t> grow_plants;
     std::map<int32_t, int16_t> milk_creatures;
-    std::set<int32_t> clay_stones;
-    std::map<int32_t, std::string> raw_coke;
+    // plants giving something edible, raw, cooked, milled or bagged
+    std::set<int32_t> edible_plants;
+    // farm plot crop candidates by [subterranean][season], see update_plants
+    std::vector<int32_t> food_crops[2][4];
+    // edible raw and brewable, for the first food plot
+    std::vector<int32_t> drink_food_crops[2][4];
+    std::vector<int32_t> thread_crops[2][4];
+    // thread or dye
+    std::vector<int32_t> cloth_crops[2][4];
+    // indexed by inorganic id, see update_inorganics
+    std::vector<bool> metal_ore_stones;
+    std::vector<bool> gypsum_stones;
+    std::vector<bool> clay_stones;
+    // custom reaction turning the stone into coke
+    std::vector<std::string> raw_coke;
     std::map<std::string, int32_t> raw_coke_inv;
+    // custom reactions making bars of the metal, with the size of the bars
+    std::vector<std::vector<std::pair<df::reaction *, int32_t>>> bar_reactions;
 
     std::vector<int32_t> metal_digger_pref;
     std::vector<int32_t> metal_weapon_pref;
@@ -86,30 +335,34 @@ public:
     void update(color_ostream & out);
     void update_kitchen(color_ostream & out);
     void update_plants(color_ostream & out);
+    void update_inorganics(color_ostream & out);
     void count_seeds(color_ostream & out);
     void count_plants(color_ostream & out);
     void update_corpses(color_ostream & out);
     void update_slabs(color_ostream & out);
 
-    int32_t num_needed(const std::string & key);
-    void act(color_ostream & out, std::string key);
-    int32_t count_stocks(color_ostream & out, std::string k);
+    int32_t num_needed(stock_kind::kind key);
+    void act(color_ostream & out, stock_kind::kind key);
+    void census_setup();
+    void count_census(color_ostream & out, df::items_other_id id);
+    void census_finish(color_ostream & out);
+    int32_t count_stocks(color_ostream & out, stock_kind::kind k);
     int32_t count_stocks_weapon(color_ostream & out, df::job_skill skill = job_skill::NONE);
     int32_t count_stocks_armor(color_ostream & out, df::items_other_id oidx);
     int32_t count_stocks_clothes(color_ostream & out, df::items_other_id oidx);
 
-    void queue_need(color_ostream & out, std::string what, int32_t amount);
+    void queue_need(color_ostream & out, stock_kind::kind what, int32_t amount);
     void queue_need_weapon(color_ostream & out, int32_t needed, df::job_skill skill = job_skill::NONE);
     void queue_need_armor(color_ostream & out, df::items_other_id oidx);
     void queue_need_anvil(color_ostream & out);
     void queue_need_clothes(color_ostream & out, df::items_other_id oidx);
     void queue_need_coffin_bld(color_ostream & out, int32_t amount);
-    void queue_use(color_ostream & out, std::string what, int32_t amount);
+    void queue_use(color_ostream & out, stock_kind::kind what, int32_t amount);
     void queue_use_gems(color_ostream & out, int32_t amount);
     void queue_use_metal_ore(color_ostream & out, int32_t amount);
     void queue_use_raw_coke(color_ostream & out, int32_t amount);
 
-    std::set<df::coord, std::function<bool(df::coord, df::coord)>> tree_list();
+    void update_trees();
     df::coord cuttrees(color_ostream & out, int32_t amount);
 
     static bool is_item_free(df::item *i, bool allow_nonempty = false);
@@ -125,20 +378,28 @@ public:
 
     void init_manager_subtype();
 
+    void index_manager_orders();
+    const manager_order_index & manager_orders();
     int32_t count_manager_orders_matcat(const df::job_material_category & matcat, df::job_type order = job_type::NONE);
+    manager_order_amount count_manager_orders_job(df::job_type job);
+    manager_order_amount count_manager_orders_job(df::job_type job, int16_t item_subtype);
     void legacy_add_manager_order(color_ostream & out, std::string order, int32_t amount = 1, int32_t maxmerge = 30);
     int32_t count_manager_orders(color_ostream & out, const df::manager_order_template & tmpl);
     void add_manager_order(color_ostream & out, const df::manager_order_template & tmpl, int32_t amount = 1);
+    void flush_manager_orders(color_ostream & out);
 
     std::string furniture_order(std::string k);
     std::function<bool(df::item *)> furniture_find(std::string k);
     df::item *find_furniture_item(std::string itm);
     int32_t find_furniture_itemcount(std::string itm);
 
+    const std::vector<int32_t> & farm_crops(room *r, bool subterranean, int8_t season);
+    int32_t choose_crop(int8_t season, const std::vector<int32_t> & crops);
     void farmplot(color_ostream & out, room *r, bool initial = true);
+    void plan_farmplots(color_ostream & out);
     void queue_slab(color_ostream & out, int32_t histfig_id);
 
-    bool need_more(std::string type);
+    bool need_more(stock_kind::kind type);
 };
 
 // vim: et:sw=4:ts=4